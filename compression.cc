@@ -0,0 +1,102 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "compression.h"
+
+namespace {
+
+// Setting up a deflate stream allocates several hundred kilobytes of state,
+// so every thread keeps one stream per encoding and resets it between uses.
+struct DeflateStream {
+  DeflateStream() : ready(false), level(kCompressionLevel) {}
+  ~DeflateStream() {
+    if (ready) {
+      deflateEnd(&stream);
+    }
+  }
+  z_stream stream;
+  bool ready;
+  int level;
+};
+
+thread_local DeflateStream streams[ENCODING_COUNT];
+
+z_stream *GetStream(ContentEncoding encoding, int level) {
+  DeflateStream &deflater = streams[encoding];
+  if (!deflater.ready) {
+    memset(&deflater.stream, 0, sizeof(z_stream));
+    int window = encoding == ENCODING_GZIP ? MAX_WBITS + 16 : MAX_WBITS;
+    if (deflateInit2(&deflater.stream, level, Z_DEFLATED, window, 8,
+                     Z_DEFAULT_STRATEGY) != Z_OK) {
+      return nullptr;
+    }
+    deflater.ready = true;
+    deflater.level = level;
+    return &deflater.stream;
+  }
+  if (deflateReset(&deflater.stream) != Z_OK) {
+    return nullptr;
+  }
+  if (deflater.level != level) {
+    if (deflateParams(&deflater.stream, level, Z_DEFAULT_STRATEGY) != Z_OK) {
+      return nullptr;
+    }
+    deflater.level = level;
+  }
+  return &deflater.stream;
+}
+
+} // namespace
+
+const char *GetEncodingName(ContentEncoding encoding) {
+  switch (encoding) {
+  case ENCODING_DEFLATE:
+    return "deflate";
+  case ENCODING_GZIP:
+    return "gzip";
+  default:
+    return "identity";
+  }
+}
+
+bool Compress(std::string_view input, std::string &output,
+              ContentEncoding encoding, int level) {
+  if (encoding != ENCODING_DEFLATE && encoding != ENCODING_GZIP) {
+    return false;
+  }
+  z_stream *stream = GetStream(encoding, level);
+  if (stream == nullptr) {
+    return false;
+  }
+  output.resize(deflateBound(stream, input.length()));
+  stream->next_in = (Bytef *)input.data();
+  stream->avail_in = input.length();
+  stream->next_out = (Bytef *)&output[0];
+  stream->avail_out = output.length();
+  if (deflate(stream, Z_FINISH) != Z_STREAM_END) {
+    output.clear();
+    return false;
+  }
+  output.resize(stream->total_out);
+  return true;
+}
@@ -0,0 +1,120 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "histogram.h"
+
+namespace {
+
+const uint64_t kSubBuckets = 1ULL << kHistogramPrecisionBits;
+
+unsigned GetMagnitude(uint64_t value) {
+  unsigned bits = 64 - __builtin_clzll(value | 1);
+  return bits > kHistogramPrecisionBits + 1
+             ? bits - kHistogramPrecisionBits - 1
+             : 0;
+}
+
+} // namespace
+
+LatencyHistogram::LatencyHistogram()
+    : counts_(GetIndex(UINT64_MAX) + 1, 0), count_(0), minimum_(UINT64_MAX),
+      maximum_(0), sum_(0.0) {}
+
+LatencyHistogram::~LatencyHistogram() {}
+
+size_t LatencyHistogram::GetIndex(uint64_t value) {
+  unsigned magnitude = GetMagnitude(value);
+  if (magnitude == 0) {
+    return value;
+  }
+  return (magnitude + 1) * kSubBuckets + ((value >> magnitude) - kSubBuckets);
+}
+
+uint64_t LatencyHistogram::GetHighestEquivalent(size_t index) {
+  if (index < 2 * kSubBuckets) {
+    return index;
+  }
+  unsigned magnitude = index / kSubBuckets - 1;
+  uint64_t lowest = (kSubBuckets + index % kSubBuckets) << magnitude;
+  return lowest + ((1ULL << magnitude) - 1);
+}
+
+void LatencyHistogram::Record(uint64_t value, uint64_t count) {
+  if (count == 0) {
+    return;
+  }
+  counts_[GetIndex(value)] += count;
+  count_ += count;
+  minimum_ = std::min(minimum_, value);
+  maximum_ = std::max(maximum_, value);
+  sum_ += (double)value * count;
+}
+
+void LatencyHistogram::Merge(const LatencyHistogram &histogram) {
+  if (histogram.count_ == 0) {
+    return;
+  }
+  for (size_t i = 0; i < counts_.size(); i++) {
+    counts_[i] += histogram.counts_[i];
+  }
+  count_ += histogram.count_;
+  minimum_ = std::min(minimum_, histogram.minimum_);
+  maximum_ = std::max(maximum_, histogram.maximum_);
+  sum_ += histogram.sum_;
+}
+
+void LatencyHistogram::Reset() {
+  std::fill(counts_.begin(), counts_.end(), 0);
+  count_ = 0;
+  minimum_ = UINT64_MAX;
+  maximum_ = 0;
+  sum_ = 0.0;
+}
+
+uint64_t LatencyHistogram::GetPercentile(double percentile) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  percentile = std::min(std::max(percentile, 0.0), 100.0);
+  uint64_t rank = (uint64_t)(percentile / 100.0 * count_ + 0.5);
+  rank = std::max(rank, (uint64_t)1);
+  uint64_t seen = 0;
+  for (size_t i = 0; i < counts_.size(); i++) {
+    seen += counts_[i];
+    if (seen >= rank) {
+      return std::min(GetHighestEquivalent(i), maximum_);
+    }
+  }
+  return maximum_;
+}
+
+uint64_t LatencyHistogram::GetMinimum() const {
+  return count_ == 0 ? 0 : minimum_;
+}
+
+uint64_t LatencyHistogram::GetMaximum() const { return maximum_; }
+
+double LatencyHistogram::GetMean() const {
+  return count_ == 0 ? 0.0 : sum_ / count_;
+}
+
+uint64_t LatencyHistogram::Count() const { return count_; }
@@ -0,0 +1,57 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdlib>
+#include <vector>
+
+const unsigned kHistogramPrecisionBits = 10;
+
+// Log-linear histogram in the spirit of HdrHistogram. Values below
+// 2^(kHistogramPrecisionBits + 1) are counted exactly, larger values land in
+// buckets whose width is a power of two, which keeps the relative error
+// below 2^-kHistogramPrecisionBits (three significant digits).
+class LatencyHistogram {
+public:
+  LatencyHistogram();
+  virtual ~LatencyHistogram();
+  void Record(uint64_t value, uint64_t count = 1);
+  void Merge(const LatencyHistogram &histogram);
+  void Reset();
+  uint64_t GetPercentile(double percentile) const;
+  uint64_t GetMinimum() const;
+  uint64_t GetMaximum() const;
+  double GetMean() const;
+  uint64_t Count() const;
+
+private:
+  static size_t GetIndex(uint64_t value);
+  static uint64_t GetHighestEquivalent(size_t index);
+  std::vector<uint64_t> counts_;
+  uint64_t count_;
+  uint64_t minimum_;
+  uint64_t maximum_;
+  double sum_;
+};
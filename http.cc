@@ -53,6 +53,8 @@ std::string HttpConstants::GetStatusString(int status) {
       insert(std::make_pair(UNPROCESSABLE_ENTITY, "Unprocessable Entity"));
       insert(std::make_pair(LOCKED, "Locked"));
       insert(std::make_pair(TOO_MANY_REQUESTS, "Too Many Requests"));
+      insert(std::make_pair(REQUEST_HEADER_FIELDS_TOO_LARGE,
+                            "Request Header Fields Too Large"));
       insert(std::make_pair(INTERNAL_SERVER_ERROR, "Internal Server Error"));
       insert(std::make_pair(NOT_IMPLEMENTED, "Not Implemented"));
       insert(std::make_pair(BAD_GATEWAY, "Bad Gateway"));
@@ -89,85 +91,245 @@ std::string HttpConstants::GetMethodString(const HttpMethod method) {
   return kStringEmpty;
 }
 
-HttpMethod HttpConstants::GetMethod(const std::string method_string) {
-  struct StaticMap : std::unordered_map<std::string, HttpMethod> {
-    StaticMap() {
-      insert(std::make_pair("INVALID", INVALID));
-      insert(std::make_pair("POST", POST));
-      insert(std::make_pair("GET", GET));
-      insert(std::make_pair("HEAD", HEAD));
-      insert(std::make_pair("PUT", PUT));
-      insert(std::make_pair("DELETE", DELETE));
-      insert(std::make_pair("CONNECT", CONNECT));
-      insert(std::make_pair("UPDATE", UPDATE));
-      insert(std::make_pair("TRACE", TRACE));
-      insert(std::make_pair("PATCH", PATCH));
-      insert(std::make_pair("OPTIONS", OPTIONS));
-    }
-  } static string_to_method;
-  auto it = string_to_method.find(method_string);
-  if (it != string_to_method.end()) {
-    return it->second;
+HttpMethod HttpConstants::GetMethod(std::string_view method_string) {
+  static const std::pair<std::string_view, HttpMethod> string_to_method[] = {
+      {"GET", GET},         {"POST", POST},       {"PUT", PUT},
+      {"DELETE", DELETE},   {"HEAD", HEAD},       {"PATCH", PATCH},
+      {"OPTIONS", OPTIONS}, {"CONNECT", CONNECT}, {"UPDATE", UPDATE},
+      {"TRACE", TRACE},     {"INVALID", INVALID}};
+  for (const auto &it : string_to_method) {
+    if (it.first == method_string) {
+      return it.second;
+    }
   }
   return INVALID;
 }
 
+// Interned names of the headers the server itself looks at. Tokens are
+// resolved once per header, so later lookups compare integers instead of
+// folding the case of both strings.
+HttpHeader HttpConstants::GetHeader(std::string_view name) {
+  for (size_t i = HEADER_OTHER + 1; i < HEADER_COUNT; i++) {
+    std::string_view candidate = GetHeaderName((HttpHeader)i);
+    if (candidate.length() == name.length() &&
+        StringEqualsNoCase(candidate, name)) {
+      return (HttpHeader)i;
+    }
+  }
+  return HEADER_OTHER;
+}
+
+std::string_view HttpConstants::GetHeaderName(HttpHeader header) {
+  static const std::string_view header_to_name[] = {
+      "",
+      "accept",
+      "accept-encoding",
+      "accept-language",
+      "allow",
+      "authorization",
+      "cache-control",
+      "connection",
+      "content-encoding",
+      "content-length",
+      "content-type",
+      "cookie",
+      "date",
+      "etag",
+      "expect",
+      "host",
+      "if-modified-since",
+      "if-none-match",
+      "last-modified",
+      "location",
+      "retry-after",
+      "server",
+      "set-cookie",
+      "transfer-encoding",
+      "user-agent",
+      "vary"};
+  static_assert(sizeof(header_to_name) / sizeof(header_to_name[0]) ==
+                    HEADER_COUNT,
+                "every header token needs a name");
+  if (header <= HEADER_OTHER || header >= HEADER_COUNT) {
+    return std::string_view();
+  }
+  return header_to_name[header];
+}
+
+std::string HttpConstants::FormatDate(time_t time) {
+  struct tm calendar;
+  char buffer[64];
+  if (gmtime_r(&time, &calendar) == nullptr) {
+    return kStringEmpty;
+  }
+  size_t length = strftime(buffer, sizeof(buffer),
+                           "%a, %d %b %Y %H:%M:%S GMT", &calendar);
+  return std::string(buffer, length);
+}
+
+time_t HttpConstants::ParseDate(std::string_view date) {
+  struct tm calendar;
+  memset(&calendar, 0, sizeof(struct tm));
+  std::string text(date);
+  const char *end = strptime(text.c_str(), "%a, %d %b %Y %H:%M:%S GMT",
+                             &calendar);
+  if (end == nullptr || *end != '\0') {
+    return (time_t)-1;
+  }
+  return timegm(&calendar);
+}
+
 HttpRequest::HttpRequest()
-    : method_(GET), url_(kStringSlash), protocol_(kHttpProtocol1_1),
-      body_(kStringEmpty) {}
+    : method_(GET), url_(kStringSlash), path_(kStringSlash),
+      query_(kStringEmpty), protocol_(kHttpProtocol1_1), body_(kStringEmpty) {}
+
+HttpRequest::HttpRequest(const HttpRequest &request)
+    : method_(request.method_), url_(request.url_), path_(request.path_),
+      query_(request.query_), protocol_(request.protocol_),
+      headers_(request.headers_), parameters_(request.parameters_),
+      body_(request.body_) {
+  Own();
+}
+
+HttpRequest &HttpRequest::operator=(const HttpRequest &request) {
+  if (this == &request) {
+    return *this;
+  }
+  Initialize();
+  method_ = request.method_;
+  url_ = request.url_;
+  path_ = request.path_;
+  query_ = request.query_;
+  protocol_ = request.protocol_;
+  headers_ = request.headers_;
+  parameters_ = request.parameters_;
+  body_ = request.body_;
+  Own();
+  return *this;
+}
 
 HttpRequest::~HttpRequest() {}
 
 void HttpRequest::Initialize() {
   method_ = GET;
   url_ = kStringSlash;
+  path_ = kStringSlash;
+  query_ = kStringEmpty;
   protocol_ = kHttpProtocol1_1;
   headers_.clear();
+  parameters_.clear();
   body_ = kStringEmpty;
+  // the largest block is kept for the next request on the connection
+  if (storage_.size() > 1) {
+    storage_.erase(storage_.begin(), std::prev(storage_.end()));
+  }
+  if (!storage_.empty() &&
+      storage_.back().capacity() > (size_t)kTcpReceiveBufferSize) {
+    storage_.clear();
+  }
+  if (!storage_.empty()) {
+    storage_.back().clear();
+  }
 }
 
 void HttpRequest::SetMethod(const HttpMethod method) { method_ = method; }
 
 const HttpMethod &HttpRequest::GetMethod() const { return method_; }
 
-void HttpRequest::SetUrl(const std::string &url) { url_ = url; }
+void HttpRequest::SetUrl(std::string_view url) {
+  parameters_.clear();
+  url_ = Keep(url);
+  SplitUrl();
+}
+
+std::string_view HttpRequest::GetUrl() const { return url_; }
 
-const std::string &HttpRequest::GetUrl() const { return url_; }
+std::string_view HttpRequest::GetPath() const { return path_; }
 
-void HttpRequest::SetProtocol(const std::string &protocol) {
-  protocol_ = protocol;
+std::string_view HttpRequest::GetQuery() const { return query_; }
+
+std::string_view HttpRequest::GetParameter(std::string_view name) const {
+  for (auto it = parameters_.begin(); it != parameters_.end(); it++) {
+    if (it->first == name) {
+      return it->second;
+    }
+  }
+  return std::string_view();
+}
+
+const size_t HttpRequest::CountParameters() const {
+  return parameters_.size();
+}
+
+void HttpRequest::SetProtocol(std::string_view protocol) {
+  protocol_ = Keep(protocol);
 }
 
-const std::string &HttpRequest::GetProtocol() const { return protocol_; }
+std::string_view HttpRequest::GetProtocol() const { return protocol_; }
 
-void HttpRequest::AddHeader(const std::string &key, const std::string &value) {
-  headers_[StringToLower(key)] = value;
+void HttpRequest::AddHeader(std::string_view key, std::string_view value) {
+  for (auto it = headers_.begin(); it != headers_.end(); it++) {
+    if (StringEqualsNoCase(it->key, key)) {
+      it->value = Keep(value);
+      return;
+    }
+  }
+  Reserve(key.length() + value.length());
+  std::string_view name = Keep(key);
+  headers_.push_back({HttpConstants::GetHeader(key), name, Keep(value)});
 }
 
-void HttpRequest::AddHeader(const std::string &key, size_t value) {
-  headers_[StringToLower(key)] = std::to_string(value);
+void HttpRequest::AddHeader(std::string_view key, size_t value) {
+  AddHeader(key, std::to_string(value));
 }
 
-const std::string HttpRequest::GetHeader(const std::string &key) const {
-  auto it = headers_.find(StringToLower(key));
-  if (it != headers_.end()) {
-    return it->second;
+std::string_view HttpRequest::GetHeader(std::string_view key) const {
+  HttpHeader header = HttpConstants::GetHeader(key);
+  if (header != HEADER_OTHER) {
+    return GetHeader(header);
   }
-  return kStringEmpty;
+  for (auto it = headers_.begin(); it != headers_.end(); it++) {
+    if (StringEqualsNoCase(it->key, key)) {
+      return it->value;
+    }
+  }
+  return std::string_view();
 }
 
-void HttpRequest::SetBody(const std::string &body) { body_ = body; }
+std::string_view HttpRequest::GetHeader(HttpHeader header) const {
+  for (auto it = headers_.begin(); it != headers_.end(); it++) {
+    if (it->token == header) {
+      return it->value;
+    }
+  }
+  return std::string_view();
+}
 
-void HttpRequest::AppendToBody(const std::string &text) { body_.append(text); }
+void HttpRequest::SetBody(std::string_view body) { body_ = Keep(body); }
+
+// A body that ends the newest block grows in place while the block has
+// room, otherwise it moves on together with the appended text.
+void HttpRequest::AppendToBody(std::string_view text) {
+  if (!storage_.empty() && !body_.empty()) {
+    std::string &block = storage_.back();
+    if (body_.data() + body_.length() == block.data() + block.length() &&
+        block.capacity() - block.length() >= text.length()) {
+      block.append(text);
+      body_ = std::string_view(body_.data(), body_.length() + text.length());
+      return;
+    }
+  }
+  body_ = Keep(body_, text);
+}
 
-const std::string &HttpRequest::GetBody() const { return body_; }
+std::string_view HttpRequest::GetBody() const { return body_; }
 
 const std::string HttpRequest::AsString() const {
   std::stringstream packet;
   packet << HttpConstants::GetMethodString(method_) << kStringSpace << url_
          << kStringSpace << protocol_ << kHttpLineFeed;
   for (auto it = headers_.begin(); it != headers_.end(); it++) {
-    packet << it->first << kStringColon << kStringSpace << it->second
+    packet << it->key << kStringColon << kStringSpace << it->value
            << kHttpLineFeed;
   }
   packet << kHttpLineFeed;
@@ -177,556 +339,3635 @@ const std::string HttpRequest::AsString() const {
 
 const size_t HttpRequest::CountHeaders() const { return headers_.size(); }
 
+// Copies every view into the request's own memory, for instance before the
+// buffer it was parsed from is reused.
+void HttpRequest::Own() {
+  size_t total = url_.length() + protocol_.length() + body_.length();
+  for (auto it = headers_.begin(); it != headers_.end(); it++) {
+    total += it->key.length() + it->value.length();
+  }
+  for (auto it = parameters_.begin(); it != parameters_.end(); it++) {
+    total += it->first.length() + it->second.length();
+  }
+  Reserve(total);
+  url_ = Keep(url_);
+  SplitUrl();
+  protocol_ = Keep(protocol_);
+  for (auto it = headers_.begin(); it != headers_.end(); it++) {
+    it->key = Keep(it->key);
+    it->value = Keep(it->value);
+  }
+  for (auto it = parameters_.begin(); it != parameters_.end(); it++) {
+    it->first = Keep(it->first);
+    it->second = Keep(it->second);
+  }
+  body_ = Keep(body_);
+}
+
+// Appends values to the newest block of owned memory. Blocks never grow
+// beyond the capacity they were reserved with, so views handed out earlier
+// stay valid, and a full block is followed by one at least twice as large.
+std::string_view HttpRequest::Keep(std::string_view first,
+                                   std::string_view second) {
+  size_t length = first.length() + second.length();
+  if (length == 0) {
+    return std::string_view();
+  }
+  Reserve(length);
+  std::string &block = storage_.back();
+  size_t offset = block.length();
+  block.append(first);
+  block.append(second);
+  return std::string_view(block.data() + offset, length);
+}
+
+void HttpRequest::Reserve(size_t length) {
+  if (!storage_.empty() &&
+      storage_.back().capacity() - storage_.back().length() >= length) {
+    return;
+  }
+  size_t capacity = kHttpRequestBlockSize;
+  if (!storage_.empty()) {
+    capacity = 2 * storage_.back().capacity();
+  }
+  storage_.emplace_back();
+  storage_.back().reserve(std::max(capacity, length));
+}
+
+void HttpRequest::SplitUrl() {
+  size_t position = url_.find('?');
+  if (position == std::string_view::npos) {
+    path_ = url_;
+    query_ = std::string_view();
+    return;
+  }
+  path_ = url_.substr(0, position);
+  query_ = url_.substr(position + 1);
+}
+
+thread_local bool HttpClock::driven_ = false;
+thread_local time_t HttpClock::second_ = 0;
+thread_local std::string HttpClock::date_;
+
+// Reactors tick their clock from the connection timer, so the Date header is
+// formatted once per second per thread instead of once per response. Threads
+// without a timer refresh the clock whenever they ask for the date.
+void HttpClock::Tick() {
+  driven_ = true;
+  Refresh(time(nullptr));
+}
+
+std::string_view HttpClock::GetDate() {
+  if (!driven_ || date_.empty()) {
+    Refresh(time(nullptr));
+  }
+  return date_;
+}
+
+void HttpClock::Refresh(time_t now) {
+  if (now == second_ && !date_.empty()) {
+    return;
+  }
+  second_ = now;
+  date_ = HttpConstants::FormatDate(now);
+}
+
 HttpResponse::HttpResponse()
     : protocol_(kHttpProtocol1_1), status_(OK),
-      message_(HttpConstants::GetStatusString(OK)), body_(kStringEmpty) {}
+      message_(HttpConstants::GetStatusString(OK)), body_(kStringEmpty),
+      file_offset_(0), file_length_(0) {}
+
+HttpResponse::HttpResponse(std::shared_ptr<const HttpPrefix> prefix)
+    : prefix_(std::move(prefix)), status_(prefix_->status), file_offset_(0),
+      file_length_(0) {}
 
 HttpResponse::~HttpResponse() {}
 
 void HttpResponse::Initialize() {
+  prefix_ = nullptr;
   protocol_ = kHttpProtocol1_1;
   status_ = OK;
   message_ = HttpConstants::GetStatusString(OK);
   headers_.clear();
   body_ = kStringEmpty;
+  shared_body_ = nullptr;
+  producer_ = nullptr;
+  file_ = nullptr;
+  file_offset_ = 0;
+  file_length_ = 0;
 }
 
 void HttpResponse::SetProtocol(const std::string &protocol) {
+  if (prefix_ != nullptr && prefix_->protocol == protocol) {
+    return;
+  }
+  Thaw();
   protocol_ = protocol;
 }
 
-const std::string &HttpResponse::GetProtocol() const { return protocol_; }
+const std::string &HttpResponse::GetProtocol() const {
+  return prefix_ != nullptr ? prefix_->protocol : protocol_;
+}
 
-void HttpResponse::SetStatus(const int status) { status_ = status; }
+void HttpResponse::SetStatus(const int status) {
+  if (prefix_ != nullptr && prefix_->status == status) {
+    return;
+  }
+  Thaw();
+  status_ = status;
+}
 
 const int HttpResponse::GetStatus() const { return status_; }
 
 void HttpResponse::SetMessage(const std::string &message) {
+  if (prefix_ != nullptr && prefix_->message == message) {
+    return;
+  }
+  Thaw();
   message_ = message;
 }
 
-const std::string &HttpResponse::GetMessage() const { return message_; }
+const std::string &HttpResponse::GetMessage() const {
+  return prefix_ != nullptr ? prefix_->message : message_;
+}
 
-void HttpResponse::AddHeader(const std::string &key, const std::string &value) {
-  headers_[StringToLower(key)] = value;
+void HttpResponse::AddHeader(std::string_view key, std::string_view value) {
+  HttpHeader header = HttpConstants::GetHeader(key);
+  size_t index = FindHeader(header, key);
+  if (index < headers_.size()) {
+    headers_[index].value.assign(value.data(), value.length());
+    return;
+  }
+  headers_.push_back({header,
+                      header == HEADER_OTHER ? std::string(key) : std::string(),
+                      std::string(value)});
 }
 
-void HttpResponse::AddHeader(const std::string &key, const size_t value) {
-  headers_[StringToLower(key)] = std::to_string(value);
+void HttpResponse::AddHeader(std::string_view key, const size_t value) {
+  char digits[24];
+  std::to_chars_result result =
+      std::to_chars(digits, digits + sizeof(digits), value);
+  AddHeader(key, std::string_view(digits, result.ptr - digits));
 }
 
-const std::string HttpResponse::GetHeader(const std::string &key) const {
-  auto it = headers_.find(StringToLower(key));
-  if (it != headers_.end()) {
-    return it->second;
+void HttpResponse::AddHeader(HttpHeader header, std::string_view value) {
+  size_t index = FindHeader(header, std::string_view());
+  if (index < headers_.size()) {
+    headers_[index].value.assign(value.data(), value.length());
+    return;
   }
-  return kStringEmpty;
+  headers_.push_back({header, std::string(), std::string(value)});
 }
 
-void HttpResponse::SetBody(const std::string &body) { body_ = body; }
-
-const std::string &HttpResponse::GetBody() const { return body_; }
-
-HttpResponse HttpResponse::Build(const int status) {
-  HttpResponse response;
-  response.SetStatus(status);
-  response.SetMessage(HttpConstants::GetStatusString(status));
-  response.AddHeader("date", time(nullptr));
-  response.AddHeader("server", "alvagis version 1.0");
-  response.AddHeader("content-length", 0);
-  return response;
+void HttpResponse::AddHeader(HttpHeader header, const size_t value) {
+  char digits[24];
+  std::to_chars_result result =
+      std::to_chars(digits, digits + sizeof(digits), value);
+  AddHeader(header, std::string_view(digits, result.ptr - digits));
 }
 
-HttpResponse HttpResponse::Build(const int status, const std::string &body) {
-  HttpResponse response;
-  response.SetStatus(status);
-  response.SetMessage(HttpConstants::GetStatusString(status));
-  response.AddHeader("date", time(nullptr));
-  response.AddHeader("server", "alvagis version 1.0");
-  response.AddHeader("content-length", body.length());
-  response.SetBody(body);
-  return response;
+std::string_view HttpResponse::GetHeader(std::string_view key) const {
+  HttpHeader header = HttpConstants::GetHeader(key);
+  if (header != HEADER_OTHER) {
+    return GetHeader(header);
+  }
+  for (auto it = headers_.begin(); it != headers_.end(); it++) {
+    if (it->token == HEADER_OTHER && StringEqualsNoCase(it->key, key)) {
+      return it->value;
+    }
+  }
+  if (prefix_ != nullptr) {
+    for (auto it = prefix_->headers.begin(); it != prefix_->headers.end();
+         it++) {
+      if (it->token == HEADER_OTHER && StringEqualsNoCase(it->key, key)) {
+        return it->value;
+      }
+    }
+  }
+  return std::string_view();
 }
 
-const std::string HttpResponse::AsString() const {
-  std::stringstream packet;
-  packet << protocol_ << kStringSpace << status_ << kStringSpace << message_
-         << kHttpLineFeed;
+std::string_view HttpResponse::GetHeader(HttpHeader header) const {
   for (auto it = headers_.begin(); it != headers_.end(); it++) {
-    packet << it->first << kStringColon << kStringSpace << it->second
-           << kHttpLineFeed;
+    if (it->token == header) {
+      return it->value;
+    }
   }
-  packet << kHttpLineFeed;
-  packet << body_;
-  return packet.str();
+  if (prefix_ != nullptr) {
+    for (auto it = prefix_->headers.begin(); it != prefix_->headers.end();
+         it++) {
+      if (it->token == header) {
+        return it->value;
+      }
+    }
+  }
+  return std::string_view();
 }
 
-HttpHandler::HttpHandler() : method_(GET), url_(kStringSlash) {}
-
-HttpHandler::HttpHandler(const HttpMethod method, const std::string &url,
-                         HttpCallback callback)
-    : method_(method), url_(url), callback_(callback) {}
-
-HttpHandler::~HttpHandler() {}
-
-void HttpHandler::SetMethod(const HttpMethod method) { method_ = method; }
+void HttpResponse::RemoveHeader(std::string_view key) {
+  size_t index = FindHeader(HttpConstants::GetHeader(key), key);
+  if (index < headers_.size()) {
+    headers_.erase(&headers_[index]);
+  }
+}
 
-const HttpMethod &HttpHandler::GetMethod() const { return method_; }
+void HttpResponse::RemoveHeader(HttpHeader header) {
+  size_t index = FindHeader(header, std::string_view());
+  if (index < headers_.size()) {
+    headers_.erase(&headers_[index]);
+  }
+}
 
-void HttpHandler::SetUrl(const std::string &url) { url_ = url; }
+const size_t HttpResponse::CountHeaders() const {
+  return headers_.size() + (prefix_ != nullptr ? prefix_->headers.size() : 0);
+}
 
-const std::string &HttpHandler::GetUrl() const { return url_; }
+// Looks a header up among the headers owned by the response. A header that
+// is still part of a frozen prefix is about to be changed by the caller, so
+// the prefix is thawed first.
+size_t HttpResponse::FindHeader(HttpHeader header, std::string_view key) {
+  if (prefix_ != nullptr) {
+    for (auto it = prefix_->headers.begin(); it != prefix_->headers.end();
+         it++) {
+      if (it->token == header &&
+          (header != HEADER_OTHER || StringEqualsNoCase(it->key, key))) {
+        Thaw();
+        break;
+      }
+    }
+  }
+  for (size_t i = 0; i < headers_.size(); i++) {
+    if (headers_[i].token != header) {
+      continue;
+    }
+    if (header != HEADER_OTHER || StringEqualsNoCase(headers_[i].key, key)) {
+      return i;
+    }
+  }
+  return headers_.size();
+}
 
-void HttpHandler::SetCallback(HttpCallback callback) { callback_ = callback; }
+// Turns a response built from a frozen prefix back into a plain response
+// whose status line and headers can all be changed.
+void HttpResponse::Thaw() {
+  if (prefix_ == nullptr) {
+    return;
+  }
+  std::shared_ptr<const HttpPrefix> prefix = std::move(prefix_);
+  prefix_ = nullptr;
+  protocol_ = prefix->protocol;
+  status_ = prefix->status;
+  message_ = prefix->message;
+  SmallVector<HttpResponseHeader, kHttpInlineHeaders> headers =
+      prefix->headers;
+  for (auto it = headers_.begin(); it != headers_.end(); it++) {
+    headers.push_back(std::move(*it));
+  }
+  headers_ = std::move(headers);
+}
 
-HttpCallback HttpHandler::GetCallback() { return callback_; }
+void HttpResponse::SetBody(const std::string &body) {
+  body_ = body;
+  shared_body_ = nullptr;
+}
 
-HttpConnection::HttpConnection(TcpSocket *socket) {
-  stage_ = START;
-  expiry_ = TimeEpochMilliseconds() + kHttpConnectionTimeout;
-  socket_ = socket;
-  reader_ = new TcpReader(socket);
-  writer_ = new TcpWriter(socket);
+// Shares a body that never changes, like a precompressed file, so that it
+// goes out as a segment of its own instead of being copied per response.
+void HttpResponse::SetBody(std::shared_ptr<const std::string> body) {
+  shared_body_ = std::move(body);
+  body_.clear();
 }
 
-HttpConnection::~HttpConnection() {
-  delete reader_;
-  delete writer_;
-  socket_->Close();
+const std::string &HttpResponse::GetBody() const {
+  return shared_body_ != nullptr ? *shared_body_ : body_;
 }
 
-const HttpStage HttpConnection::GetStage() const { return stage_; }
+HttpResponse HttpResponse::Build(const int status) {
+  std::shared_ptr<const HttpPrefix> prefix = GetPrefix(status);
+  if (prefix == nullptr) {
+    HttpResponse response;
+    response.SetStatus(status);
+    response.SetMessage(HttpConstants::GetStatusString(status));
+    response.AddHeader(HEADER_SERVER, kHttpServerName);
+    response.AddHeader(HEADER_CONTENT_LENGTH, (size_t)0);
+    return response;
+  }
+  HttpResponse response(std::move(prefix));
+  response.AddHeader(HEADER_CONTENT_LENGTH, (size_t)0);
+  return response;
+}
 
-TcpReader *HttpConnection::GetReader() { return reader_; }
+HttpResponse HttpResponse::Build(const int status, const std::string &body) {
+  HttpResponse response = Build(status);
+  response.AddHeader(HEADER_CONTENT_LENGTH, body.length());
+  response.SetBody(body);
+  return response;
+}
 
-TcpWriter *HttpConnection::GetWriter() { return writer_; }
+// Every known status gets a frozen prefix holding its status line and the
+// server header, so that Build only has to attach it to the response.
+std::shared_ptr<const HttpPrefix> HttpResponse::GetPrefix(int status) {
+  struct StaticPrefixes {
+    StaticPrefixes() {
+      for (int i = 0; i < kHttpMaximumStatus; i++) {
+        std::string message = HttpConstants::GetStatusString(i);
+        if (message.empty()) {
+          continue;
+        }
+        HttpResponse prototype;
+        prototype.SetStatus(i);
+        prototype.SetMessage(message);
+        prototype.AddHeader(HEADER_SERVER, kHttpServerName);
+        prefixes[i] = HttpTemplate::Freeze(prototype);
+      }
+    }
+    std::shared_ptr<const HttpPrefix> prefixes[kHttpMaximumStatus];
+  } static status_to_prefix;
+  if (status < 0 || status >= kHttpMaximumStatus) {
+    return nullptr;
+  }
+  return status_to_prefix.prefixes[status];
+}
 
-const HttpRequest &HttpConnection::GetRequest() { return request_; }
+const std::string HttpResponse::AsString() const {
+  std::string packet;
+  AppendHead(packet);
+  packet.append(GetBody());
+  return packet;
+}
 
-long HttpConnection::GetExpiry() { return expiry_; }
+HttpResponse HttpResponse::Stream(const int status, HttpProducer producer) {
+  HttpResponse response = Build(status);
+  response.SetProducer(producer);
+  return response;
+}
 
-void HttpConnection::Parse() {
-  static std::string token;
-  static std::string line;
-  static std::string key;
-  static std::string value;
-  static std::string content_length_string;
-  static size_t position;
-  static size_t content_length;
-  static HttpMethod method;
-  switch (stage_) {
-  case START:
-  case METHOD:
-    if ((position = reader_->GetPosition(kStringSpace)) == std::string::npos) {
-      break;
-    }
-    token = reader_->PopSegment(position);
-    if (token.empty()) {
-      stage_ = FAILED;
-      return;
-    }
-    method = HttpConstants::GetMethod(token);
-    if (method == INVALID) {
-      stage_ = FAILED;
-      return;
-    }
-    request_.SetMethod(method);
-    stage_ = URL;
-  case URL:
-    if ((position = reader_->GetPosition(kStringSpace)) == std::string::npos) {
-      return;
-    }
-    token = reader_->PopSegment(position);
-    if (token.empty() || !StringStartsWith(token, kStringSlash) || StringContains(token, kStringSlash + kStringSlash)) {
-      stage_ = FAILED;
-      return;
-    }
-    request_.SetUrl(token);
-    stage_ = PROTOCOL;
-  case PROTOCOL:
-    if ((position = reader_->GetPosition(kHttpLineFeed)) == std::string::npos) {
-      return;
-    }
-    token = reader_->PopSegment(position);
-    if (token.empty() || token.compare(kHttpProtocol1_1) != 0) {
-      stage_ = FAILED;
-      return;
-    }
-    request_.SetProtocol(kHttpProtocol1_1);
-    stage_ = HEADER;
-  case HEADER:
-    if (!reader_->IsInBuffer(kHttpDoubleLineFeed)) {
-      return;
-    }
-    for (;;) {
-      line = reader_->PopSegment(kHttpLineFeed);
-      StringTrim(line, kStringSpace);
-      if (line.empty()) {
-        break;
-      }
-      key = StringPopSegment(line, kStringColon);
-      StringTrim(key, kStringSpace);
-      if (key.empty()) {
-        stage_ = FAILED;
-        return;
-      }
-      value = line;
-      StringTrim(value, kStringSpace);
-      if (value.empty()) {
-        stage_ = FAILED;
-        return;
-      }
-      request_.AddHeader(key, value);
-    }
-    stage_ = BODY;
-  case BODY:
-    content_length_string = request_.GetHeader("content-length");
-    content_length = content_length_string.empty()
-                         ? -1
-                         : atoi(content_length_string.c_str());
-    if (content_length == -1) {
-      stage_ = END;
-      return;
-    }
-    request_.AppendToBody(
-        reader_->PopSegment(content_length - request_.GetBody().length()));
-    if (request_.GetBody().length() < content_length) {
-      return;
-    }
-    stage_ = END;
-  case END:
-    return;
-  default:
+void HttpResponse::SetProducer(HttpProducer producer) {
+  producer_ = producer;
+  if (producer_ == nullptr) {
+    RemoveHeader(HEADER_TRANSFER_ENCODING);
     return;
   }
+  RemoveHeader(HEADER_CONTENT_LENGTH);
+  AddHeader(HEADER_TRANSFER_ENCODING, "chunked");
+  body_.clear();
+  shared_body_ = nullptr;
 }
 
-void HttpConnection::Restart() {
-  stage_ = START;
-  expiry_ = TimeEpochMilliseconds() + kHttpConnectionTimeout;
-}
+const HttpProducer &HttpResponse::GetProducer() const { return producer_; }
 
-bool HttpConnection::IsGood() { return socket_->IsGood(); }
+bool HttpResponse::IsStreaming() const { return producer_ != nullptr; }
 
-HttpServer::HttpServer() : running_(false) {}
+void HttpResponse::SetFile(std::shared_ptr<TcpFile> file, off_t offset,
+                           size_t length) {
+  file_ = file;
+  file_offset_ = offset;
+  file_length_ = file_ == nullptr ? 0 : length;
+  AddHeader(HEADER_CONTENT_LENGTH, file_length_);
+  body_.clear();
+  shared_body_ = nullptr;
+}
 
-HttpServer::~HttpServer() {}
+bool HttpResponse::HasFile() const { return file_ != nullptr; }
 
-void HttpServer::RegisterHandler(HttpMethod method, const std::string &url,
-                                 HttpCallback callback) {
-  if (running_) {
+void HttpResponse::WriteTo(TcpWriter *writer) {
+  std::string &head = writer->Prepare();
+  AppendHead(head);
+  if (file_ != nullptr) {
+    writer->Write(std::move(file_), file_offset_, file_length_);
+    file_ = nullptr;
     return;
   }
-  HttpHandler handler(method, url, callback);
-  bool registered = false;
-  HandlerRange range = handlers_.equal_range(handler.GetUrl());
-  for (HandlerIterator it = range.first; it != range.second; it++) {
-    if (handler.GetMethod() == it->second.GetMethod()) {
-      registered = true;
+  if (shared_body_ != nullptr) {
+    if (shared_body_->length() <= kHttpInlineBodySize) {
+      head.append(*shared_body_);
+    } else {
+      writer->Write(std::move(shared_body_));
     }
+    shared_body_ = nullptr;
+    return;
   }
-  if (registered) {
+  if (body_.length() <= kHttpInlineBodySize) {
+    head.append(body_);
     return;
   }
-  handlers_.insert(std::make_pair(url, handler));
+  writer->Write(std::move(body_));
+  body_.clear();
 }
 
-HttpResponse HttpServer::ExecuteHandler(const HttpRequest &request) {
-  HttpResponse response = HttpResponse::Build(NOT_FOUND);
-  HandlerRange range = handlers_.equal_range(request.GetUrl());
-  for (HandlerIterator it = range.first; it != range.second; it++) {
-    if (request.GetMethod() == it->second.GetMethod()) {
-      response = (it->second.GetCallback())(request);
+// Renders the status line and headers. A frozen prefix is copied as one
+// block, and the date comes from the clock of the calling thread unless the
+// handler set its own.
+void HttpResponse::AppendHead(std::string &head) const {
+  if (!AppendFields(head, false)) {
+    head.append("date: ");
+    head.append(HttpClock::GetDate());
+    head.append(kHttpLineFeed);
+  }
+  head.append(kHttpLineFeed);
+}
+
+// Renders the status line and every header, and tells whether one of them
+// was a date. A head that is recorded for replay leaves out the date and
+// the connection header, both of which belong to the moment of sending.
+bool HttpResponse::AppendFields(std::string &head, bool replay) const {
+  if (prefix_ != nullptr) {
+    head.append(prefix_->bytes);
+  } else {
+    char status[16];
+    std::to_chars_result result =
+        std::to_chars(status, status + sizeof(status), status_);
+    head.append(protocol_);
+    head.append(kStringSpace);
+    head.append(status, result.ptr - status);
+    head.append(kStringSpace);
+    head.append(message_);
+    head.append(kHttpLineFeed);
+  }
+  bool dated = false;
+  for (auto it = headers_.begin(); it != headers_.end(); it++) {
+    if (replay &&
+        (it->token == HEADER_DATE || it->token == HEADER_CONNECTION)) {
+      continue;
+    }
+    if (it->token == HEADER_OTHER) {
+      head.append(it->key);
+    } else {
+      head.append(HttpConstants::GetHeaderName(it->token));
     }
+    head.append(kStringColon);
+    head.append(kStringSpace);
+    head.append(it->value);
+    head.append(kHttpLineFeed);
+    dated = dated || it->token == HEADER_DATE;
   }
+  return dated;
+}
+
+HttpTemplate::HttpTemplate(const HttpResponse &prototype)
+    : prefix_(Freeze(prototype)) {}
+
+HttpTemplate::~HttpTemplate() {}
+
+HttpResponse HttpTemplate::Build() const {
+  HttpResponse response(prefix_);
+  response.AddHeader(HEADER_CONTENT_LENGTH, (size_t)0);
   return response;
 }
 
-void HttpServer::Serve(const std::string &service, const std::string &host) {
-  bool success;
-  if (!SetupServerSocket(service, host)) {
-    printf("cannot not set up server socket\n");
-    return;
+HttpResponse HttpTemplate::Build(const std::string &body) const {
+  HttpResponse response(prefix_);
+  response.AddHeader(HEADER_CONTENT_LENGTH, body.length());
+  response.body_ = body;
+  return response;
+}
+
+HttpResponse HttpTemplate::Build(std::string &&body) const {
+  HttpResponse response(prefix_);
+  response.AddHeader(HEADER_CONTENT_LENGTH, body.length());
+  response.body_ = std::move(body);
+  return response;
+}
+
+// Pre-renders the status line and the constant headers of a prototype.
+// Content-Length depends on the body and Date on the clock, so both are
+// left out and added when a response is written.
+std::shared_ptr<const HttpPrefix>
+HttpTemplate::Freeze(const HttpResponse &prototype) {
+  std::shared_ptr<HttpPrefix> prefix = std::make_shared<HttpPrefix>();
+  prefix->protocol = prototype.GetProtocol();
+  prefix->status = prototype.GetStatus();
+  prefix->message = prototype.GetMessage();
+  SmallVector<HttpResponseHeader, kHttpInlineHeaders> headers;
+  if (prototype.prefix_ != nullptr) {
+    headers = prototype.prefix_->headers;
   }
-  if (!epoll_instance_.Create()) {
-    printf("cannot not set up epoll instance\n");
-    return;
+  for (auto it = prototype.headers_.begin(); it != prototype.headers_.end();
+       it++) {
+    headers.push_back(*it);
   }
-  if (!epoll_instance_.AddReadableDescriptor(server_socket_.GetDescriptor())) {
-    printf("cannot not add listening socket to epoll instance\n");
-    return;
+  for (auto it = headers.begin(); it != headers.end(); it++) {
+    if (it->token != HEADER_CONTENT_LENGTH && it->token != HEADER_DATE) {
+      prefix->headers.push_back(*it);
+    }
   }
-  if (sigemptyset(&sigset_) == -1) {
-    printf("cannot clear signal set\n");
-    return;
+  char status[16];
+  std::to_chars_result result =
+      std::to_chars(status, status + sizeof(status), prefix->status);
+  std::string &bytes = prefix->bytes;
+  bytes.append(prefix->protocol);
+  bytes.append(kStringSpace);
+  bytes.append(status, result.ptr - status);
+  bytes.append(kStringSpace);
+  bytes.append(prefix->message);
+  bytes.append(kHttpLineFeed);
+  for (auto it = prefix->headers.begin(); it != prefix->headers.end(); it++) {
+    if (it->token == HEADER_OTHER) {
+      bytes.append(it->key);
+    } else {
+      bytes.append(HttpConstants::GetHeaderName(it->token));
+    }
+    bytes.append(kStringColon);
+    bytes.append(kStringSpace);
+    bytes.append(it->value);
+    bytes.append(kHttpLineFeed);
   }
-  if (sigaddset(&sigset_, SIGINT) == -1 || sigaddset(&sigset_, SIGKILL) == -1 || sigaddset(&sigset_, SIGTERM) == -1) {
-    printf("cannot add signal to signal set\n");
-    return;
+  return prefix;
+}
+
+HttpCompression::HttpCompression(int level, size_t minimum)
+    : level_(level), minimum_(minimum) {}
+
+HttpCompression::~HttpCompression() {}
+
+// Compresses the body of a finished response in place. Responses that are
+// streamed, already encoded, too small or of a media type that is compressed
+// by itself are left alone, as are bodies that would not shrink.
+bool HttpCompression::Apply(ContentEncoding encoding,
+                            HttpResponse &response) const {
+  if (response.IsStreaming() || response.HasFile() ||
+      !response.GetHeader(HEADER_CONTENT_ENCODING).empty()) {
+    return false;
   }
-  if (sigprocmask(SIG_BLOCK, &sigset_, nullptr) == -1) {
-    printf("cannot block signals\n");
-    return;
+  const std::string &body = response.GetBody();
+  std::string_view type = response.GetHeader(HEADER_CONTENT_TYPE);
+  if (body.length() < minimum_ || (!type.empty() && !IsCompressible(type))) {
+    return false;
   }
-  if ((signal_descriptor_ = signalfd(-1, &sigset_, 0)) == -1) {
-    printf("cannot open signal descriptor\n");
-    return;
+  response.AddHeader(HEADER_VARY, "accept-encoding");
+  std::string compressed;
+  if (encoding == ENCODING_IDENTITY ||
+      !Compress(body, compressed, encoding, level_) ||
+      compressed.length() >= body.length()) {
+    return false;
   }
-  if (!UnblockDescriptor(signal_descriptor_)) {
-    printf("cannot set signal descriptor to nonblocking mode\n");
-    return;
+  response.AddHeader(HEADER_CONTENT_ENCODING, GetEncodingName(encoding));
+  response.AddHeader(HEADER_CONTENT_LENGTH, compressed.length());
+  response.SetBody(compressed);
+  return true;
+}
+
+int HttpCompression::GetLevel() const { return level_; }
+
+size_t HttpCompression::GetMinimum() const { return minimum_; }
+
+// Picks the coding with the highest quality. An explicit entry for a coding
+// wins over the wildcard, so "gzip;q=0, *" never answers with gzip.
+ContentEncoding HttpCompression::Negotiate(const HttpRequest &request) {
+  std::string_view text = request.GetHeader(HEADER_ACCEPT_ENCODING);
+  double qualities[ENCODING_COUNT];
+  for (size_t i = 0; i < ENCODING_COUNT; i++) {
+    qualities[i] = -1.0;
+  }
+  double wildcard = -1.0;
+  while (!text.empty()) {
+    size_t end = std::min(text.find(','), text.length());
+    std::string_view token = text.substr(0, end);
+    text = text.substr(std::min(end + 1, text.length()));
+    double quality = 1.0;
+    size_t semicolon = token.find(';');
+    if (semicolon != std::string_view::npos) {
+      size_t position = token.find("q=", semicolon);
+      if (position != std::string_view::npos) {
+        quality = strtod(std::string(token.substr(position + 2)).c_str(),
+                         nullptr);
+      }
+      token = token.substr(0, semicolon);
+    }
+    while (!token.empty() && token.front() == ' ') {
+      token.remove_prefix(1);
+    }
+    while (!token.empty() && token.back() == ' ') {
+      token.remove_suffix(1);
+    }
+    if (StringEqualsNoCase(token, "gzip") ||
+        StringEqualsNoCase(token, "x-gzip")) {
+      qualities[ENCODING_GZIP] = quality;
+    } else if (StringEqualsNoCase(token, "deflate")) {
+      qualities[ENCODING_DEFLATE] = quality;
+    } else if (token == "*") {
+      wildcard = quality;
+    }
+  }
+  ContentEncoding encoding = ENCODING_IDENTITY;
+  double best = 0.0;
+  for (ContentEncoding candidate : {ENCODING_DEFLATE, ENCODING_GZIP}) {
+    double quality =
+        qualities[candidate] < 0.0 ? wildcard : qualities[candidate];
+    if (quality > 0.0 && quality >= best) {
+      best = quality;
+      encoding = candidate;
+    }
+  }
+  return encoding;
+}
+
+bool HttpCompression::IsCompressible(std::string_view type) {
+  std::string media =
+      StringToLower(std::string(type.substr(0, type.find(';'))));
+  StringTrim(media, kStringSpace);
+  return StringStartsWith(media, "text/") || StringStopsWith(media, "+json") ||
+         StringStopsWith(media, "+xml") || media == "application/json" ||
+         media == "application/javascript" || media == "application/xml" ||
+         media == "application/wasm" || media == "image/x-icon";
+}
+
+HttpResponseCache::HttpResponseCache(long ttl, size_t capacity,
+                                     const std::vector<std::string> &headers)
+    : ttl_(ttl), capacity_(capacity), headers_(headers), size_(0), hits_(0),
+      misses_(0) {}
+
+HttpResponseCache::~HttpResponseCache() {}
+
+// Replays a fresh entry into the writer. The recorded head gets the date of
+// this moment and, on a connection that is about to close, a connection
+// header. Large bodies are shared, so a hit neither runs the handler nor
+// copies them.
+bool HttpResponseCache::Respond(const HttpRequest &request,
+                                ContentEncoding encoding, TcpWriter *writer,
+                                bool keep_alive) {
+  if (IsPersonal(request)) {
+    return false;
+  }
+  std::string key = GetKey(request, encoding);
+  long now = TimeMonotonicMilliseconds();
+  std::shared_ptr<const std::string> head;
+  std::shared_ptr<const std::string> body;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(key);
+    if (it != index_.end()) {
+      if (it->second->expires > now) {
+        entries_.splice(entries_.begin(), entries_, it->second);
+        head = it->second->head;
+        body = it->second->body;
+      } else {
+        Erase(it->second);
+      }
+    }
+  }
+  if (head == nullptr) {
+    misses_++;
+    return false;
+  }
+  hits_++;
+  std::string &segment = writer->Prepare();
+  segment.append(*head);
+  segment.append("date: ");
+  segment.append(HttpClock::GetDate());
+  segment.append(kHttpLineFeed);
+  if (!keep_alive) {
+    segment.append(HttpConstants::GetHeaderName(HEADER_CONNECTION));
+    segment.append(": close");
+    segment.append(kHttpLineFeed);
+  }
+  segment.append(kHttpLineFeed);
+  if (body->length() <= kHttpInlineBodySize) {
+    segment.append(*body);
+  } else {
+    writer->Write(std::move(body));
+  }
+  return true;
+}
+
+void HttpResponseCache::Store(const HttpRequest &request,
+                              ContentEncoding encoding,
+                              const HttpResponse &response) {
+  if (!IsShareable(response) || IsPersonal(request)) {
+    return;
+  }
+  std::string fields;
+  response.AppendFields(fields, true);
+  std::shared_ptr<const std::string> head =
+      std::make_shared<const std::string>(std::move(fields));
+  std::shared_ptr<const std::string> body =
+      response.shared_body_ != nullptr
+          ? response.shared_body_
+          : std::make_shared<const std::string>(response.GetBody());
+  size_t length = head->length() + body->length();
+  if (length > capacity_) {
+    return;
+  }
+  std::string key = GetKey(request, encoding);
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(key);
+  if (it != index_.end()) {
+    Erase(it->second);
+  }
+  while (!entries_.empty() && size_ + length > capacity_) {
+    Erase(std::prev(entries_.end()));
+  }
+  size_ += length;
+  entries_.push_front({key, std::string(request.GetPath()), std::move(head),
+                       std::move(body), TimeMonotonicMilliseconds() + ttl_});
+  index_[key] = entries_.begin();
+}
+
+void HttpResponseCache::Invalidate() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  entries_.clear();
+  index_.clear();
+  size_ = 0;
+}
+
+void HttpResponseCache::Invalidate(std::string_view path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  for (auto it = entries_.begin(); it != entries_.end();) {
+    auto entry = it++;
+    if (entry->path == path) {
+      Erase(entry);
+    }
+  }
+}
+
+size_t HttpResponseCache::GetHits() const { return hits_; }
+
+size_t HttpResponseCache::GetMisses() const { return misses_; }
+
+size_t HttpResponseCache::GetSize() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return size_;
+}
+
+size_t HttpResponseCache::Count() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  return entries_.size();
+}
+
+std::string HttpResponseCache::GetKey(const HttpRequest &request,
+                                      ContentEncoding encoding) const {
+  std::string key = HttpConstants::GetMethodString(request.GetMethod());
+  key.append(kStringSpace);
+  key.append(request.GetUrl());
+  key.append(kStringSpace);
+  key.append(GetEncodingName(encoding));
+  for (size_t i = 0; i < headers_.size(); i++) {
+    key.append(kHttpLineFeed);
+    key.append(request.GetHeader(headers_[i]));
+  }
+  return key;
+}
+
+// Requests carrying credentials may get answers meant for their user only,
+// so they bypass the cache unless the credentials are part of the key.
+bool HttpResponseCache::IsPersonal(const HttpRequest &request) const {
+  for (HttpHeader header : {HEADER_AUTHORIZATION, HEADER_COOKIE}) {
+    if (request.GetHeader(header).empty()) {
+      continue;
+    }
+    bool keyed = false;
+    for (size_t i = 0; i < headers_.size() && !keyed; i++) {
+      keyed = StringEqualsNoCase(headers_[i],
+                                 HttpConstants::GetHeaderName(header));
+    }
+    if (!keyed) {
+      return true;
+    }
+  }
+  return false;
+}
+
+// Only complete 200 responses that neither set cookies nor restrict caching
+// are shared between clients.
+bool HttpResponseCache::IsShareable(const HttpResponse &response) {
+  if (response.GetStatus() != OK || response.IsStreaming() ||
+      response.HasFile() || !response.GetHeader(HEADER_SET_COOKIE).empty()) {
+    return false;
+  }
+  std::string control =
+      StringToLower(std::string(response.GetHeader(HEADER_CACHE_CONTROL)));
+  return control.find("no-store") == std::string::npos &&
+         control.find("no-cache") == std::string::npos &&
+         control.find("private") == std::string::npos;
+}
+
+void HttpResponseCache::Erase(std::list<Entry>::iterator entry) {
+  size_ -= entry->head->length() + entry->body->length();
+  index_.erase(entry->key);
+  entries_.erase(entry);
+}
+
+HttpHandler::HttpHandler()
+    : method_(GET), url_(kStringSlash), id_(0), execution_(EXECUTE_INLINE),
+      cache_(nullptr), compression_(nullptr) {}
+
+HttpHandler::HttpHandler(const HttpMethod method, const std::string &url,
+                         HttpCallback callback)
+    : method_(method), url_(url), id_(0), callback_(callback),
+      execution_(EXECUTE_INLINE), cache_(nullptr), compression_(nullptr) {}
+
+HttpHandler::~HttpHandler() {
+  delete cache_;
+  delete compression_;
+}
+
+void HttpHandler::SetMethod(const HttpMethod method) { method_ = method; }
+
+const HttpMethod &HttpHandler::GetMethod() const { return method_; }
+
+void HttpHandler::SetUrl(const std::string &url) { url_ = url; }
+
+const std::string &HttpHandler::GetUrl() const { return url_; }
+
+void HttpHandler::SetId(size_t id) { id_ = id; }
+
+size_t HttpHandler::GetId() const { return id_; }
+
+void HttpHandler::SetCallback(HttpCallback callback) { callback_ = callback; }
+
+HttpCallback HttpHandler::GetCallback() { return callback_; }
+
+void HttpHandler::SetExecution(const HttpExecution execution) {
+  execution_ = execution;
+}
+
+const HttpExecution &HttpHandler::GetExecution() const { return execution_; }
+
+void HttpHandler::SetBodyCallback(HttpBodyCallback body_callback) {
+  body_callback_ = body_callback;
+}
+
+HttpBodyCallback HttpHandler::GetBodyCallback() { return body_callback_; }
+
+void HttpHandler::SetCache(long ttl, size_t capacity,
+                           const std::vector<std::string> &headers) {
+  delete cache_;
+  cache_ = new HttpResponseCache(ttl, capacity, headers);
+}
+
+HttpResponseCache *HttpHandler::GetCache() { return cache_; }
+
+void HttpHandler::SetCompression(int level, size_t minimum) {
+  delete compression_;
+  compression_ = new HttpCompression(level, minimum);
+}
+
+HttpCompression *HttpHandler::GetCompression() { return compression_; }
+
+bool HttpHandler::Respond(const HttpRequest &request, TcpWriter *writer,
+                          bool keep_alive) {
+  if (cache_ == nullptr) {
+    return false;
+  }
+  return cache_->Respond(request, GetEncoding(request), writer, keep_alive);
+}
+
+// Runs the callback and the response stages configured for the route. The
+// cache stores the compressed variant, so hot responses are compressed once.
+HttpResponse HttpHandler::Execute(const HttpRequest &request) {
+  HttpResponse response = callback_(request);
+  if (compression_ == nullptr && cache_ == nullptr) {
+    return response;
+  }
+  ContentEncoding encoding = GetEncoding(request);
+  if (compression_ != nullptr) {
+    compression_->Apply(encoding, response);
+  }
+  if (cache_ != nullptr) {
+    cache_->Store(request, encoding, response);
+  }
+  return response;
+}
+
+ContentEncoding HttpHandler::GetEncoding(const HttpRequest &request) const {
+  if (compression_ == nullptr) {
+    return ENCODING_IDENTITY;
+  }
+  return HttpCompression::Negotiate(request);
+}
+
+HttpParser::HttpParser() { Reset(); }
+
+HttpParser::~HttpParser() {}
+
+void HttpParser::Reset() {
+  stage_ = START;
+  status_ = OK;
+  offset_ = 0;
+  method_ = INVALID;
+  url_ = {0, 0};
+  protocol_ = {0, 0};
+  headers_.clear();
+  head_length_ = 0;
+  content_length_ = 0;
+  has_length_ = false;
+  chunked_ = false;
+  streaming_ = false;
+  chunk_stage_ = CHUNK_SIZE;
+  remaining_ = 0;
+  if (decoded_.capacity() > (size_t)kTcpReceiveBufferSize) {
+    decoded_ = std::string();
+  }
+  decoded_.clear();
+  fragment_ = std::string_view();
+}
+
+const HttpStage HttpParser::GetStage() const { return stage_; }
+
+const int HttpParser::GetStatus() const { return status_; }
+
+size_t HttpParser::GetLength() const {
+  if (stage_ != END) {
+    return 0;
+  }
+  return offset_;
+}
+
+void HttpParser::ReadHead(std::string_view data, HttpRequest &request) {
+  request.Initialize();
+  request.method_ = method_;
+  request.url_ = data.substr(url_.offset, url_.length);
+  request.SplitUrl();
+  request.protocol_ = data.substr(protocol_.offset, protocol_.length);
+  for (auto it = headers_.begin(); it != headers_.end(); it++) {
+    std::string_view key = data.substr(it->first.offset, it->first.length);
+    request.headers_.push_back(
+        {HttpConstants::GetHeader(key), key,
+         data.substr(it->second.offset, it->second.length)});
+  }
+}
+
+// Switches a parser whose head is complete to streaming. Body fragments are
+// then handed out one by one through GetFragment instead of being collected,
+// and the caller discards everything parsed so far with Release. Nothing is
+// consumed before the request ends, so decoding restarts at the body.
+void HttpParser::Stream() {
+  streaming_ = true;
+  offset_ = head_length_;
+  chunk_stage_ = CHUNK_SIZE;
+  remaining_ = content_length_;
+  decoded_.clear();
+}
+
+std::string_view HttpParser::GetFragment() const { return fragment_; }
+
+size_t HttpParser::Release() {
+  size_t length = offset_;
+  offset_ = 0;
+  head_length_ = 0;
+  return length;
+}
+
+bool HttpParser::IsChunked(std::string_view value) {
+  size_t comma = value.rfind(',');
+  if (comma != std::string_view::npos) {
+    value.remove_prefix(comma + 1);
+  }
+  while (!value.empty() && (value.front() == ' ' || value.front() == '\t')) {
+    value.remove_prefix(1);
+  }
+  return StringEqualsNoCase(value, "chunked");
+}
+
+// Decodes chunked transfer coding starting at offset_. Collected bodies are
+// appended to decoded_; in streaming mode every piece of chunk data is
+// returned as a fragment right away.
+HttpStage HttpParser::Decode(std::string_view data) {
+  size_t position;
+  for (;;) {
+    switch (chunk_stage_) {
+    case CHUNK_SIZE: {
+      if ((position = data.find(kHttpLineFeed, offset_)) ==
+          std::string_view::npos) {
+        if (data.length() - offset_ > kHttpMaximumChunkLine) {
+          return Fail();
+        }
+        return stage_;
+      }
+      size_t end = std::min(position, data.find(';', offset_));
+      remaining_ = 0;
+      for (size_t i = offset_; i < end; i++) {
+        int digit;
+        if (data[i] >= '0' && data[i] <= '9') {
+          digit = data[i] - '0';
+        } else if (data[i] >= 'a' && data[i] <= 'f') {
+          digit = data[i] - 'a' + 10;
+        } else if (data[i] >= 'A' && data[i] <= 'F') {
+          digit = data[i] - 'A' + 10;
+        } else {
+          return Fail();
+        }
+        if (remaining_ > (SIZE_MAX >> 4)) {
+          return Fail();
+        }
+        remaining_ = (remaining_ << 4) | digit;
+      }
+      if (end == offset_) {
+        return Fail();
+      }
+      if (!streaming_ &&
+          decoded_.length() + remaining_ > (size_t)kTcpMaximumPayloadSize) {
+        return Fail();
+      }
+      offset_ = position + kHttpLineFeed.length();
+      chunk_stage_ = remaining_ == 0 ? CHUNK_TRAILER : CHUNK_DATA;
+      break;
+    }
+    case CHUNK_DATA: {
+      size_t length = std::min(remaining_, data.length() - offset_);
+      if (length == 0) {
+        return stage_;
+      }
+      std::string_view piece = data.substr(offset_, length);
+      offset_ += length;
+      remaining_ -= length;
+      if (remaining_ == 0) {
+        chunk_stage_ = CHUNK_END;
+      }
+      if (streaming_) {
+        fragment_ = piece;
+        return stage_;
+      }
+      decoded_.append(piece);
+      break;
+    }
+    case CHUNK_END:
+      if (data.length() - offset_ < kHttpLineFeed.length()) {
+        return stage_;
+      }
+      if (data.substr(offset_, kHttpLineFeed.length()) != kHttpLineFeed) {
+        return Fail();
+      }
+      offset_ += kHttpLineFeed.length();
+      chunk_stage_ = CHUNK_SIZE;
+      break;
+    case CHUNK_TRAILER:
+      if ((position = data.find(kHttpLineFeed, offset_)) ==
+          std::string_view::npos) {
+        if (data.length() - offset_ > kHttpMaximumChunkLine) {
+          return Fail();
+        }
+        return stage_;
+      }
+      if (position == offset_) {
+        offset_ = position + kHttpLineFeed.length();
+        return END;
+      }
+      offset_ = position + kHttpLineFeed.length();
+      break;
+    }
+  }
+}
+
+HttpStage HttpParser::Fail(int status) {
+  stage_ = FAILED;
+  status_ = status;
+  return stage_;
+}
+
+HttpParser::Span HttpParser::Trim(std::string_view data, size_t offset,
+                                  size_t length) {
+  while (length > 0 && (data[offset] == ' ' || data[offset] == '\t')) {
+    offset++;
+    length--;
+  }
+  while (length > 0 &&
+         (data[offset + length - 1] == ' ' || data[offset + length - 1] == '\t')) {
+    length--;
+  }
+  return {offset, length};
+}
+
+HttpStage HttpParser::Parse(std::string_view data, HttpRequest &request) {
+  size_t position;
+  switch (stage_) {
+  case START:
+  case METHOD:
+    stage_ = METHOD;
+    if ((position = data.find(' ', offset_)) == std::string_view::npos) {
+      offset_ = data.length();
+      if (offset_ > kHttpMaximumMethodLength) {
+        return Fail();
+      }
+      return stage_;
+    }
+    method_ = HttpConstants::GetMethod(data.substr(0, position));
+    if (method_ == INVALID) {
+      return Fail();
+    }
+    offset_ = position + 1;
+    url_.offset = offset_;
+    stage_ = URL;
+  case URL:
+    if ((position = data.find(' ', offset_)) == std::string_view::npos) {
+      offset_ = data.length();
+      if (offset_ - url_.offset > kHttpMaximumUrlLength) {
+        return Fail(REQUEST_URI_TOO_LONG);
+      }
+      return stage_;
+    }
+    url_.length = position - url_.offset;
+    if (url_.length > kHttpMaximumUrlLength) {
+      return Fail(REQUEST_URI_TOO_LONG);
+    }
+    if (url_.length == 0 || data[url_.offset] != '/' ||
+        data.substr(url_.offset, url_.length).find("//") !=
+            std::string_view::npos) {
+      return Fail();
+    }
+    offset_ = position + 1;
+    protocol_.offset = offset_;
+    stage_ = PROTOCOL;
+  case PROTOCOL:
+    if ((position = data.find(kHttpLineFeed, offset_)) ==
+        std::string_view::npos) {
+      offset_ = std::max(protocol_.offset, data.length() - 1);
+      if (offset_ - protocol_.offset > kHttpProtocol1_1.length()) {
+        return Fail();
+      }
+      return stage_;
+    }
+    protocol_.length = position - protocol_.offset;
+    if (data.substr(protocol_.offset, protocol_.length) != kHttpProtocol1_1) {
+      return Fail();
+    }
+    offset_ = position + kHttpLineFeed.length();
+    head_length_ = offset_;
+    stage_ = HEADER;
+  case HEADER:
+    for (;;) {
+      // The header block starts right behind the request line, its size is
+      // capped on its own so that a slow stream of fields cannot pile up.
+      size_t block =
+          protocol_.offset + protocol_.length + kHttpLineFeed.length();
+      if ((position = data.find(kHttpLineFeed, offset_)) ==
+          std::string_view::npos) {
+        offset_ = std::max(head_length_, data.length() - 1);
+        if (data.length() - block > kHttpMaximumHeaderLength) {
+          return Fail(REQUEST_HEADER_FIELDS_TOO_LARGE);
+        }
+        return stage_;
+      }
+      if (position - block > kHttpMaximumHeaderLength) {
+        return Fail(REQUEST_HEADER_FIELDS_TOO_LARGE);
+      }
+      size_t start = head_length_;
+      offset_ = position + kHttpLineFeed.length();
+      head_length_ = offset_;
+      if (position == start) {
+        break;
+      }
+      std::string_view line = data.substr(start, position - start);
+      size_t colon = line.find(':');
+      if (colon == std::string_view::npos) {
+        return Fail();
+      }
+      // Field values may be empty, names may neither be empty nor carry
+      // whitespace before the colon.
+      Span key = Trim(data, start, colon);
+      Span value = Trim(data, start + colon + 1, line.length() - colon - 1);
+      if (key.length == 0 || key.offset != start || key.length != colon) {
+        return Fail();
+      }
+      headers_.push_back(std::make_pair(key, value));
+      std::string_view name = data.substr(key.offset, key.length);
+      if (StringEqualsNoCase(name, "transfer-encoding")) {
+        if (!IsChunked(data.substr(value.offset, value.length))) {
+          return Fail();
+        }
+        chunked_ = true;
+        continue;
+      }
+      if (!StringEqualsNoCase(name, "content-length")) {
+        continue;
+      }
+      size_t length = 0;
+      if (value.length == 0) {
+        return Fail();
+      }
+      for (size_t i = value.offset; i < value.offset + value.length; i++) {
+        if (data[i] < '0' || data[i] > '9' || length > (SIZE_MAX - 9) / 10) {
+          return Fail();
+        }
+        length = length * 10 + (data[i] - '0');
+      }
+      if (has_length_ && length != content_length_) {
+        return Fail();
+      }
+      content_length_ = length;
+      has_length_ = true;
+    }
+    // A body framed both ways is read differently by different servers,
+    // which is what request smuggling relies on.
+    if (chunked_ && has_length_) {
+      return Fail();
+    }
+    remaining_ = content_length_;
+    stage_ = BODY;
+    // Bodies that cannot be collected right away are left for the next call,
+    // which gives the caller a chance to stream them instead.
+    if (chunked_ || content_length_ > (size_t)kTcpMaximumPayloadSize) {
+      return stage_;
+    }
+  case BODY:
+    fragment_ = std::string_view();
+    if (streaming_) {
+      if (chunked_) {
+        if (Decode(data) == END) {
+          stage_ = END;
+        }
+        return stage_;
+      }
+      fragment_ = data.substr(offset_, std::min(remaining_,
+                                                data.length() - offset_));
+      offset_ += fragment_.length();
+      remaining_ -= fragment_.length();
+      if (remaining_ == 0) {
+        stage_ = END;
+      }
+      return stage_;
+    }
+    if (chunked_) {
+      HttpStage stage = Decode(data);
+      if (stage != END) {
+        return stage;
+      }
+    } else {
+      if (content_length_ > (size_t)kTcpMaximumPayloadSize) {
+        return Fail();
+      }
+      if (data.length() < head_length_ + content_length_) {
+        return stage_;
+      }
+      offset_ = head_length_ + content_length_;
+    }
+    ReadHead(data, request);
+    request.body_ = chunked_ ? std::string_view(decoded_)
+                             : data.substr(head_length_, content_length_);
+    stage_ = END;
+  case END:
+  default:
+    return stage_;
+  }
+}
+
+HttpConnection::HttpConnection()
+    : upload_(nullptr), inspected_(false), reader_(&socket_), writer_(&socket_),
+      timer_({nullptr, nullptr, 0, this}), id_(0), pending_(false),
+      keep_alive_(true), events_(0), operations_(0), received_(0) {}
+
+HttpConnection::~HttpConnection() { socket_.Close(); }
+
+const HttpStage HttpConnection::GetStage() const {
+  return parser_.GetStage();
+}
+
+TcpSocket *HttpConnection::GetSocket() { return &socket_; }
+
+TcpReader *HttpConnection::GetReader() { return &reader_; }
+
+TcpWriter *HttpConnection::GetWriter() { return &writer_; }
+
+HttpRequest &HttpConnection::GetRequest() { return request_; }
+
+HttpParser *HttpConnection::GetParser() { return &parser_; }
+
+int HttpConnection::GetDescriptor() { return socket_.GetDescriptor(); }
+
+TimerNode *HttpConnection::GetTimer() { return &timer_; }
+
+void HttpConnection::SetId(uint32_t id) { id_ = id; }
+
+uint32_t HttpConnection::GetId() { return id_; }
+
+void HttpConnection::SetPending(bool pending) { pending_ = pending; }
+
+bool HttpConnection::IsPending() { return pending_; }
+
+void HttpConnection::SetKeepAlive(bool keep_alive) { keep_alive_ = keep_alive; }
+
+bool HttpConnection::IsKeepAlive() { return keep_alive_; }
+
+void HttpConnection::SetEvents(int events) { events_ = events; }
+
+int HttpConnection::GetEvents() { return events_; }
+
+void HttpConnection::SetOperations(int operations) {
+  operations_ = operations;
+}
+
+int HttpConnection::GetOperations() { return operations_; }
+
+// Time in microseconds at which the reactor last read bytes from the
+// connection. Requests that are served later have been queued since then.
+void HttpConnection::SetReceived(long received) { received_ = received; }
+
+long HttpConnection::GetReceived() { return received_; }
+
+// Describes the memory at the front of the writer for a send on io_uring.
+// Returns null if a file is next in line, which goes out with sendfile once
+// the socket is writable.
+struct msghdr *HttpConnection::Gather() {
+  bool more = false;
+  size_t count = writer_.Gather(vector_, kHttpRingSegments, more);
+  if (count == 0) {
+    return nullptr;
+  }
+  memset(&message_, 0, sizeof(struct msghdr));
+  message_.msg_iov = vector_;
+  message_.msg_iovlen = count;
+  return &message_;
+}
+
+void HttpConnection::Parse() { parser_.Parse(reader_.GetBuffer(), request_); }
+
+void HttpConnection::BeginUpload(HttpHandler *handler) {
+  upload_ = handler;
+  request_.Own();
+  parser_.Stream();
+}
+
+// Hands the body fragments in the reader buffer to the upload handler and
+// drops them right away. Returns false if the handler rejects the request.
+bool HttpConnection::Upload() {
+  HttpBodyCallback callback = upload_->GetBodyCallback();
+  for (;;) {
+    if (parser_.Parse(reader_.GetBuffer(), request_) == FAILED) {
+      return true;
+    }
+    std::string_view fragment = parser_.GetFragment();
+    bool accepted = fragment.empty() || callback(request_, fragment);
+    reader_.Consume(parser_.Release());
+    if (!accepted) {
+      return false;
+    }
+    if (parser_.GetStage() == END || fragment.empty()) {
+      return true;
+    }
+  }
+}
+
+HttpHandler *HttpConnection::GetUpload() { return upload_; }
+
+bool HttpConnection::IsUploading() { return upload_ != nullptr; }
+
+void HttpConnection::SetInspected(bool inspected) { inspected_ = inspected; }
+
+bool HttpConnection::IsInspected() { return inspected_; }
+
+void HttpConnection::Respond(HttpResponse response) {
+  if (!keep_alive_ && response.GetHeader(HEADER_CONNECTION).empty()) {
+    response.AddHeader(HEADER_CONNECTION, "close");
+  }
+  response.WriteTo(&writer_);
+  producer_ = response.GetProducer();
+}
+
+// Pulls chunks from the producer of a streaming response until the body is
+// complete or the writer backlog reaches the high-water mark. Pausing there
+// bounds the memory of a connection no matter how large the body gets.
+void HttpConnection::Produce() {
+  while (producer_ != nullptr && writer_.GetLength() < kHttpHighWaterMark) {
+    std::string chunk;
+    bool more = producer_(chunk);
+    if (!chunk.empty()) {
+      char length[16];
+      std::to_chars_result result =
+          std::to_chars(length, length + sizeof(length), chunk.length(), 16);
+      std::string &segment = writer_.Prepare();
+      segment.append(length, result.ptr - length);
+      segment.append(kHttpLineFeed);
+      if (chunk.length() <= kHttpInlineBodySize) {
+        segment.append(chunk);
+        segment.append(kHttpLineFeed);
+      } else {
+        writer_.Write(std::move(chunk));
+        writer_.Write(kHttpLineFeed);
+      }
+    }
+    if (!more) {
+      writer_.Write("0" + kHttpDoubleLineFeed);
+      producer_ = nullptr;
+    }
+  }
+}
+
+bool HttpConnection::IsStreaming() { return producer_ != nullptr; }
+
+void HttpConnection::Restart() {
+  reader_.Consume(parser_.GetLength());
+  parser_.Reset();
+  upload_ = nullptr;
+  inspected_ = false;
+}
+
+void HttpConnection::Close() {
+  socket_.Close();
+  reader_.Reset();
+  writer_.Reset();
+  parser_.Reset();
+  request_.Initialize();
+  producer_ = nullptr;
+  upload_ = nullptr;
+  inspected_ = false;
+  timer_ = {nullptr, nullptr, 0, this};
+  id_ = 0;
+  pending_ = false;
+  keep_alive_ = true;
+  events_ = 0;
+  operations_ = 0;
+}
+
+bool HttpConnection::IsGood() { return socket_.IsGood(); }
+
+HttpRouter::HttpRouter() : root_(CreateNode(kStringEmpty)) {}
+
+HttpRouter::~HttpRouter() {
+  DeleteNode(root_);
+  for (size_t i = 0; i < handlers_.size(); i++) {
+    delete handlers_[i];
+  }
+}
+
+HttpHandler *HttpRouter::Insert(HttpMethod method, const std::string &url,
+                                HttpCallback callback) {
+  if (method == INVALID || (size_t)method >= kHttpMethods || url.empty() ||
+      url[0] != '/') {
+    return nullptr;
+  }
+  Node *node = root_;
+  size_t position = 0;
+  while (position < url.length()) {
+    if (url[position] == ':' || url[position] == '*') {
+      if (url[position - 1] != '/') {
+        return nullptr;
+      }
+      size_t end = url.find('/', position);
+      if (end == std::string::npos) {
+        end = url.length();
+      }
+      std::string name = url.substr(position + 1, end - position - 1);
+      if (name.empty() || name.find_first_of(":*") != std::string::npos) {
+        return nullptr;
+      }
+      if (url[position] == '*') {
+        if (end != url.length()) {
+          return nullptr;
+        }
+        if (node->wildcard == nullptr) {
+          node->wildcard = CreateNode(kStringEmpty);
+          node->wildcard->name = name;
+        }
+        if (node->wildcard->name != name) {
+          return nullptr;
+        }
+        node = node->wildcard;
+        position = end;
+        break;
+      }
+      if (node->parameter == nullptr) {
+        node->parameter = CreateNode(kStringEmpty);
+        node->parameter->name = name;
+      }
+      if (node->parameter->name != name) {
+        return nullptr;
+      }
+      node = node->parameter;
+      position = end;
+      continue;
+    }
+    size_t end = url.find_first_of(":*", position);
+    if (end == std::string::npos) {
+      end = url.length();
+    }
+    node = InsertStatic(node, url.substr(position, end - position));
+    position = end;
+  }
+  if (node->handlers[method] != nullptr) {
+    return nullptr;
+  }
+  HttpHandler *handler = new HttpHandler(method, url, callback);
+  handler->SetId(handlers_.size());
+  handlers_.push_back(handler);
+  node->handlers[method] = handler;
+  node->allow.clear();
+  for (size_t i = 0; i < kHttpMethods; i++) {
+    if (node->handlers[i] == nullptr && i != OPTIONS) {
+      continue;
+    }
+    if (!node->allow.empty()) {
+      node->allow.append(", ");
+    }
+    node->allow.append(HttpConstants::GetMethodString((HttpMethod)i));
+  }
+  return handler;
+}
+
+HttpRoute HttpRouter::Find(HttpRequest &request) {
+  HttpRoute route = {nullptr, NOT_FOUND, std::string_view()};
+  request.parameters_.clear();
+  Node *node = Match(root_, request.path_, request.parameters_);
+  if (node == nullptr) {
+    return route;
+  }
+  route.allow = node->allow;
+  if ((size_t)request.method_ < kHttpMethods &&
+      node->handlers[request.method_] != nullptr) {
+    route.handler = node->handlers[request.method_];
+    route.status = OK;
+    return route;
+  }
+  route.status = request.method_ == OPTIONS ? NO_CONTENT : METHOD_NOT_ALLOWED;
+  return route;
+}
+
+const std::vector<HttpHandler *> &HttpRouter::GetHandlers() const {
+  return handlers_;
+}
+
+HttpRouter::Node *HttpRouter::CreateNode(const std::string &prefix) {
+  Node *node = new Node();
+  node->prefix = prefix;
+  node->parameter = nullptr;
+  node->wildcard = nullptr;
+  for (size_t i = 0; i < kHttpMethods; i++) {
+    node->handlers[i] = nullptr;
+  }
+  return node;
+}
+
+void HttpRouter::DeleteNode(Node *node) {
+  if (node == nullptr) {
+    return;
+  }
+  for (size_t i = 0; i < node->children.size(); i++) {
+    DeleteNode(node->children[i]);
+  }
+  DeleteNode(node->parameter);
+  DeleteNode(node->wildcard);
+  delete node;
+}
+
+HttpRouter::Node *HttpRouter::InsertStatic(Node *node,
+                                           const std::string &text) {
+  size_t position = 0;
+  while (position < text.length()) {
+    size_t index = node->indices.find(text[position]);
+    if (index == std::string::npos) {
+      Node *child = CreateNode(text.substr(position));
+      node->indices.push_back(text[position]);
+      node->children.push_back(child);
+      return child;
+    }
+    Node *child = node->children[index];
+    size_t common = 0;
+    while (common < child->prefix.length() &&
+           position + common < text.length() &&
+           child->prefix[common] == text[position + common]) {
+      common++;
+    }
+    if (common < child->prefix.length()) {
+      Node *split = CreateNode(child->prefix.substr(0, common));
+      child->prefix = child->prefix.substr(common);
+      split->indices.push_back(child->prefix[0]);
+      split->children.push_back(child);
+      node->children[index] = split;
+      child = split;
+    }
+    position += common;
+    node = child;
+  }
+  return node;
+}
+
+HttpRouter::Node *
+HttpRouter::Match(Node *node, std::string_view path,
+                  std::vector<HttpRequest::Header> &parameters) {
+  if (path.empty() && HasHandlers(node)) {
+    return node;
+  }
+  if (!path.empty()) {
+    size_t index = node->indices.find(path[0]);
+    if (index != std::string::npos) {
+      Node *child = node->children[index];
+      if (path.compare(0, child->prefix.length(), child->prefix) == 0) {
+        Node *match =
+            Match(child, path.substr(child->prefix.length()), parameters);
+        if (match != nullptr) {
+          return match;
+        }
+      }
+    }
+  }
+  if (node->parameter != nullptr && !path.empty() && path[0] != '/') {
+    size_t end = std::min(path.find('/'), path.length());
+    parameters.push_back(
+        std::make_pair(std::string_view(node->parameter->name),
+                       path.substr(0, end)));
+    Node *match = Match(node->parameter, path.substr(end), parameters);
+    if (match != nullptr) {
+      return match;
+    }
+    parameters.pop_back();
+  }
+  if (node->wildcard != nullptr && HasHandlers(node->wildcard)) {
+    parameters.push_back(
+        std::make_pair(std::string_view(node->wildcard->name), path));
+    return node->wildcard;
+  }
+  return nullptr;
+}
+
+bool HttpRouter::HasHandlers(Node *node) {
+  for (size_t i = 0; i < kHttpMethods; i++) {
+    if (node->handlers[i] != nullptr) {
+      return true;
+    }
+  }
+  return false;
+}
+
+HttpFileCache::HttpFileCache(const std::string &directory, ThreadPool *pool)
+    : directory_(directory), pool_(pool) {}
+
+HttpFileCache::~HttpFileCache() {}
+
+HttpResponse HttpFileCache::Serve(const HttpRequest &request) {
+  std::string path(request.GetParameter("path"));
+  if (!IsSafe(path)) {
+    return HttpResponse::Build(NOT_FOUND);
+  }
+  if (path.empty() || path.back() == '/') {
+    path.append("index.html");
+  }
+  Entry entry;
+  if (!Lookup(path, entry)) {
+    return HttpResponse::Build(NOT_FOUND);
+  }
+  HttpResponse response = HttpResponse::Build(OK);
+  std::string tag = entry.tag;
+  std::shared_ptr<const std::string> variant;
+  if (HttpCompression::IsCompressible(entry.type) &&
+      entry.size >= kHttpCompressionMinimum &&
+      entry.size <= kHttpCompressionFileLimit) {
+    response.AddHeader(HEADER_VARY, "accept-encoding");
+    ContentEncoding encoding = HttpCompression::Negotiate(request);
+    if (encoding != ENCODING_IDENTITY) {
+      variant = GetVariant(path, entry, encoding);
+    }
+    if (variant != nullptr && !variant->empty()) {
+      tag.insert(tag.length() - 1,
+                 std::string("-") + GetEncodingName(encoding));
+      response.AddHeader(HEADER_CONTENT_ENCODING, GetEncodingName(encoding));
+    } else {
+      variant = nullptr;
+    }
+  }
+  response.AddHeader(HEADER_ETAG, tag);
+  response.AddHeader(HEADER_LAST_MODIFIED, entry.date);
+  if (IsNotModified(request, entry, tag)) {
+    response.SetStatus(NOT_MODIFIED);
+    response.SetMessage(HttpConstants::GetStatusString(NOT_MODIFIED));
+    response.RemoveHeader(HEADER_CONTENT_LENGTH);
+    return response;
+  }
+  response.AddHeader(HEADER_CONTENT_TYPE, entry.type);
+  if (variant != nullptr) {
+    response.AddHeader(HEADER_CONTENT_LENGTH, variant->length());
+    if (request.GetMethod() != HEAD) {
+      response.SetBody(variant);
+    }
+    return response;
+  }
+  if (request.GetMethod() == HEAD) {
+    response.AddHeader(HEADER_CONTENT_LENGTH, entry.size);
+    return response;
+  }
+  response.SetFile(entry.file, 0, entry.size);
+  return response;
+}
+
+bool HttpFileCache::Lookup(const std::string &path, Entry &entry) {
+  long now = TimeMonotonicMilliseconds();
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(path);
+    if (it != index_.end()) {
+      entries_.splice(entries_.begin(), entries_, it->second);
+      entry = *it->second;
+      if (now - entry.checked < kHttpFileCheckInterval) {
+        return true;
+      }
+    }
+  }
+  // revalidate outside the lock so a slow stat does not stall other reactors
+  std::string filename = JoinPath(directory_, path);
+  bool unchanged = entry.file != nullptr &&
+                   FileSize(filename) == (off_t)entry.size &&
+                   FileModificationTime(filename) == entry.modified;
+  if (!unchanged && !Open(filename, entry)) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto it = index_.find(path);
+    if (it != index_.end()) {
+      Erase(it->second);
+    }
+    return false;
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  auto it = index_.find(path);
+  if (it != index_.end()) {
+    // an unchanged entry keeps the variants that were built in the meantime
+    if (unchanged && it->second->file == entry.file) {
+      it->second->checked = now;
+      entry = *it->second;
+      return true;
+    }
+    Erase(it->second);
+  }
+  while (entries_.size() >= kHttpFileCacheSize) {
+    Erase(std::prev(entries_.end()));
+  }
+  entry.path = path;
+  entry.checked = now;
+  entries_.push_front(entry);
+  index_[path] = entries_.begin();
+  return true;
+}
+
+bool HttpFileCache::Open(const std::string &path, Entry &entry) {
+  int descriptor = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (descriptor == -1) {
+    return false;
+  }
+  struct stat info;
+  if (fstat(descriptor, &info) != 0 || !S_ISREG(info.st_mode)) {
+    close(descriptor);
+    return false;
+  }
+  entry.file = std::make_shared<TcpFile>(descriptor);
+  entry.size = info.st_size;
+  entry.modified = info.st_mtim.tv_sec;
+  char tag[64];
+  snprintf(tag, sizeof(tag), "\"%lx-%lx\"", (unsigned long)entry.size,
+           (unsigned long)entry.modified);
+  entry.tag = tag;
+  entry.date = HttpConstants::FormatDate(entry.modified);
+  entry.type = GetContentType(path);
+  for (size_t i = 0; i < ENCODING_COUNT; i++) {
+    entry.variants[i] = nullptr;
+  }
+  return true;
+}
+
+// Compressed variants are built once per version of a file on the thread
+// pool, so a miss never stalls the reactor that saw it. The file goes out
+// uncompressed until its variant is ready, and concurrent misses share one
+// build. An empty variant records that compression did not pay off.
+std::shared_ptr<const std::string>
+HttpFileCache::GetVariant(const std::string &path, const Entry &entry,
+                          ContentEncoding encoding) {
+  if (entry.variants[encoding] != nullptr) {
+    return entry.variants[encoding];
+  }
+  std::string key = path + kStringSpace + GetEncodingName(encoding);
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!compressing_.insert(key).second) {
+      return nullptr;
+    }
+  }
+  std::shared_ptr<TcpFile> file = entry.file;
+  size_t size = entry.size;
+  if (!pool_->Submit([this, path, file, size, encoding]() {
+        BuildVariant(path, file, size, encoding);
+      })) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    compressing_.erase(key);
+  }
+  return nullptr;
+}
+
+void HttpFileCache::BuildVariant(const std::string &path,
+                                 std::shared_ptr<TcpFile> file, size_t size,
+                                 ContentEncoding encoding) {
+  std::string content(size, '\0');
+  size_t length = 0;
+  while (length < size) {
+    ssize_t bytes = pread(file->GetDescriptor(), &content[length],
+                          size - length, length);
+    if (bytes <= 0) {
+      break;
+    }
+    length += bytes;
+  }
+  std::shared_ptr<const std::string> variant;
+  if (length == size) {
+    std::string compressed;
+    if (!Compress(content, compressed, encoding, kHttpCompressionFileLevel) ||
+        compressed.length() >= content.length()) {
+      compressed.clear();
+    }
+    variant = std::make_shared<const std::string>(std::move(compressed));
+  }
+  std::lock_guard<std::mutex> lock(mutex_);
+  compressing_.erase(path + kStringSpace + GetEncodingName(encoding));
+  auto it = index_.find(path);
+  if (variant != nullptr && it != index_.end() && it->second->file == file) {
+    it->second->variants[encoding] = variant;
+  }
+}
+
+void HttpFileCache::Erase(std::list<Entry>::iterator entry) {
+  index_.erase(entry->path);
+  entries_.erase(entry);
+}
+
+bool HttpFileCache::IsSafe(std::string_view path) {
+  if (path.find('\0') != std::string_view::npos) {
+    return false;
+  }
+  size_t position = 0;
+  while (position <= path.length()) {
+    size_t end = std::min(path.find('/', position), path.length());
+    if (path.substr(position, end - position) == "..") {
+      return false;
+    }
+    position = end + 1;
+  }
+  return true;
+}
+
+bool HttpFileCache::IsNotModified(const HttpRequest &request,
+                                  const Entry &entry, const std::string &tag) {
+  std::string match(request.GetHeader(HEADER_IF_NONE_MATCH));
+  if (!match.empty()) {
+    for (std::string &candidate : StringExplode(match, ",")) {
+      StringTrim(candidate, kStringSpace);
+      if (StringStartsWith(candidate, "W/")) {
+        candidate = candidate.substr(2);
+      }
+      if (candidate == "*" || candidate == tag) {
+        return true;
+      }
+    }
+    return false;
+  }
+  std::string_view since = request.GetHeader(HEADER_IF_MODIFIED_SINCE);
+  if (since.empty()) {
+    return false;
+  }
+  time_t date = HttpConstants::ParseDate(since);
+  return date != (time_t)-1 && entry.modified <= date;
+}
+
+std::string HttpFileCache::GetContentType(const std::string &path) {
+  static const std::pair<std::string_view, std::string_view>
+      extension_to_type[] = {
+          {".html", "text/html; charset=utf-8"},
+          {".htm", "text/html; charset=utf-8"},
+          {".css", "text/css; charset=utf-8"},
+          {".js", "text/javascript; charset=utf-8"},
+          {".mjs", "text/javascript; charset=utf-8"},
+          {".json", "application/json"},
+          {".txt", "text/plain; charset=utf-8"},
+          {".xml", "application/xml"},
+          {".svg", "image/svg+xml"},
+          {".png", "image/png"},
+          {".jpg", "image/jpeg"},
+          {".jpeg", "image/jpeg"},
+          {".gif", "image/gif"},
+          {".webp", "image/webp"},
+          {".ico", "image/x-icon"},
+          {".woff", "font/woff"},
+          {".woff2", "font/woff2"},
+          {".wasm", "application/wasm"},
+          {".pdf", "application/pdf"}};
+  size_t dot = path.rfind('.');
+  if (dot != std::string::npos && path.find('/', dot) == std::string::npos) {
+    std::string extension = StringToLower(path.substr(dot));
+    for (const auto &it : extension_to_type) {
+      if (it.first == extension) {
+        return std::string(it.second);
+      }
+    }
+  }
+  return "application/octet-stream";
+}
+
+HttpMetrics::HttpMetrics()
+    : accepted_(kMetricsInvalid), active_(kMetricsInvalid),
+      failures_(kMetricsInvalid), shed_(kMetricsInvalid),
+      throttled_(kMetricsInvalid), pauses_(kMetricsInvalid), received_(kMetricsInvalid),
+      sent_(kMetricsInvalid) {}
+
+HttpMetrics::~HttpMetrics() {}
+
+void HttpMetrics::Setup(const std::vector<HttpHandler *> &handlers) {
+  if (registry_.IsFrozen() || !latencies_.empty()) {
+    return;
+  }
+  accepted_ = registry_.AddCounter("http_connections_accepted_total",
+                                   "Client connections accepted.");
+  active_ = registry_.AddGauge("http_connections_active",
+                               "Client connections currently open.");
+  failures_ = registry_.AddCounter("http_parse_failures_total",
+                                   "Requests rejected by the parser.");
+  shed_ = registry_.AddCounter("http_requests_shed_total",
+                               "Requests rejected by admission control.");
+  throttled_ = registry_.AddCounter("http_requests_throttled_total",
+                                    "Requests rejected by the rate limit.");
+  pauses_ = registry_.AddCounter("http_accept_pauses_total",
+                                 "Times a reactor stopped accepting.");
+  received_ = registry_.AddCounter("http_received_bytes_total",
+                                   "Bytes read from client connections.");
+  sent_ = registry_.AddCounter("http_sent_bytes_total",
+                               "Bytes written to client connections.");
+  for (size_t i = 0; i <= handlers.size(); i++) {
+    std::string labels = "method=\"\",route=\"\"";
+    if (i < handlers.size()) {
+      labels = "method=\"" +
+               HttpConstants::GetMethodString(handlers[i]->GetMethod()) +
+               "\",route=\"" +
+               MetricsRegistry::Escape(handlers[i]->GetUrl()) + "\"";
+    }
+    latencies_.push_back(
+        registry_.AddHistogram("http_request_duration_seconds",
+                               "Time spent producing responses.", labels));
+    responses_.push_back(registry_.AddCounters(
+        "http_responses_total", "Responses by route and status code.", labels,
+        "code", kHttpMaximumStatus));
+  }
+}
+
+void HttpMetrics::RecordAccept() {
+  registry_.Increment(accepted_);
+  registry_.Adjust(active_, 1);
+}
+
+void HttpMetrics::RecordClose() { registry_.Adjust(active_, -1); }
+
+void HttpMetrics::RecordParseFailure() { registry_.Increment(failures_); }
+
+void HttpMetrics::RecordShed() { registry_.Increment(shed_); }
+
+void HttpMetrics::RecordThrottle() { registry_.Increment(throttled_); }
+
+void HttpMetrics::RecordPause() { registry_.Increment(pauses_); }
+
+void HttpMetrics::RecordTransfer(size_t received, size_t sent) {
+  if (received > 0) {
+    registry_.Increment(received_, received);
+  }
+  if (sent > 0) {
+    registry_.Increment(sent_, sent);
+  }
+}
+
+void HttpMetrics::RecordResponse(const HttpHandler *handler, int status,
+                                 long duration) {
+  size_t route = GetRoute(handler);
+  if (route >= latencies_.size()) {
+    return;
+  }
+  registry_.Observe(latencies_[route], std::max(duration, 0L));
+  registry_.Increment(responses_[route], 1, status);
+}
+
+std::string HttpMetrics::Render() { return registry_.Render(); }
+
+size_t HttpMetrics::GetRoute(const HttpHandler *handler) const {
+  if (handler == nullptr) {
+    return latencies_.size() - 1;
+  }
+  if (handler->GetId() + 1 >= latencies_.size()) {
+    return kMetricsInvalid;
+  }
+  return handler->GetId();
+}
+
+HttpAdmission::HttpAdmission(long target, long interval)
+    : target_(target * 1000), interval_(interval * 1000), deadline_(0),
+      minimum_(0), overloaded_(false), resetting_(false) {}
+
+HttpAdmission::~HttpAdmission() {}
+
+void HttpAdmission::Configure(long target, long interval) {
+  target_ = target * 1000;
+  interval_ = interval * 1000;
+  deadline_ = 0;
+  minimum_ = 0;
+  overloaded_ = false;
+}
+
+long HttpAdmission::GetTarget() const { return target_ / 1000; }
+
+long HttpAdmission::GetInterval() const { return interval_ / 1000; }
+
+bool HttpAdmission::Admit(long sojourn, long now) {
+  if (target_ <= 0) {
+    return true;
   }
-  if (!epoll_instance_.AddReadableDescriptor(signal_descriptor_)) {
-    printf("cannot add signal descriptor to epoll instance\n");
+  if (now > deadline_.load(std::memory_order_relaxed) &&
+      !resetting_.exchange(true, std::memory_order_acquire)) {
+    if (now > deadline_.load(std::memory_order_relaxed)) {
+      overloaded_.store(minimum_.load(std::memory_order_relaxed) > target_,
+                        std::memory_order_relaxed);
+      minimum_.store(sojourn, std::memory_order_relaxed);
+      deadline_.store(now + interval_, std::memory_order_relaxed);
+    }
+    resetting_.store(false, std::memory_order_release);
+  } else {
+    long minimum = minimum_.load(std::memory_order_relaxed);
+    while (sojourn < minimum &&
+           !minimum_.compare_exchange_weak(minimum, sojourn,
+                                           std::memory_order_relaxed)) {
+    }
+  }
+  return !overloaded_.load(std::memory_order_relaxed) ||
+         sojourn <= 2 * target_;
+}
+
+bool HttpAdmission::IsOverloaded() const { return overloaded_; }
+
+HttpRateLimiter::HttpRateLimiter(double rate, size_t burst,
+                                 const std::string &header, size_t capacity)
+    : rate_(rate), burst_(std::max(burst, (size_t)1)), header_(header),
+      token_(HttpConstants::GetHeader(header)),
+      sets_(std::max(capacity / (kHttpRateLimitShards * kHttpRateLimitWays),
+                     (size_t)1)) {
+  for (size_t i = 0; i < kHttpRateLimitShards; i++) {
+    shards_[i].buckets.assign(sets_ * kHttpRateLimitWays, {0, 0, 0.0});
+  }
+}
+
+HttpRateLimiter::~HttpRateLimiter() {}
+
+long HttpRateLimiter::Acquire(std::string_view address,
+                              const HttpRequest &request, long now) {
+  std::string_view value;
+  if (!header_.empty()) {
+    value = token_ != HEADER_OTHER ? request.GetHeader(token_)
+                                   : request.GetHeader(header_);
+  }
+  return Acquire(GetKey(address, value), now);
+}
+
+// Returns zero if the request may pass, otherwise the milliseconds until
+// the bucket of the client holds a token again.
+long HttpRateLimiter::Acquire(uint64_t key, long now) {
+  if (key == 0) {
+    key = 1;
+  }
+  Shard &shard = shards_[(key >> 32) % kHttpRateLimitShards];
+  std::lock_guard<std::mutex> lock(shard.mutex);
+  Bucket *set = &shard.buckets[(key % sets_) * kHttpRateLimitWays];
+  Bucket *bucket = nullptr;
+  Bucket *idle = set;
+  for (size_t i = 0; i < kHttpRateLimitWays; i++) {
+    if (set[i].key == key) {
+      bucket = &set[i];
+      break;
+    }
+    if (set[i].updated < idle->updated) {
+      idle = &set[i];
+    }
+  }
+  if (bucket == nullptr) {
+    bucket = idle;
+    bucket->key = key;
+    bucket->updated = now;
+    bucket->tokens = burst_;
+  } else if (now > bucket->updated) {
+    bucket->tokens = std::min(
+        burst_, bucket->tokens + (now - bucket->updated) * rate_ / 1000.0);
+    bucket->updated = now;
+  }
+  if (bucket->tokens >= 1.0) {
+    bucket->tokens -= 1.0;
+    return 0;
+  }
+  if (rate_ <= 0.0) {
+    return LONG_MAX;
+  }
+  return std::max((long)std::ceil((1.0 - bucket->tokens) * 1000.0 / rate_),
+                  1L);
+}
+
+double HttpRateLimiter::GetRate() const { return rate_; }
+
+size_t HttpRateLimiter::GetBurst() const { return (size_t)burst_; }
+
+size_t HttpRateLimiter::GetCapacity() const {
+  return sets_ * kHttpRateLimitWays * kHttpRateLimitShards;
+}
+
+uint64_t HttpRateLimiter::GetKey(std::string_view address,
+                                 std::string_view value) {
+  uint64_t key = std::hash<std::string_view>{}(address);
+  if (!value.empty()) {
+    key ^= std::hash<std::string_view>{}(value) * 0x9e3779b97f4a7c15ULL;
+  }
+  return key;
+}
+
+HttpServer::HttpServer()
+    : running_(false), workers_(std::thread::hardware_concurrency()),
+      edge_triggered_(false), backend_(BACKEND_EPOLL), maximum_connections_(0),
+      reactor_connections_(0), shed_([] {
+        HttpResponse prototype = HttpResponse::Build(SERVICE_UNAVAILABLE);
+        prototype.AddHeader(HEADER_RETRY_AFTER, kHttpRetryAfter);
+        return prototype;
+      }()),
+      rate_limiter_(nullptr), drain_timeout_(kHttpDrainTimeout),
+      draining_(false), drain_deadline_(0), signal_descriptor_(-1),
+      event_descriptor_(-1) {}
+
+HttpServer::~HttpServer() {
+  delete rate_limiter_;
+  for (size_t i = 0; i < files_.size(); i++) {
+    delete files_[i];
+  }
+}
+
+HttpHandler *HttpServer::RegisterHandler(HttpMethod method,
+                                         const std::string &url,
+                                         HttpCallback callback) {
+  if (running_) {
+    return nullptr;
+  }
+  return router_.Insert(method, url, callback);
+}
+
+HttpHandler *HttpServer::RegisterFiles(const std::string &url,
+                                       const std::string &directory) {
+  if (running_ || url.empty() || url[0] != '/' || !IsDirectory(directory)) {
+    return nullptr;
+  }
+  std::string route = url;
+  if (route.back() != '/') {
+    route.append(kStringSlash);
+  }
+  route.append("*path");
+  HttpFileCache *files = new HttpFileCache(directory, &pool_);
+  files_.push_back(files);
+  HttpCallback callback = [files](const HttpRequest &request) {
+    return files->Serve(request);
+  };
+  router_.Insert(HEAD, route, callback);
+  return router_.Insert(GET, route, callback);
+}
+
+HttpHandler *HttpServer::RegisterMetrics(const std::string &url) {
+  if (running_) {
+    return nullptr;
+  }
+  HttpMetrics *metrics = &metrics_;
+  return router_.Insert(GET, url, [metrics](const HttpRequest &request) {
+    HttpResponse response = HttpResponse::Build(OK, metrics->Render());
+    response.AddHeader(HEADER_CONTENT_TYPE, kHttpMetricsContentType);
+    response.AddHeader(HEADER_CACHE_CONTROL, "no-store");
+    return response;
+  });
+}
+
+HttpRoute HttpServer::FindRoute(HttpRequest &request) {
+  return router_.Find(request);
+}
+
+HttpResponse HttpServer::ExecuteHandler(HttpRequest &request) {
+  return ExecuteHandler(FindRoute(request), request);
+}
+
+HttpResponse HttpServer::ExecuteHandler(const HttpRoute &route,
+                                        const HttpRequest &request) {
+  if (route.handler != nullptr) {
+    long start = TimeMonotonicMicroseconds();
+    HttpResponse response = route.handler->Execute(request);
+    metrics_.RecordResponse(route.handler, response.GetStatus(),
+                            TimeMonotonicMicroseconds() - start);
+    return response;
+  }
+  HttpResponse response = HttpResponse::Build(route.status);
+  if (route.status != NOT_FOUND) {
+    response.AddHeader(HEADER_ALLOW, std::string(route.allow));
+  }
+  metrics_.RecordResponse(nullptr, route.status, 0);
+  return response;
+}
+
+void HttpServer::SetWorkers(size_t workers) {
+  if (running_) {
     return;
   }
-  if ((timer_descriptor_ = timerfd_create(CLOCK_MONOTONIC, 0)) == -1) {
-    printf("cannot open timer descriptor\n");
+  workers_ = workers;
+}
+
+void HttpServer::SetEdgeTriggered(bool edge_triggered) {
+  if (running_) {
     return;
   }
-  if (!UnblockDescriptor(timer_descriptor_)) {
-    printf("cannot set timer descriptor to nonblocking mode\n");
+  edge_triggered_ = edge_triggered;
+}
+
+bool HttpServer::IsEdgeTriggered() { return edge_triggered_; }
+
+// Reactors that cannot set up io_uring, for instance on kernels older than
+// 6.0, fall back to epoll. Edge triggering only applies to epoll.
+void HttpServer::SetBackend(HttpBackend backend) {
+  if (running_) {
+    return;
+  }
+  backend_ = backend;
+}
+
+HttpBackend HttpServer::GetBackend() { return backend_; }
+
+void HttpServer::SetMaximumConnections(size_t maximum_connections) {
+  if (running_) {
+    return;
+  }
+  maximum_connections_ = maximum_connections;
+}
+
+size_t HttpServer::GetMaximumConnections() { return maximum_connections_; }
+
+size_t HttpServer::GetReactorConnections() { return reactor_connections_; }
+
+void HttpServer::SetQueueTarget(long target, long interval) {
+  if (running_) {
+    return;
+  }
+  admission_.Configure(target, interval);
+}
+
+HttpAdmission *HttpServer::GetAdmission() { return &admission_; }
+
+// Rejections reuse a frozen 503 so that shedding costs less than serving.
+HttpResponse HttpServer::Shed() {
+  metrics_.RecordShed();
+  return shed_.Build();
+}
+
+// A rate of zero removes the limit.
+void HttpServer::SetRateLimit(double rate, size_t burst,
+                              const std::string &header, size_t capacity) {
+  if (running_) {
+    return;
+  }
+  delete rate_limiter_;
+  rate_limiter_ = nullptr;
+  if (rate > 0.0) {
+    rate_limiter_ = new HttpRateLimiter(rate, burst, header, capacity);
+  }
+}
+
+HttpRateLimiter *HttpServer::GetRateLimiter() { return rate_limiter_; }
+
+// With an upgrade path a starting server first asks a running one for its
+// listening sockets. The running server hands them over, stops accepting
+// and drains its connections, so no queued connection is ever reset.
+void HttpServer::SetUpgradePath(const std::string &path, long drain_timeout) {
+  if (running_) {
+    return;
+  }
+  upgrade_path_ = path;
+  drain_timeout_ = drain_timeout;
+}
+
+bool HttpServer::IsDraining() { return draining_; }
+
+long HttpServer::GetDrainDeadline() { return drain_deadline_; }
+
+void HttpServer::InheritListeners(std::vector<int> &listeners) {
+  listeners.clear();
+  if (upgrade_path_.empty()) {
+    return;
+  }
+  UnixSocket socket;
+  if (!socket.Connect(upgrade_path_)) {
+    LOG_DEBUG("no running server to take over from");
+    return;
+  }
+  if (!socket.ReceiveDescriptors(listeners)) {
+    LOG_WARNING("cannot receive listening sockets from running server");
+    return;
+  }
+  LOG_INFO("took over %lu listening sockets", listeners.size());
+}
+
+bool HttpServer::HandOver() {
+  UnixSocket client;
+  if (!upgrade_socket_.Accept(&client)) {
+    LOG_WARNING("cannot accept upgrade connection");
+    return false;
+  }
+  std::vector<int> listeners;
+  for (size_t i = 0; i < reactors_.size(); i++) {
+    int descriptor = reactors_[i]->GetListener();
+    if (descriptor != -1) {
+      listeners.push_back(descriptor);
+    }
+  }
+  if (!client.SendDescriptors(listeners)) {
+    LOG_ERROR("cannot hand over listening sockets");
+    return false;
+  }
+  LOG_INFO("handed over %lu listening sockets - drain connections",
+           listeners.size());
+  epoll_instance_.DeleteDescriptor(upgrade_socket_.GetDescriptor());
+  upgrade_socket_.Close();
+  drain_deadline_ = TimeMonotonicMilliseconds() + drain_timeout_;
+  draining_ = true;
+  for (size_t i = 0; i < reactors_.size(); i++) {
+    reactors_[i]->Wake();
+  }
+  return true;
+}
+
+HttpResponse HttpServer::Throttle(long wait) {
+  metrics_.RecordThrottle();
+  HttpResponse response = HttpResponse::Build(TOO_MANY_REQUESTS);
+  response.AddHeader(HEADER_RETRY_AFTER,
+                     (size_t)(wait / 1000 + (wait % 1000 != 0)));
+  return response;
+}
+
+ThreadPool *HttpServer::GetPool() { return &pool_; }
+
+HttpMetrics *HttpServer::GetMetrics() { return &metrics_; }
+
+bool HttpServer::HasPooledHandlers() {
+  const std::vector<HttpHandler *> &handlers = router_.GetHandlers();
+  for (auto it = handlers.begin(); it != handlers.end(); it++) {
+    if ((*it)->GetExecution() == EXECUTE_POOLED) {
+      return true;
+    }
+  }
+  return false;
+}
+
+void HttpServer::Serve(const std::string &service, const std::string &host,
+                       size_t reactors) {
+  if (running_) {
+    return;
+  }
+  if (reactors == 0) {
+    reactors = 1;
+  }
+  if (!epoll_instance_.Create()) {
+    LOG_ERROR("cannot set up epoll instance");
+    return;
+  }
+  if (sigemptyset(&sigset_) == -1) {
+    LOG_ERROR("cannot clear signal set");
+    return;
+  }
+  if (sigaddset(&sigset_, SIGINT) == -1 || sigaddset(&sigset_, SIGKILL) == -1 ||
+      sigaddset(&sigset_, SIGTERM) == -1) {
+    LOG_ERROR("cannot add signal to signal set");
+    return;
+  }
+  if (sigprocmask(SIG_BLOCK, &sigset_, nullptr) == -1) {
+    LOG_ERROR("cannot block signals");
+    return;
+  }
+  // sendfile has no MSG_NOSIGNAL, a client that hangs up during a download
+  // would otherwise take the process down
+  if (signal(SIGPIPE, SIG_IGN) == SIG_ERR) {
+    LOG_ERROR("cannot ignore broken pipe signal");
+    return;
+  }
+  if ((signal_descriptor_ = signalfd(-1, &sigset_, 0)) == -1) {
+    LOG_ERROR("cannot open signal descriptor");
+    return;
+  }
+  if (!UnblockDescriptor(signal_descriptor_)) {
+    LOG_ERROR("cannot set signal descriptor to nonblocking mode");
+    return;
+  }
+  if (!epoll_instance_.AddReadableDescriptor(signal_descriptor_)) {
+    LOG_ERROR("cannot add signal descriptor to epoll instance");
     return;
   }
-  if (!epoll_instance_.AddReadableDescriptor(timer_descriptor_)) {
-    printf("cannot add timer descriptor to epoll instance\n");
+  if ((event_descriptor_ = eventfd(0, EFD_NONBLOCK)) == -1) {
+    LOG_ERROR("cannot open event descriptor");
     return;
   }
-  ScheduleTimer(kHttpConnectionTimeout);
+  if (!epoll_instance_.AddReadableDescriptor(event_descriptor_)) {
+    LOG_ERROR("cannot add event descriptor to epoll instance");
+    return;
+  }
+  metrics_.Setup(router_.GetHandlers());
+  std::vector<int> listeners;
+  InheritListeners(listeners);
+  reactors = std::max(reactors, listeners.size());
+  size_t maximum_connections = maximum_connections_;
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur != RLIM_INFINITY &&
+      limit.rlim_cur > kHttpReservedDescriptors) {
+    size_t available = limit.rlim_cur - kHttpReservedDescriptors;
+    if (maximum_connections == 0 || maximum_connections > available) {
+      maximum_connections = available;
+    }
+  }
+  reactor_connections_ =
+      maximum_connections == 0
+          ? SIZE_MAX
+          : std::max(maximum_connections / reactors, (size_t)1);
+  draining_ = false;
+  for (size_t i = 0; i < reactors; i++) {
+    HttpReactor *reactor = new HttpReactor(this);
+    reactors_.push_back(reactor);
+    int inherited = -1;
+    if (!listeners.empty()) {
+      inherited = fcntl(listeners[i % listeners.size()], F_DUPFD_CLOEXEC, 0);
+    }
+    if (!reactor->Setup(service, host, reactors > 1, inherited)) {
+      LOG_ERROR("cannot set up reactor %lu", i);
+      for (size_t j = 0; j < listeners.size(); j++) {
+        close(listeners[j]);
+      }
+      DeleteReactors();
+      close(event_descriptor_);
+      close(signal_descriptor_);
+      epoll_instance_.Release();
+      return;
+    }
+  }
+  for (size_t i = 0; i < listeners.size(); i++) {
+    close(listeners[i]);
+  }
+  if (!upgrade_path_.empty()) {
+    if (!upgrade_socket_.Listen(upgrade_path_) ||
+        !epoll_instance_.AddReadableDescriptor(
+            upgrade_socket_.GetDescriptor())) {
+      LOG_ERROR("cannot listen for upgrades on %s", upgrade_path_.c_str());
+      upgrade_socket_.Close();
+    }
+  }
+  // file routes build their compressed variants on the pool
+  if (HasPooledHandlers() || !files_.empty()) {
+    if (!pool_.Start(std::max(workers_, (size_t)1))) {
+      LOG_ERROR("cannot start worker pool");
+      DeleteReactors();
+      close(event_descriptor_);
+      close(signal_descriptor_);
+      epoll_instance_.Release();
+      return;
+    }
+    LOG_INFO("started %lu pool workers", pool_.CountWorkers());
+  }
   running_ = true;
-  while (running_) {
+  for (size_t i = 0; i < reactors_.size(); i++) {
+    threads_.push_back(std::thread(&HttpReactor::Run, reactors_[i]));
+  }
+  LOG_INFO("serving on %lu reactor threads", reactors_.size());
+  while (running_ && !draining_) {
+    int ready = epoll_instance_.Wait();
+    for (size_t i = 0; i < ready; i++) {
+      if (upgrade_socket_.GetDescriptor() == epoll_instance_.GetDescriptor(i)) {
+        if (HandOver()) {
+          break;
+        }
+        continue;
+      }
+      if (event_descriptor_ == epoll_instance_.GetDescriptor(i)) {
+        uint64_t events = 0;
+        ssize_t bytes = read(event_descriptor_, &events, sizeof(uint64_t));
+        if (bytes == -1) {
+          LOG_ERROR("error reading event descriptor");
+        }
+        continue;
+      }
+      if (signal_descriptor_ == epoll_instance_.GetDescriptor(i)) {
+        LOG_DEBUG("event on signal descriptor");
+        memset(&signal_info_, 0, sizeof(struct signalfd_siginfo));
+        ssize_t bytes = read(signal_descriptor_, &signal_info_,
+                             sizeof(struct signalfd_siginfo));
+        if (bytes == -1) {
+          LOG_ERROR("error reading signal info from signal descriptor");
+          continue;
+        }
+        if (signal_info_.ssi_signo == SIGINT ||
+            signal_info_.ssi_signo == SIGKILL ||
+            signal_info_.ssi_signo == SIGTERM) {
+          LOG_INFO("process stopped by signal");
+          running_ = false;
+          break;
+        }
+        continue;
+      }
+    }
+  }
+  if (upgrade_socket_.GetDescriptor() != -1) {
+    upgrade_socket_.Close();
+    unlink(upgrade_path_.c_str());
+  }
+  LOG_INFO("stop reactor threads");
+  for (size_t i = 0; i < reactors_.size(); i++) {
+    reactors_[i]->Wake();
+  }
+  for (size_t i = 0; i < threads_.size(); i++) {
+    threads_[i].join();
+  }
+  threads_.clear();
+  LOG_INFO("stop worker pool");
+  pool_.Stop();
+  DeleteReactors();
+  LOG_DEBUG("close event descriptor");
+  close(event_descriptor_);
+  LOG_DEBUG("close signal descriptor");
+  close(signal_descriptor_);
+  LOG_DEBUG("release epoll instance");
+  epoll_instance_.Release();
+  running_ = false;
+  draining_ = false;
+  LOG_INFO("clean http server shutdown succeeded");
+}
+
+void HttpServer::Stop() {
+  running_ = false;
+  uint64_t event = 1;
+  if (write(event_descriptor_, &event, sizeof(uint64_t)) == -1) {
+    LOG_ERROR("cannot notify server about stop");
+  }
+}
+
+bool HttpServer::IsRunning() { return running_; }
+
+void HttpServer::DeleteReactors() {
+  for (size_t i = 0; i < reactors_.size(); i++) {
+    reactors_[i]->Release();
+    delete reactors_[i];
+  }
+  reactors_.clear();
+}
+
+HttpReactor::HttpReactor(HttpServer *server)
+    : server_(server), service_(kStringEmpty), host_(kStringEmpty),
+      reuse_port_(false), inherited_(-1), uring_(false), accepting_(false),
+      event_value_(0), timer_value_(0), count_(0), limit_(SIZE_MAX),
+      paused_(false), draining_(false), woken_(0), arrived_(0), now_(0),
+      sequence_(0), event_descriptor_(-1), timer_descriptor_(-1) {}
+
+HttpReactor::~HttpReactor() {}
+
+bool HttpReactor::Setup(const std::string &service, const std::string &host,
+                        bool reuse_port, int inherited) {
+  service_ = service;
+  host_ = host;
+  reuse_port_ = reuse_port;
+  inherited_ = inherited;
+  limit_ = server_->GetReactorConnections();
+  admission_.Configure(server_->GetAdmission()->GetTarget(),
+                       server_->GetAdmission()->GetInterval());
+  if (!SetupServerSocket()) {
+    LOG_ERROR("cannot set up server socket");
+    return false;
+  }
+  if ((event_descriptor_ = eventfd(0, EFD_NONBLOCK)) == -1) {
+    LOG_ERROR("cannot open event descriptor");
+    return false;
+  }
+  if ((timer_descriptor_ = timerfd_create(CLOCK_MONOTONIC, 0)) == -1) {
+    LOG_ERROR("cannot open timer descriptor");
+    return false;
+  }
+  if (!UnblockDescriptor(timer_descriptor_)) {
+    LOG_ERROR("cannot set timer descriptor to nonblocking mode");
+    return false;
+  }
+  if (server_->GetBackend() == BACKEND_URING) {
+    uring_ = SetupRing();
+    if (!uring_) {
+      LOG_WARNING("cannot set up io_uring instance - fall back to epoll");
+      ring_.Release();
+    }
+  }
+  if (!uring_) {
+    if (!epoll_instance_.Create()) {
+      LOG_ERROR("cannot set up epoll instance");
+      return false;
+    }
+    epoll_instance_.SetEdgeTriggered(server_->IsEdgeTriggered());
+    if (!epoll_instance_.AddReadableDescriptor(
+            server_socket_.GetDescriptor())) {
+      LOG_ERROR("cannot add listening socket to epoll instance");
+      return false;
+    }
+    if (!epoll_instance_.AddReadableDescriptor(event_descriptor_)) {
+      LOG_ERROR("cannot add event descriptor to epoll instance");
+      return false;
+    }
+    if (!epoll_instance_.AddReadableDescriptor(timer_descriptor_)) {
+      LOG_ERROR("cannot add timer descriptor to epoll instance");
+      return false;
+    }
+  }
+  now_ = TimeMonotonicMilliseconds();
+  wheel_.Start(now_);
+  ScheduleTimer(wheel_.GetResolution());
+  return true;
+}
+
+// The ring replaces epoll as well as the reads and writes on connections.
+// Accepts and receives are multishot, so they are submitted once and keep
+// completing. Data is received into provided buffers and copied into the
+// reader right away, which keeps the number of buffers per reactor fixed
+// no matter how many connections are open. Sends carry the writer segments
+// by reference. The event and timer descriptors are read through the ring
+// as well, so a busy reactor only enters the kernel once per loop.
+bool HttpReactor::SetupRing() {
+  if (!ring_.Create()) {
+    return false;
+  }
+  if (!ring_.SetupBuffers(kHttpRingBuffers, kHttpRingBufferSize)) {
+    return false;
+  }
+  if (!ring_.Read(event_descriptor_, &event_value_, sizeof(uint64_t),
+                  GetRingTag(nullptr, RING_EVENT)) ||
+      !ring_.Read(timer_descriptor_, &timer_value_, sizeof(uint64_t),
+                  GetRingTag(nullptr, RING_TIMER)) ||
+      !ring_.Accept(server_socket_.GetDescriptor(),
+                    GetRingTag(nullptr, RING_ACCEPT))) {
+    return false;
+  }
+  accepting_ = true;
+  return true;
+}
+
+uint64_t HttpReactor::GetRingTag(HttpConnection *connection,
+                                 HttpRingOperation operation) {
+  return (uint64_t)connection | operation;
+}
+
+int HttpReactor::GetListener() { return server_socket_.GetDescriptor(); }
+
+bool HttpReactor::IsDrained() {
+  if (!server_->IsDraining()) {
+    return false;
+  }
+  if (!draining_) {
+    Drain();
+  }
+  if (count_ == 0 || now_ >= server_->GetDrainDeadline()) {
+    LOG_DEBUG("reactor drained with %lu open connections", count_);
+    return true;
+  }
+  return false;
+}
+
+void HttpReactor::Run() {
+  HttpClock::Tick();
+  woken_ = TimeMonotonicMicroseconds();
+  if (uring_) {
+    RunRing();
+    return;
+  }
+  while (server_->IsRunning()) {
+    if (IsDrained()) {
+      break;
+    }
+    long idle = TimeMonotonicMicroseconds();
     int ready = epoll_instance_.Wait();
+    Wake(idle);
     for (size_t i = 0; i < ready; i++) {
       if (timer_descriptor_ == epoll_instance_.GetDescriptor(i)) {
-        printf("event on timer descriptor\n");
         uint64_t expired = 0;
         ssize_t bytes = read(timer_descriptor_, &expired, sizeof(uint64_t));
         if (bytes == -1) {
-          printf("error reading time from timer descriptor\n");
-          continue;
-        }
-        printf("delete expired connections\n");
-        DeleteExpiredConnections();
-        printf("show connections:\n");
-        if (connections_.size() == 0) {
-          printf("tick: no connections\n");
+          LOG_ERROR("error reading time from timer descriptor");
           continue;
         }
-        for (auto it = connections_.begin(); it != connections_.end(); it++) {
-          printf("tick: connection %d\n", it->first);
+        HttpClock::Tick();
+        DeleteExpiredConnections();
+        if (paused_ && count_ < limit_) {
+          ResumeAccepting();
         }
         continue;
       }
-      if (signal_descriptor_ == epoll_instance_.GetDescriptor(i)) {
-        printf("event on signal descriptor\n");
-        memset(&signal_info_, 0, sizeof(struct signalfd_siginfo));
-        ssize_t bytes = read(signal_descriptor_, &signal_info_,
-                             sizeof(struct signalfd_siginfo));
+      if (event_descriptor_ == epoll_instance_.GetDescriptor(i)) {
+        uint64_t events = 0;
+        ssize_t bytes = read(event_descriptor_, &events, sizeof(uint64_t));
         if (bytes == -1) {
-          printf("error reading signal info from signal descriptor\n");
-          continue;
-        }
-        if (signal_info_.ssi_signo == SIGINT ||
-            signal_info_.ssi_signo == SIGKILL ||
-            signal_info_.ssi_signo == SIGTERM) {
-          printf("process stopped by signal\n");
-          running_ = false;
-          break;
+          LOG_ERROR("error reading event descriptor");
         }
+        ProcessCompletions();
         continue;
       }
       if (server_socket_.GetDescriptor() == epoll_instance_.GetDescriptor(i)) {
-        printf("event on server socket\n");
+        LOG_DEBUG("event on server socket");
         if (epoll_instance_.HasErrors(i)) {
-          printf("error condition on server socket\n");
+          LOG_WARNING("error condition on server socket");
           epoll_instance_.DeleteDescriptor(server_socket_.GetDescriptor());
-          if (!SetupServerSocket(service, host)) {
-            printf("cannot set up server socket\n");
-            return;
+          if (!SetupServerSocket()) {
+            LOG_ERROR("cannot set up server socket");
+            server_->Stop();
+            break;
           }
           if (!epoll_instance_.AddReadableDescriptor(
                   server_socket_.GetDescriptor())) {
-            printf("cannot add listening socket to epoll instance\n");
-            return;
+            LOG_ERROR("cannot add listening socket to epoll instance");
+            server_->Stop();
+            break;
           }
-          printf("server socket has been restarted\n");
-          continue;
-        }
-        TcpSocket *client_socket;
-        client_socket = server_socket_.Accept();
-        if (client_socket == nullptr) {
-          printf("error accepting new client socket\n");
-          continue;
-        }
-        if (!epoll_instance_.AddReadableDescriptor(
-                client_socket->GetDescriptor())) {
-          printf("cannot add new client socket to epoll instance\n");
-          client_socket->Close();
-          delete client_socket;
+          LOG_INFO("server socket has been restarted");
           continue;
         }
-        client_socket->Unblock();
-        HttpConnection *connection = new HttpConnection(client_socket);
-        connections_.insert(
-            std::make_pair(client_socket->GetDescriptor(), connection));
+        AcceptConnections();
       } else {
-        auto lookup = connections_.find(epoll_instance_.GetDescriptor(i));
-        if (lookup == connections_.end()) {
-          printf("cannot not find connection\n");
+        int descriptor = epoll_instance_.GetDescriptor(i);
+        HttpConnection *connection =
+            FindConnection(descriptor, epoll_instance_.GetTag(i));
+        if (connection == nullptr) {
+          LOG_DEBUG("cannot find connection");
           continue;
         }
-        int descriptor = lookup->first;
-        HttpConnection *connection = lookup->second;
-        if (!connection->IsGood() || epoll_instance_.HasErrors(i)) {
-          printf("error condition on client socket - remove client\n");
+        if (epoll_instance_.HasErrors(i)) {
+          LOG_DEBUG("error condition on client socket - remove client");
           DeleteConnection(descriptor);
           continue;
         }
-        if (epoll_instance_.IsReadable(i)) {
-          if (connection->GetStage() == END) {
-            printf("connection still readable though successfully parsed\n");
+        if (epoll_instance_.IsEdgeTriggered()) {
+          if (!ServeConnection(descriptor, connection,
+                               epoll_instance_.IsReadable(i))) {
             DeleteConnection(descriptor);
             continue;
           }
+          WatchConnection(descriptor, connection);
+        } else if (epoll_instance_.IsReadable(i)) {
           connection->GetReader()->ReadSome();
+          Account(connection);
           if (connection->GetReader()->HasErrors()) {
-            printf("error condition on reader - probably connection closed\n");
+            LOG_DEBUG("error condition on reader - probably connection closed");
             DeleteConnection(descriptor);
             continue;
           }
-          printf("parse request incoming on connection %d\n", descriptor);
-          connection->Parse();
-          if (connection->GetStage() == FAILED) {
-            printf("parsing of request failed\n");
+          ArmTimer(connection);
+          LOG_DEBUG("parse requests incoming on connection %d", descriptor);
+          if (!ExecuteRequests(descriptor, connection)) {
             DeleteConnection(descriptor);
             continue;
           }
-          if (connection->GetStage() == END) {
-            printf("execute handler\n");
-            connection->GetWriter()->Write(
-                ExecuteHandler(connection->GetRequest()).AsString());
-            if (!epoll_instance_.SetWriteable(i)) {
-              printf("could not set descriptor to write mode\n");
-              DeleteConnection(descriptor);
-              continue;
-            }
-          }
+          WatchConnection(descriptor, connection);
         } else if (epoll_instance_.IsWritable(i)) {
-          printf("got request:\n");
-          printf("%s\n", connection->GetRequest().AsString().c_str());
-          printf("send response\n");
+          LOG_DEBUG("send responses");
           connection->GetWriter()->SendSome();
-          if (connection->GetWriter()->IsEmpty()) {
-            printf("response has been sent for connection %d\n", descriptor);
-            if (connection->GetRequest()
-                    .GetHeader("connection")
-                    .compare("keep-alive") == 0) {
-              printf("keep-alive request detected\n");
-              connection->Restart();
-              if (!epoll_instance_.SetReadable(i)) {
-                printf("could not set descriptor to read mode\n");
-                DeleteConnection(descriptor);
-                continue;
-              }
-              printf("connection restarted due to keep-alive header\n");
-              continue;
-            }
+          Account(connection);
+          if (connection->GetWriter()->HasErrors()) {
+            LOG_DEBUG("error occurred when sending response");
             DeleteConnection(descriptor);
             continue;
           }
-          if (connection->GetWriter()->HasErrors()) {
-            printf("error occurred when sending response\n");
-            DeleteConnection(descriptor);
+          if (!connection->GetWriter()->IsEmpty() &&
+              !connection->IsStreaming()) {
             continue;
           }
+          LOG_DEBUG("responses have been sent for connection %d", descriptor);
+          if (!connection->IsPending() &&
+              (connection->IsStreaming() || connection->IsKeepAlive())) {
+            ArmTimer(connection);
+            if (!ExecuteRequests(descriptor, connection)) {
+              DeleteConnection(descriptor);
+              continue;
+            }
+          }
+          WatchConnection(descriptor, connection);
         } else {
-          printf("unknown event on client socket\n");
+          LOG_WARNING("unknown event on client socket");
           DeleteConnection(descriptor);
           continue;
         }
       }
     }
   }
-  printf("close timer descriptor\n");
-  close(timer_descriptor_);
-  printf("close signal descriptor\n");
-  close(signal_descriptor_);
-  printf("close server socket\n");
+}
+
+void HttpReactor::RunRing() {
+  if (!ring_.Enable()) {
+    LOG_ERROR("cannot enable io_uring instance");
+    server_->Stop();
+    return;
+  }
+  while (server_->IsRunning()) {
+    if (IsDrained()) {
+      break;
+    }
+    long idle = TimeMonotonicMicroseconds();
+    int ready = ring_.Wait();
+    Wake(idle);
+    for (int i = 0; i < ready; i++) {
+      uint64_t tag = ring_.GetTag(i);
+      HttpConnection *connection =
+          (HttpConnection *)(tag & ~kHttpRingOperationMask);
+      HttpRingOperation operation =
+          (HttpRingOperation)(tag & kHttpRingOperationMask);
+      int result = ring_.GetResult(i);
+      switch (operation) {
+      case RING_ACCEPT:
+        AcceptRing(result, ring_.HasMore(i));
+        break;
+      case RING_EVENT:
+        // A failed poll posts its own completion and cancels the read, of
+        // which only the first one submits the next read.
+        if (result == -ECANCELED) {
+          break;
+        }
+        if (result < 0 && result != -EAGAIN) {
+          LOG_ERROR("error reading event descriptor");
+        }
+        ProcessCompletions();
+        if (!ring_.Read(event_descriptor_, &event_value_, sizeof(uint64_t),
+                        tag)) {
+          LOG_ERROR("cannot submit read of event descriptor");
+          server_->Stop();
+        }
+        break;
+      case RING_TIMER:
+        if (result == -ECANCELED) {
+          break;
+        }
+        if (result < 0) {
+          if (result != -EAGAIN) {
+            LOG_ERROR("error reading time from timer descriptor");
+          }
+        } else {
+          HttpClock::Tick();
+          DeleteExpiredConnections();
+          if (paused_ && count_ < limit_) {
+            ResumeAccepting();
+          }
+        }
+        if (!ring_.Read(timer_descriptor_, &timer_value_, sizeof(uint64_t),
+                        tag)) {
+          LOG_ERROR("cannot submit read of timer descriptor");
+          server_->Stop();
+        }
+        break;
+      case RING_RECEIVE:
+        ReceiveRing(connection, result, ring_.GetBufferId(i),
+                    ring_.HasMore(i));
+        break;
+      case RING_SEND:
+      case RING_POLL:
+        SendRing(connection, operation, result);
+        break;
+      default:
+        break;
+      }
+    }
+  }
+}
+
+// Drains the backlog, which an edge-triggered listener reports only once.
+// Clients that reset while they were queued and interrupted calls leave the
+// rest of the backlog in place, so accepting goes on after them.
+void HttpReactor::AcceptConnections() {
+  while (count_ < limit_) {
+    int error = 0;
+    HttpConnection *connection = AddConnection(error);
+    if (connection != nullptr) {
+      server_->GetMetrics()->RecordAccept();
+      ArmTimer(connection);
+      continue;
+    }
+    if (error == 0 || error == ECONNABORTED || error == EPROTO ||
+        error == EINTR) {
+      continue;
+    }
+    if (error == EMFILE || error == ENFILE) {
+      LOG_WARNING("out of file descriptors - pause accepting");
+      PauseAccepting();
+      return;
+    }
+    if (error != EAGAIN && error != EWOULDBLOCK) {
+      LOG_WARNING("error accepting new client socket: %s", strerror(error));
+    }
+    return;
+  }
+  LOG_DEBUG("connection limit reached - pause accepting");
+  PauseAccepting();
+}
+
+// Accepted descriptors arrive as completions of the multishot accept. While
+// the reactor pauses, the accept is cancelled, and it is submitted again
+// once its last completion has come in and the reactor accepts again.
+void HttpReactor::AcceptRing(int result, bool more) {
+  if (!more) {
+    accepting_ = false;
+  }
+  if (result >= 0) {
+    int error = 0;
+    HttpConnection *connection = AddConnection(error, result);
+    if (connection != nullptr) {
+      server_->GetMetrics()->RecordAccept();
+      ArmTimer(connection);
+    }
+    if (count_ >= limit_) {
+      LOG_DEBUG("connection limit reached - pause accepting");
+      PauseAccepting();
+    }
+  } else if (result == -EMFILE || result == -ENFILE) {
+    LOG_WARNING("out of file descriptors - pause accepting");
+    PauseAccepting();
+  } else if (result == -ECONNABORTED || result == -EPROTO ||
+             result == -EINTR) {
+    LOG_DEBUG("client reset before it was accepted");
+  } else if (result != -ECANCELED) {
+    // Anything else is retried with the next tick instead of right away, a
+    // persistent error would otherwise keep failing the accept in a loop.
+    LOG_WARNING("error accepting new client socket: %s", strerror(-result));
+    PauseAccepting();
+  }
+  if (accepting_ || paused_ || draining_) {
+    return;
+  }
+  if (!ring_.Accept(server_socket_.GetDescriptor(),
+                    GetRingTag(nullptr, RING_ACCEPT))) {
+    LOG_ERROR("cannot submit accept to io_uring instance");
+    return;
+  }
+  accepting_ = true;
+}
+
+// Multishot receives stop when the kernel runs out of provided buffers and
+// are submitted again while the connection is open. Requests are executed
+// once the responses before them are out, like on epoll, where the reactor
+// only watches for input while nothing is left to send.
+void HttpReactor::ReceiveRing(HttpConnection *connection, int result,
+                              int buffer, bool more) {
+  if (!more) {
+    connection->SetOperations(connection->GetOperations() &
+                              ~(1 << RING_RECEIVE));
+  }
+  if (IsClosing(connection)) {
+    if (buffer != -1) {
+      ring_.RecycleBuffer(buffer);
+    }
+    return;
+  }
+  int descriptor = connection->GetDescriptor();
+  TcpReader *reader = connection->GetReader();
+  if (buffer != -1) {
+    reader->Append(ring_.GetBuffer(buffer), result);
+    ring_.RecycleBuffer(buffer);
+  } else if (result == 0) {
+    reader->SetStatus(DISCONNECT);
+  } else if (result == -ENOBUFS) {
+    reader->SetStatus(BLOCKED);
+  } else {
+    reader->SetStatus(ERROR);
+  }
+  Account(connection);
+  if (reader->HasErrors()) {
+    LOG_DEBUG("error condition on reader - probably connection closed");
+    DeleteConnection(descriptor);
+    return;
+  }
+  if (!(connection->GetOperations() & (1 << RING_RECEIVE))) {
+    if (!ring_.Receive(descriptor, GetRingTag(connection, RING_RECEIVE))) {
+      LOG_ERROR("could not submit receive for connection %d", descriptor);
+      DeleteConnection(descriptor);
+      return;
+    }
+    connection->SetOperations(connection->GetOperations() |
+                              (1 << RING_RECEIVE));
+  }
+  if (buffer == -1) {
+    return;
+  }
+  ArmTimer(connection);
+  if ((connection->GetOperations() & (1 << RING_SEND | 1 << RING_POLL)) ||
+      !connection->GetWriter()->IsEmpty()) {
+    return;
+  }
+  LOG_DEBUG("parse requests incoming on connection %d", descriptor);
+  if (!ExecuteRequests(descriptor, connection)) {
+    DeleteConnection(descriptor);
+    return;
+  }
+  WatchConnection(descriptor, connection);
+}
+
+// Sends complete with the number of bytes the socket took, the segments
+// stay queued until then. Files wait for the socket to become writable and
+// go out with sendfile.
+void HttpReactor::SendRing(HttpConnection *connection,
+                           HttpRingOperation operation, int result) {
+  connection->SetOperations(connection->GetOperations() & ~(1 << operation));
+  if (IsClosing(connection)) {
+    return;
+  }
+  int descriptor = connection->GetDescriptor();
+  TcpWriter *writer = connection->GetWriter();
+  if (operation == RING_POLL) {
+    writer->SendSome();
+  } else if (result < 0) {
+    writer->SetStatus(result == -EAGAIN ? BLOCKED : ERROR);
+  } else {
+    writer->Commit(result);
+  }
+  Account(connection);
+  if (writer->HasErrors()) {
+    LOG_DEBUG("error occurred when sending response");
+    DeleteConnection(descriptor);
+    return;
+  }
+  if (!writer->IsEmpty() && !connection->IsStreaming()) {
+    WatchConnection(descriptor, connection);
+    return;
+  }
+  LOG_DEBUG("responses have been sent for connection %d", descriptor);
+  if (!connection->IsPending() &&
+      (connection->IsStreaming() || connection->IsKeepAlive())) {
+    ArmTimer(connection);
+    if (!ExecuteRequests(descriptor, connection)) {
+      DeleteConnection(descriptor);
+      return;
+    }
+  }
+  WatchConnection(descriptor, connection);
+}
+
+// Connections closed with operations in flight keep their descriptor and
+// buffers until the kernel is done with them.
+bool HttpReactor::IsClosing(HttpConnection *connection) {
+  if (FindConnection(connection->GetDescriptor(), connection->GetId()) ==
+      connection) {
+    return false;
+  }
+  if (connection->GetOperations() == 0) {
+    auto it = std::find(closing_.begin(), closing_.end(), connection);
+    if (it != closing_.end()) {
+      *it = closing_.back();
+      closing_.pop_back();
+    }
+    RecycleConnection(connection);
+  }
+  return true;
+}
+
+// Pending connections stay in the listen backlog of the kernel while the
+// reactor is saturated. The reactor resumes once a connection was closed,
+// or on the next timer tick if descriptors ran out for other reasons.
+void HttpReactor::PauseAccepting() {
+  if (paused_) {
+    return;
+  }
+  if (uring_) {
+    if (accepting_ && !ring_.Cancel(GetRingTag(nullptr, RING_ACCEPT),
+                                    GetRingTag(nullptr, RING_CANCEL))) {
+      LOG_ERROR("cannot cancel accept on io_uring instance");
+      return;
+    }
+  } else if (!epoll_instance_.DeleteDescriptor(
+                 server_socket_.GetDescriptor())) {
+    LOG_ERROR("cannot remove listening socket from epoll instance");
+    return;
+  }
+  paused_ = true;
+  server_->GetMetrics()->RecordPause();
+}
+
+void HttpReactor::ResumeAccepting() {
+  if (!paused_ || draining_) {
+    return;
+  }
+  if (uring_) {
+    if (!accepting_ && !ring_.Accept(server_socket_.GetDescriptor(),
+                                     GetRingTag(nullptr, RING_ACCEPT))) {
+      LOG_ERROR("cannot submit accept to io_uring instance");
+      return;
+    }
+    accepting_ = true;
+  } else if (!epoll_instance_.AddReadableDescriptor(
+                 server_socket_.GetDescriptor())) {
+    LOG_ERROR("cannot add listening socket to epoll instance");
+    return;
+  }
+  paused_ = false;
+}
+
+// Edge-triggered connections only get woken up on new readiness, so the
+// socket is read until it blocks and responses are sent right away.
+bool HttpReactor::ServeConnection(int descriptor, HttpConnection *connection,
+                                  bool readable) {
+  ArmTimer(connection);
+  if (!readable) {
+    return ExecuteRequests(descriptor, connection);
+  }
+  do {
+    connection->GetReader()->ReadSome();
+    Account(connection);
+    if (connection->GetReader()->HasErrors()) {
+      LOG_DEBUG("error condition on reader - probably connection closed");
+      return false;
+    }
+    if (!ExecuteRequests(descriptor, connection)) {
+      return false;
+    }
+  } while (connection->GetReader()->GetStatus() == SUCCESS);
+  return true;
+}
+
+// Another process accepts from now on. Responses still in flight are
+// completed, further requests are answered with connection close, and idle
+// connections are closed after a short linger. The linger lets requests
+// that are already on their way be answered instead of being reset.
+void HttpReactor::Drain() {
+  LOG_DEBUG("drain %lu connections", count_);
+  draining_ = true;
+  PauseAccepting();
+  server_socket_.Close();
+  for (size_t i = 0; i < connections_.size(); i++) {
+    HttpConnection *connection = connections_[i];
+    if (connection != nullptr && connection->GetWriter()->IsEmpty() &&
+        !connection->IsPending() && !connection->IsStreaming() &&
+        connection->GetReader()->GetLength() == 0) {
+      wheel_.Schedule(connection->GetTimer(), now_ + kHttpDrainLinger);
+    }
+  }
+}
+
+void HttpReactor::Wake() {
+  uint64_t event = 1;
+  if (write(event_descriptor_, &event, sizeof(uint64_t)) == -1) {
+    LOG_ERROR("cannot wake reactor");
+  }
+}
+
+void HttpReactor::Complete(int descriptor, uint32_t id,
+                           HttpResponse response) {
+  {
+    std::lock_guard<std::mutex> lock(completion_mutex_);
+    completions_.push_back({descriptor, id, std::move(response)});
+  }
+  Wake();
+}
+
+bool HttpReactor::Dispatch(int descriptor, HttpConnection *connection,
+                           HttpHandler *handler) {
+  uint32_t id = connection->GetId();
+  HttpRequest request = connection->GetRequest();
+  connection->SetPending(true);
+  connection->Restart();
+  long queued = TimeMonotonicMicroseconds();
+  return server_->GetPool()->Submit([this, descriptor, id, request, handler,
+                                     queued]() {
+    long start = TimeMonotonicMicroseconds();
+    if (!server_->GetAdmission()->Admit(start - queued, start)) {
+      Complete(descriptor, id, server_->Shed());
+      return;
+    }
+    HttpRoute route = {handler, OK, std::string_view()};
+    Complete(descriptor, id, server_->ExecuteHandler(route, request));
+  });
+}
+
+// Estimates when the bytes found after a wait have arrived. If the reactor
+// slept for longer than it had been busy before, they most likely woke it
+// up. Otherwise they have been queued while the previous round was being
+// served, which began when the reactor last woke up.
+void HttpReactor::Wake(long idle) {
+  long woken = TimeMonotonicMicroseconds();
+  arrived_ = woken - idle > idle - woken_ ? woken : woken_;
+  woken_ = woken;
+  now_ = woken / 1000;
+}
+
+// Byte counters are taken after every socket operation so that long
+// transfers show up while they are still running. Reads also stamp the
+// connection with the estimated arrival of the bytes, from which the
+// admission control measures how long its requests have been waiting.
+void HttpReactor::Account(HttpConnection *connection) {
+  size_t received = connection->GetReader()->PopReceived();
+  if (received > 0) {
+    connection->SetReceived(arrived_);
+  }
+  server_->GetMetrics()->RecordTransfer(received,
+                                        connection->GetWriter()->PopSent());
+}
+
+void HttpReactor::ProcessCompletions() {
+  std::deque<HttpCompletion> completions;
+  {
+    std::lock_guard<std::mutex> lock(completion_mutex_);
+    completions.swap(completions_);
+  }
+  for (auto it = completions.begin(); it != completions.end(); it++) {
+    HttpConnection *connection = FindConnection(it->descriptor, it->id);
+    if (connection == nullptr) {
+      LOG_DEBUG("drop completion for closed connection %d", it->descriptor);
+      continue;
+    }
+    connection->SetPending(false);
+    connection->Respond(std::move(it->response));
+    if (!ExecuteRequests(it->descriptor, connection)) {
+      DeleteConnection(it->descriptor);
+      continue;
+    }
+    WatchConnection(it->descriptor, connection);
+  }
+}
+
+bool HttpReactor::ExecuteRequests(int descriptor, HttpConnection *connection) {
+  while (!connection->IsPending() &&
+         (connection->IsStreaming() || connection->IsKeepAlive())) {
+    if (connection->IsStreaming()) {
+      connection->Produce();
+      if (connection->IsStreaming()) {
+        return true;
+      }
+      continue;
+    }
+    if (connection->IsUploading()) {
+      if (!connection->Upload()) {
+        RejectUpload(connection);
+        return true;
+      }
+    } else {
+      connection->Parse();
+    }
+    if (connection->GetStage() == FAILED) {
+      LOG_DEBUG("parsing of request failed");
+      server_->GetMetrics()->RecordParseFailure();
+      connection->SetKeepAlive(false);
+      connection->Respond(
+          HttpResponse::Build(connection->GetParser()->GetStatus()));
+      return true;
+    }
+    if (connection->GetStage() == BODY && !connection->IsInspected()) {
+      connection->SetInspected(true);
+      InspectRequest(connection);
+      continue;
+    }
+    if (connection->GetStage() != END) {
+      return true;
+    }
+    HttpRequest &request = connection->GetRequest();
+    connection->SetKeepAlive(
+        !draining_ &&
+        !StringEqualsNoCase(request.GetHeader(HEADER_CONNECTION), "close"));
+    long start = TimeMonotonicMicroseconds();
+    if (!admission_.Admit(start - connection->GetReceived(), start)) {
+      Shed(connection);
+      continue;
+    }
+    if (Throttle(connection)) {
+      continue;
+    }
+    HttpRoute route = {connection->GetUpload(), OK, std::string_view()};
+    if (!connection->IsUploading()) {
+      route = server_->FindRoute(request);
+      if (route.handler != nullptr &&
+          route.handler->GetBodyCallback() != nullptr &&
+          !request.GetBody().empty() &&
+          !route.handler->GetBodyCallback()(request, request.GetBody())) {
+        RejectUpload(connection);
+        return true;
+      }
+    }
+    if (route.handler != nullptr && !draining_ &&
+        route.handler->Respond(request, connection->GetWriter(),
+                               connection->IsKeepAlive())) {
+      server_->GetMetrics()->RecordResponse(
+          route.handler, OK, TimeMonotonicMicroseconds() - start);
+      connection->Restart();
+      continue;
+    }
+    if (route.handler != nullptr &&
+        route.handler->GetExecution() == EXECUTE_POOLED) {
+      LOG_DEBUG("dispatch handler to worker pool");
+      if (!Dispatch(descriptor, connection, route.handler)) {
+        LOG_ERROR("could not dispatch handler");
+        return false;
+      }
+      return true;
+    }
+    LOG_DEBUG("execute handler");
+    HttpResponse response = server_->ExecuteHandler(route, request);
+    connection->Respond(std::move(response));
+    connection->Restart();
+  }
+  return true;
+}
+
+void HttpReactor::Shed(HttpConnection *connection) {
+  LOG_DEBUG("request shed by admission control");
+  connection->Respond(server_->Shed());
+  connection->Restart();
+}
+
+bool HttpReactor::Throttle(HttpConnection *connection) {
+  HttpRateLimiter *limiter = server_->GetRateLimiter();
+  if (limiter == nullptr) {
+    return false;
+  }
+  long wait = limiter->Acquire(connection->GetSocket()->GetAddress(),
+                               connection->GetRequest(), now_);
+  if (wait == 0) {
+    return false;
+  }
+  LOG_DEBUG("request throttled by rate limit");
+  connection->Respond(server_->Throttle(wait));
+  connection->Restart();
+  return true;
+}
+
+void HttpReactor::RejectUpload(HttpConnection *connection) {
+  LOG_DEBUG("upload rejected by handler");
+  connection->Respond(HttpResponse::Build(BAD_REQUEST));
+  connection->SetKeepAlive(false);
+}
+
+// Routes a request as soon as its head is complete. Handlers that stream
+// request bodies start receiving fragments before the body has arrived.
+void HttpReactor::InspectRequest(HttpConnection *connection) {
+  HttpRequest &request = connection->GetRequest();
+  connection->GetParser()->ReadHead(connection->GetReader()->GetBuffer(),
+                                    request);
+  HttpRoute route = server_->FindRoute(request);
+  if (route.handler != nullptr && route.handler->GetBodyCallback() != nullptr) {
+    connection->BeginUpload(route.handler);
+  }
+}
+
+bool HttpReactor::WatchConnection(int descriptor, HttpConnection *connection) {
+  if (uring_) {
+    return SubmitRing(descriptor, connection);
+  }
+  while (epoll_instance_.IsEdgeTriggered() &&
+         !connection->GetWriter()->IsEmpty()) {
+    connection->GetWriter()->SendSome();
+    Account(connection);
+    if (connection->GetWriter()->HasErrors()) {
+      LOG_DEBUG("error occurred when sending response");
+      DeleteConnection(descriptor);
+      return false;
+    }
+    if (!connection->GetWriter()->IsEmpty() || !connection->IsStreaming()) {
+      break;
+    }
+    if (!ExecuteRequests(descriptor, connection)) {
+      DeleteConnection(descriptor);
+      return false;
+    }
+  }
+  int flags = EPOLLERR | EPOLLHUP;
+  if (!connection->GetWriter()->IsEmpty()) {
+    flags |= EPOLLOUT;
+  } else if (connection->IsPending()) {
+    LOG_DEBUG("connection %d waits for worker pool", descriptor);
+  } else if (connection->IsKeepAlive()) {
+    flags |= EPOLLIN;
+    if (draining_ && connection->GetReader()->GetLength() == 0) {
+      wheel_.Schedule(connection->GetTimer(), now_ + kHttpDrainLinger);
+    }
+  } else {
+    LOG_DEBUG("close connection %d", descriptor);
+    DeleteConnection(descriptor);
+    return false;
+  }
+  if (epoll_instance_.IsEdgeTriggered() || connection->GetEvents() == flags) {
+    return true;
+  }
+  connection->SetEvents(flags);
+  if (!epoll_instance_.ModifyDescriptor(descriptor, flags,
+                                        connection->GetId())) {
+    LOG_ERROR("could not modify descriptor of connection %d", descriptor);
+    DeleteConnection(descriptor);
+    return false;
+  }
+  return true;
+}
+
+// Keeps one send in flight while the writer holds data. The receive stays
+// armed the whole time, so there is nothing to submit for idle connections.
+// Sends are not linked into chains: a single sendmsg already gathers every
+// segment of a response, and files, for which the ring has no sendfile,
+// need the completion of the preceding send before they can go out.
+bool HttpReactor::SubmitRing(int descriptor, HttpConnection *connection) {
+  int operations = connection->GetOperations();
+  if (operations & (1 << RING_SEND | 1 << RING_POLL)) {
+    return true;
+  }
+  if (!connection->GetWriter()->IsEmpty()) {
+    struct msghdr *message = connection->Gather();
+    HttpRingOperation operation = message != nullptr ? RING_SEND : RING_POLL;
+    bool submitted =
+        message != nullptr
+            ? ring_.Send(descriptor, message, GetRingTag(connection, operation))
+            : ring_.Poll(descriptor, POLLOUT,
+                         GetRingTag(connection, operation));
+    if (!submitted) {
+      LOG_ERROR("could not submit send for connection %d", descriptor);
+      DeleteConnection(descriptor);
+      return false;
+    }
+    connection->SetOperations(operations | (1 << operation));
+  } else if (connection->IsPending()) {
+    LOG_DEBUG("connection %d waits for worker pool", descriptor);
+  } else if (connection->IsKeepAlive()) {
+    if (draining_ && connection->GetReader()->GetLength() == 0) {
+      wheel_.Schedule(connection->GetTimer(), now_ + kHttpDrainLinger);
+    }
+  } else {
+    LOG_DEBUG("close connection %d", descriptor);
+    DeleteConnection(descriptor);
+    return false;
+  }
+  return true;
+}
+
+void HttpReactor::Release() {
+  if (timer_descriptor_ != -1) {
+    LOG_DEBUG("close timer descriptor");
+    close(timer_descriptor_);
+    timer_descriptor_ = -1;
+  }
+  if (event_descriptor_ != -1) {
+    LOG_DEBUG("close event descriptor");
+    close(event_descriptor_);
+    event_descriptor_ = -1;
+  }
+  LOG_DEBUG("close server socket");
   server_socket_.Close();
-  printf("delete connections\n");
+  if (uring_) {
+    LOG_DEBUG("release io_uring instance");
+    ring_.Release();
+  }
+  LOG_DEBUG("delete connections");
   DeleteConnections();
-  printf("release epoll instance\n");
+  LOG_DEBUG("release epoll instance");
   epoll_instance_.Release();
-  running_ = false;
-  printf("clean http server shutdown succeeded\n");
 }
 
-bool HttpServer::SetupServerSocket(const std::string &service,
-                                   const std::string &host) {
-  if (!server_socket_.Listen(service, host)) {
+bool HttpReactor::SetupServerSocket() {
+  if (inherited_ != -1) {
+    int descriptor = inherited_;
+    inherited_ = -1;
+    if (!server_socket_.Adopt(descriptor)) {
+      close(descriptor);
+      return false;
+    }
+  } else if (!server_socket_.Listen(service_, host_, reuse_port_)) {
     return false;
   }
   server_socket_.Unblock();
   return true;
 }
 
-void HttpServer::DeleteConnection(int descriptor) {
-  auto it_connection = connections_.find(descriptor);
-  if (it_connection == connections_.end()) {
+// Takes over a descriptor that was accepted by the ring, or accepts the
+// next connection from the listening socket.
+// Returns null if no connection could be added. The error is the one of
+// the accept, or zero if the accepted socket had to be dropped afterwards.
+HttpConnection *HttpReactor::AddConnection(int &error, int accepted) {
+  HttpConnection *connection;
+  error = 0;
+  if (spare_.empty()) {
+    connection = new HttpConnection();
+  } else {
+    connection = spare_.back();
+    spare_.pop_back();
+  }
+  if (accepted != -1) {
+    connection->GetSocket()->Attach(accepted);
+  } else if (!server_socket_.Accept(connection->GetSocket())) {
+    error = errno;
+    spare_.push_back(connection);
+    return nullptr;
+  }
+  int descriptor = connection->GetDescriptor();
+  connection->SetId(++sequence_);
+  if (uring_) {
+    if (!ring_.Receive(descriptor, GetRingTag(connection, RING_RECEIVE))) {
+      LOG_ERROR("cannot submit receive for new client socket");
+      connection->Close();
+      spare_.push_back(connection);
+      return nullptr;
+    }
+    connection->SetOperations(1 << RING_RECEIVE);
+  } else {
+    int flags = EPOLLIN;
+    if (epoll_instance_.IsEdgeTriggered()) {
+      flags |= EPOLLOUT;
+    }
+    if (!epoll_instance_.AddDescriptor(descriptor, flags,
+                                       connection->GetId())) {
+      LOG_ERROR("cannot add new client socket to epoll instance");
+      connection->Close();
+      spare_.push_back(connection);
+      return nullptr;
+    }
+    connection->SetEvents(flags | EPOLLERR | EPOLLHUP);
+  }
+  if ((size_t)descriptor >= connections_.size()) {
+    connections_.resize(
+        std::max((size_t)descriptor + 1, connections_.size() * 2), nullptr);
+  }
+  connections_[descriptor] = connection;
+  count_++;
+  return connection;
+}
+
+HttpConnection *HttpReactor::FindConnection(int descriptor, uint32_t id) {
+  if (descriptor < 0 || (size_t)descriptor >= connections_.size()) {
+    return nullptr;
+  }
+  HttpConnection *connection = connections_[descriptor];
+  if (connection == nullptr || connection->GetId() != id) {
+    return nullptr;
+  }
+  return connection;
+}
+
+void HttpReactor::DeleteConnection(int descriptor) {
+  if (descriptor < 0 || (size_t)descriptor >= connections_.size() ||
+      connections_[descriptor] == nullptr) {
+    return;
+  }
+  HttpConnection *connection = connections_[descriptor];
+  LOG_DEBUG("delete connection %d", descriptor);
+  Account(connection);
+  server_->GetMetrics()->RecordClose();
+  wheel_.Cancel(connection->GetTimer());
+  connections_[descriptor] = nullptr;
+  count_--;
+  if (paused_ && count_ < limit_) {
+    ResumeAccepting();
+  }
+  if (uring_ && connection->GetOperations() != 0) {
+    // shutting the socket down ends the operations in flight
+    shutdown(descriptor, SHUT_RDWR);
+    closing_.push_back(connection);
     return;
   }
-  printf("delete connection %d\n", it_connection->first);
-  epoll_instance_.DeleteDescriptor(it_connection->first);
-  delete it_connection->second;
-  it_connection = connections_.erase(it_connection);
+  if (!uring_) {
+    epoll_instance_.DeleteDescriptor(descriptor);
+  }
+  RecycleConnection(connection);
 }
 
-void HttpServer::DeleteConnections() {
-  auto it_connection = connections_.begin();
-  while (it_connection != connections_.end()) {
-    printf("remove connection %d\n", it_connection->first);
-    epoll_instance_.DeleteDescriptor(it_connection->first);
-    delete it_connection->second;
-    it_connection = connections_.erase(it_connection);
+void HttpReactor::RecycleConnection(HttpConnection *connection) {
+  connection->Close();
+  if (spare_.size() < kHttpSpareConnections) {
+    spare_.push_back(connection);
+    return;
   }
-  connections_.clear();
+  delete connection;
 }
 
-void HttpServer::DeleteExpiredConnections() {
-  auto it_connection = connections_.begin();
-  while (it_connection != connections_.end()) {
-    if (it_connection->second->GetExpiry() <= TimeEpochMilliseconds()) {
-      printf("remove expired connection %d\n", it_connection->first);
-      epoll_instance_.DeleteDescriptor(it_connection->first);
-      delete it_connection->second;
-      it_connection = connections_.erase(it_connection);
-    } else {
-      it_connection++;
+void HttpReactor::DeleteConnections() {
+  for (size_t i = 0; i < connections_.size(); i++) {
+    if (connections_[i] == nullptr) {
+      continue;
     }
+    LOG_DEBUG("remove connection %lu", i);
+    server_->GetMetrics()->RecordClose();
+    wheel_.Cancel(connections_[i]->GetTimer());
+    epoll_instance_.DeleteDescriptor(i);
+    delete connections_[i];
+    connections_[i] = nullptr;
+  }
+  connections_.clear();
+  for (size_t i = 0; i < closing_.size(); i++) {
+    delete closing_[i];
+  }
+  closing_.clear();
+  for (size_t i = 0; i < spare_.size(); i++) {
+    delete spare_[i];
+  }
+  spare_.clear();
+  count_ = 0;
+}
+
+void HttpReactor::DeleteExpiredConnections() {
+  expired_.clear();
+  if (wheel_.Advance(now_, expired_) == 0) {
+    return;
+  }
+  for (auto it = expired_.begin(); it != expired_.end(); it++) {
+    HttpConnection *connection = (HttpConnection *)(*it)->data;
+    LOG_DEBUG("remove expired connection %d", connection->GetDescriptor());
+    DeleteConnection(connection->GetDescriptor());
   }
 }
 
-void HttpServer::ClearTimer() {
+void HttpReactor::ArmTimer(HttpConnection *connection) {
+  wheel_.Schedule(connection->GetTimer(), now_ + kHttpConnectionTimeout);
+}
+
+void HttpReactor::ClearTimer() {
   timer_schedule_.it_interval.tv_sec = 0;
   timer_schedule_.it_interval.tv_nsec = 0;
   timer_schedule_.it_value.tv_sec = 0;
   timer_schedule_.it_value.tv_nsec = 0;
   if (timerfd_settime(timer_descriptor_, 0, &timer_schedule_, 0) == -1) {
-    printf("cannot clear timer\n");
+    LOG_ERROR("cannot clear timer");
   }
 }
 
-void HttpServer::ScheduleTimer(long duration) {
+void HttpReactor::ScheduleTimer(long duration) {
   timer_schedule_.it_interval.tv_sec = duration / 1000;
-  timer_schedule_.it_interval.tv_nsec = 0;
+  timer_schedule_.it_interval.tv_nsec = (duration % 1000) * 1000000;
   timer_schedule_.it_value.tv_sec = duration / 1000;
-  timer_schedule_.it_value.tv_nsec = 0;
+  timer_schedule_.it_value.tv_nsec = (duration % 1000) * 1000000;
   if (timerfd_settime(timer_descriptor_, 0, &timer_schedule_, 0) == -1) {
-    printf("cannot schedule timer\n");
+    LOG_ERROR("cannot schedule timer");
   }
 }
 
-bool HttpServer::IsTimerScheduled() {
+bool HttpReactor::IsTimerScheduled() {
   if (timerfd_gettime(timer_descriptor_, &timer_current_) == -1) {
     return false;
   }
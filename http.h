@@ -23,26 +23,74 @@ SOFTWARE. */
 #pragma once
 
 #include <atomic>
+#include <charconv>
+#include <climits>
+#include <cmath>
 #include <deque>
 #include <functional>
+#include <list>
 #include <map>
 #include <mutex>
 #include <signal.h>
 #include <sstream>
 #include <string.h>
 #include <string>
+#include <string_view>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
 #include <sys/signalfd.h>
 #include <sys/timerfd.h>
 #include <thread>
 #include <unordered_map>
+#include <unordered_set>
+#include <vector>
 
+#include "compression.h"
+#include "log.h"
+#include "metrics.h"
+#include "pool.h"
 #include "tcp.h"
+#include "timer.h"
 
 const std::string kHttpProtocol1_1 = "HTTP/1.1";
 const std::string kHttpLineFeed = "\r\n";
 const std::string kHttpDoubleLineFeed = "\r\n\r\n";
 const long kHttpConnectionTimeout = 10000;
 const long kHttpTick = 60000;
+const size_t kHttpMaximumMethodLength = 16;
+const size_t kHttpMaximumChunkLine = 1024;
+const size_t kHttpMaximumUrlLength = 8192;
+const size_t kHttpMaximumHeaderLength = 65536;
+const size_t kHttpInlineBodySize = 4096;
+const size_t kHttpHighWaterMark = 65536;
+const size_t kHttpSpareConnections = 1024;
+const size_t kHttpFileCacheSize = 1024;
+const long kHttpFileCheckInterval = 1000;
+const long kHttpCacheTimeToLive = 60000;
+const size_t kHttpCacheCapacity = 16777216;
+const size_t kHttpCompressionMinimum = 1024;
+const size_t kHttpCompressionFileLimit = 8388608;
+const int kHttpCompressionFileLevel = 6;
+const size_t kHttpMethods = 11;
+const size_t kHttpInlineHeaders = 16;
+const size_t kHttpRequestBlockSize = 256;
+const int kHttpMaximumStatus = 600;
+const std::string kHttpServerName = "alvagis version 1.0";
+const std::string kHttpMetricsUrl = "/metrics";
+const std::string kHttpMetricsContentType = "text/plain; version=0.0.4";
+const size_t kHttpReservedDescriptors = 64;
+const long kHttpQueueTarget = 5;
+const long kHttpQueueInterval = 100;
+const std::string kHttpRetryAfter = "1";
+const size_t kHttpRateLimitCapacity = 262144;
+const size_t kHttpRateLimitShards = 64;
+const size_t kHttpRateLimitWays = 8;
+const long kHttpDrainTimeout = 30000;
+const long kHttpDrainLinger = 1000;
+const uint16_t kHttpRingBuffers = 512;
+const uint32_t kHttpRingBufferSize = 4096;
+const size_t kHttpRingSegments = 16;
+const uint64_t kHttpRingOperationMask = 7;
 
 enum HttpMethod {
   INVALID = 0,
@@ -86,50 +134,144 @@ enum HttpStatus {
   UNPROCESSABLE_ENTITY = 422,
   LOCKED = 423,
   TOO_MANY_REQUESTS = 429,
+  REQUEST_HEADER_FIELDS_TOO_LARGE = 431,
   INTERNAL_SERVER_ERROR = 500,
   NOT_IMPLEMENTED = 501,
   BAD_GATEWAY = 502,
   SERVICE_UNAVAILABLE = 503,
 };
 
+enum HttpHeader {
+  HEADER_OTHER = 0,
+  HEADER_ACCEPT,
+  HEADER_ACCEPT_ENCODING,
+  HEADER_ACCEPT_LANGUAGE,
+  HEADER_ALLOW,
+  HEADER_AUTHORIZATION,
+  HEADER_CACHE_CONTROL,
+  HEADER_CONNECTION,
+  HEADER_CONTENT_ENCODING,
+  HEADER_CONTENT_LENGTH,
+  HEADER_CONTENT_TYPE,
+  HEADER_COOKIE,
+  HEADER_DATE,
+  HEADER_ETAG,
+  HEADER_EXPECT,
+  HEADER_HOST,
+  HEADER_IF_MODIFIED_SINCE,
+  HEADER_IF_NONE_MATCH,
+  HEADER_LAST_MODIFIED,
+  HEADER_LOCATION,
+  HEADER_RETRY_AFTER,
+  HEADER_SERVER,
+  HEADER_SET_COOKIE,
+  HEADER_TRANSFER_ENCODING,
+  HEADER_USER_AGENT,
+  HEADER_VARY,
+  HEADER_COUNT
+};
+
+struct HttpRequestHeader {
+  HttpHeader token;
+  std::string_view key;
+  std::string_view value;
+};
+
+struct HttpResponseHeader {
+  HttpHeader token;
+  std::string key;
+  std::string value;
+};
+
 class HttpConstants {
 public:
   static std::string GetStatusString(int status);
   static std::string GetMethodString(const HttpMethod method);
-  static HttpMethod GetMethod(const std::string method_string);
+  static HttpMethod GetMethod(std::string_view method_string);
+  static HttpHeader GetHeader(std::string_view name);
+  static std::string_view GetHeaderName(HttpHeader header);
+  static std::string FormatDate(time_t time);
+  static time_t ParseDate(std::string_view date);
+};
+
+class HttpClock {
+public:
+  static void Tick();
+  static std::string_view GetDate();
+
+private:
+  static void Refresh(time_t now);
+  static thread_local bool driven_;
+  static thread_local time_t second_;
+  static thread_local std::string date_;
 };
 
 class HttpRequest {
 public:
   HttpRequest();
+  HttpRequest(const HttpRequest &request);
+  HttpRequest &operator=(const HttpRequest &request);
   virtual ~HttpRequest();
   void Initialize();
   void SetMethod(const HttpMethod method);
   const HttpMethod &GetMethod() const;
-  void SetUrl(const std::string &url);
-  const std::string &GetUrl() const;
-  void SetProtocol(const std::string &protocol);
-  const std::string &GetProtocol() const;
-  void AddHeader(const std::string &key, const std::string &value);
-  void AddHeader(const std::string &key, size_t value);
-  const std::string GetHeader(const std::string &key) const;
-  void SetBody(const std::string &body);
-  void AppendToBody(const std::string &text);
-  const std::string &GetBody() const;
+  void SetUrl(std::string_view url);
+  std::string_view GetUrl() const;
+  std::string_view GetPath() const;
+  std::string_view GetQuery() const;
+  std::string_view GetParameter(std::string_view name) const;
+  const size_t CountParameters() const;
+  void SetProtocol(std::string_view protocol);
+  std::string_view GetProtocol() const;
+  void AddHeader(std::string_view key, std::string_view value);
+  void AddHeader(std::string_view key, size_t value);
+  std::string_view GetHeader(std::string_view key) const;
+  std::string_view GetHeader(HttpHeader header) const;
+  void SetBody(std::string_view body);
+  void AppendToBody(std::string_view text);
+  std::string_view GetBody() const;
   const std::string AsString() const;
   const size_t CountHeaders() const;
+  void Own();
 
 private:
+  friend class HttpParser;
+  friend class HttpRouter;
+  typedef std::pair<std::string_view, std::string_view> Header;
+  std::string_view Keep(std::string_view first,
+                        std::string_view second = std::string_view());
+  void Reserve(size_t length);
+  void SplitUrl();
   HttpMethod method_;
-  std::string url_;
-  std::string protocol_;
-  std::map<std::string, std::string> headers_;
-  std::string body_;
+  std::string_view url_;
+  std::string_view path_;
+  std::string_view query_;
+  std::string_view protocol_;
+  SmallVector<HttpRequestHeader, kHttpInlineHeaders> headers_;
+  std::vector<Header> parameters_;
+  std::string_view body_;
+  std::list<std::string> storage_;
+};
+
+// Streaming responses pull their body from a producer. It appends the next
+// chunk to the given string and returns false once the body is complete.
+typedef std::function<bool(std::string &)> HttpProducer;
+
+struct HttpPrefix {
+  std::string protocol;
+  int status;
+  std::string message;
+  SmallVector<HttpResponseHeader, kHttpInlineHeaders> headers;
+  std::string bytes;
 };
 
 class HttpResponse {
 public:
   HttpResponse();
+  HttpResponse(const HttpResponse &response) = default;
+  HttpResponse(HttpResponse &&response) = default;
+  HttpResponse &operator=(const HttpResponse &response) = default;
+  HttpResponse &operator=(HttpResponse &&response) = default;
   virtual ~HttpResponse();
   void Initialize();
   void SetProtocol(const std::string &protocol);
@@ -138,96 +280,628 @@ public:
   const int GetStatus() const;
   void SetMessage(const std::string &message);
   const std::string &GetMessage() const;
-  void AddHeader(const std::string &key, const std::string &value);
-  void AddHeader(const std::string &key, size_t value);
-  const std::string GetHeader(const std::string &key) const;
+  void AddHeader(std::string_view key, std::string_view value);
+  void AddHeader(std::string_view key, size_t value);
+  void AddHeader(HttpHeader header, std::string_view value);
+  void AddHeader(HttpHeader header, size_t value);
+  std::string_view GetHeader(std::string_view key) const;
+  std::string_view GetHeader(HttpHeader header) const;
+  void RemoveHeader(std::string_view key);
+  void RemoveHeader(HttpHeader header);
+  const size_t CountHeaders() const;
   void SetBody(const std::string &body);
+  void SetBody(std::shared_ptr<const std::string> body);
   const std::string &GetBody() const;
   static HttpResponse Build(const int status);
   static HttpResponse Build(const int status, const std::string &body);
+  static HttpResponse Stream(const int status, HttpProducer producer);
+  void SetProducer(HttpProducer producer);
+  const HttpProducer &GetProducer() const;
+  bool IsStreaming() const;
+  void SetFile(std::shared_ptr<TcpFile> file, off_t offset, size_t length);
+  bool HasFile() const;
   const std::string AsString() const;
+  void WriteTo(TcpWriter *writer);
 
 private:
+  friend class HttpTemplate;
+  friend class HttpResponseCache;
+  HttpResponse(std::shared_ptr<const HttpPrefix> prefix);
+  static std::shared_ptr<const HttpPrefix> GetPrefix(int status);
+  void Thaw();
+  void AppendHead(std::string &head) const;
+  bool AppendFields(std::string &head, bool replay) const;
+  size_t FindHeader(HttpHeader header, std::string_view key);
+  std::shared_ptr<const HttpPrefix> prefix_;
   std::string protocol_;
   int status_;
   std::string message_;
-  std::map<std::string, std::string> headers_;
+  SmallVector<HttpResponseHeader, kHttpInlineHeaders> headers_;
   std::string body_;
+  std::shared_ptr<const std::string> shared_body_;
+  HttpProducer producer_;
+  std::shared_ptr<TcpFile> file_;
+  off_t file_offset_;
+  size_t file_length_;
+};
+
+class HttpTemplate {
+public:
+  HttpTemplate(const HttpResponse &prototype);
+  virtual ~HttpTemplate();
+  HttpResponse Build() const;
+  HttpResponse Build(const std::string &body) const;
+  HttpResponse Build(std::string &&body) const;
+  static std::shared_ptr<const HttpPrefix>
+  Freeze(const HttpResponse &prototype);
+
+private:
+  std::shared_ptr<const HttpPrefix> prefix_;
 };
 
 typedef std::function<HttpResponse(const HttpRequest &)> HttpCallback;
 
+class HttpCompression {
+public:
+  HttpCompression(int level, size_t minimum);
+  virtual ~HttpCompression();
+  bool Apply(ContentEncoding encoding, HttpResponse &response) const;
+  int GetLevel() const;
+  size_t GetMinimum() const;
+  static ContentEncoding Negotiate(const HttpRequest &request);
+  static bool IsCompressible(std::string_view type);
+
+private:
+  int level_;
+  size_t minimum_;
+};
+
+class HttpResponseCache {
+public:
+  HttpResponseCache(long ttl, size_t capacity,
+                    const std::vector<std::string> &headers);
+  virtual ~HttpResponseCache();
+  bool Respond(const HttpRequest &request, ContentEncoding encoding,
+               TcpWriter *writer, bool keep_alive);
+  void Store(const HttpRequest &request, ContentEncoding encoding,
+             const HttpResponse &response);
+  void Invalidate();
+  void Invalidate(std::string_view path);
+  size_t GetHits() const;
+  size_t GetMisses() const;
+  size_t GetSize();
+  size_t Count();
+
+private:
+  struct Entry {
+    std::string key;
+    std::string path;
+    std::shared_ptr<const std::string> head;
+    std::shared_ptr<const std::string> body;
+    long expires;
+  };
+  std::string GetKey(const HttpRequest &request,
+                     ContentEncoding encoding) const;
+  bool IsPersonal(const HttpRequest &request) const;
+  static bool IsShareable(const HttpResponse &response);
+  void Erase(std::list<Entry>::iterator entry);
+  long ttl_;
+  size_t capacity_;
+  std::vector<std::string> headers_;
+  std::mutex mutex_;
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  size_t size_;
+  std::atomic<size_t> hits_;
+  std::atomic<size_t> misses_;
+};
+
+// Handlers that opt into streamed request bodies receive every body fragment
+// as it arrives, before their callback is executed. Bodies that did not fit
+// into one read are not kept in the request. Returning false rejects it.
+typedef std::function<bool(const HttpRequest &, std::string_view)>
+    HttpBodyCallback;
+
+enum HttpExecution { EXECUTE_INLINE = 0, EXECUTE_POOLED };
+
 class HttpHandler {
 public:
   HttpHandler();
   HttpHandler(const HttpMethod method, const std::string &url,
               HttpCallback callback);
+  HttpHandler(const HttpHandler &handler) = delete;
+  HttpHandler &operator=(const HttpHandler &handler) = delete;
   virtual ~HttpHandler();
   void SetMethod(const HttpMethod method);
   const HttpMethod &GetMethod() const;
   void SetUrl(const std::string &url);
   const std::string &GetUrl() const;
+  void SetId(size_t id);
+  size_t GetId() const;
   void SetCallback(HttpCallback callback);
   HttpCallback GetCallback();
+  void SetExecution(const HttpExecution execution);
+  const HttpExecution &GetExecution() const;
+  void SetBodyCallback(HttpBodyCallback body_callback);
+  HttpBodyCallback GetBodyCallback();
+  void SetCache(long ttl = kHttpCacheTimeToLive,
+                size_t capacity = kHttpCacheCapacity,
+                const std::vector<std::string> &headers = {});
+  HttpResponseCache *GetCache();
+  void SetCompression(int level = kCompressionLevel,
+                      size_t minimum = kHttpCompressionMinimum);
+  HttpCompression *GetCompression();
+  bool Respond(const HttpRequest &request, TcpWriter *writer, bool keep_alive);
+  HttpResponse Execute(const HttpRequest &request);
 
 private:
+  ContentEncoding GetEncoding(const HttpRequest &request) const;
   HttpMethod method_;
   std::string url_;
+  size_t id_;
   HttpCallback callback_;
+  HttpExecution execution_;
+  HttpBodyCallback body_callback_;
+  HttpResponseCache *cache_;
+  HttpCompression *compression_;
+};
+
+enum HttpBackend { BACKEND_EPOLL = 0, BACKEND_URING };
+
+// Operations a reactor keeps in flight on its io_uring instance. The
+// operation is stored in the low bits of the tag, the connection, if any,
+// in the remaining bits.
+enum HttpRingOperation {
+  RING_ACCEPT = 0,
+  RING_EVENT,
+  RING_TIMER,
+  RING_CANCEL,
+  RING_RECEIVE,
+  RING_SEND,
+  RING_POLL
 };
 
 enum HttpStage { START = 0, METHOD, URL, PROTOCOL, HEADER, BODY, END, FAILED };
 
+class HttpParser {
+public:
+  HttpParser();
+  virtual ~HttpParser();
+  void Reset();
+  HttpStage Parse(std::string_view data, HttpRequest &request);
+  void ReadHead(std::string_view data, HttpRequest &request);
+  void Stream();
+  std::string_view GetFragment() const;
+  size_t Release();
+  const HttpStage GetStage() const;
+  const int GetStatus() const;
+  size_t GetLength() const;
+
+private:
+  enum ChunkStage { CHUNK_SIZE = 0, CHUNK_DATA, CHUNK_END, CHUNK_TRAILER };
+  struct Span {
+    size_t offset;
+    size_t length;
+  };
+  static Span Trim(std::string_view data, size_t offset, size_t length);
+  static bool IsChunked(std::string_view value);
+  HttpStage Decode(std::string_view data);
+  HttpStage Fail(int status = BAD_REQUEST);
+  HttpStage stage_;
+  int status_;
+  size_t offset_;
+  HttpMethod method_;
+  Span url_;
+  Span protocol_;
+  std::vector<std::pair<Span, Span>> headers_;
+  size_t head_length_;
+  size_t content_length_;
+  bool has_length_;
+  bool chunked_;
+  bool streaming_;
+  ChunkStage chunk_stage_;
+  size_t remaining_;
+  std::string decoded_;
+  std::string_view fragment_;
+};
+
 class HttpConnection {
 public:
-  HttpConnection(TcpSocket *socket);
+  HttpConnection();
   virtual ~HttpConnection();
   const HttpStage GetStage() const;
+  TcpSocket *GetSocket();
   TcpReader *GetReader();
   TcpWriter *GetWriter();
-  const HttpRequest &GetRequest();
+  HttpRequest &GetRequest();
+  HttpParser *GetParser();
   void Parse();
+  void BeginUpload(HttpHandler *handler);
+  bool Upload();
+  HttpHandler *GetUpload();
+  bool IsUploading();
+  void SetInspected(bool inspected);
+  bool IsInspected();
+  void Respond(HttpResponse response);
+  void Produce();
+  bool IsStreaming();
   void Restart();
+  void Close();
   bool IsGood();
-  long GetExpiry();
+  int GetDescriptor();
+  TimerNode *GetTimer();
+  void SetId(uint32_t id);
+  uint32_t GetId();
+  void SetPending(bool pending);
+  bool IsPending();
+  void SetKeepAlive(bool keep_alive);
+  bool IsKeepAlive();
+  void SetEvents(int events);
+  int GetEvents();
+  void SetOperations(int operations);
+  int GetOperations();
+  void SetReceived(long received);
+  long GetReceived();
+  struct msghdr *Gather();
 
 private:
   HttpRequest request_;
-  HttpStage stage_;
-  TcpReader *reader_;
-  TcpWriter *writer_;
-  TcpSocket *socket_;
-  long expiry_;
+  HttpParser parser_;
+  HttpProducer producer_;
+  HttpHandler *upload_;
+  bool inspected_;
+  TcpSocket socket_;
+  TcpReader reader_;
+  TcpWriter writer_;
+  TimerNode timer_;
+  uint32_t id_;
+  bool pending_;
+  bool keep_alive_;
+  int events_;
+  int operations_;
+  long received_;
+  struct msghdr message_;
+  struct iovec vector_[kHttpRingSegments];
 };
 
-class HttpServer {
+struct HttpCompletion {
+  int descriptor;
+  uint32_t id;
+  HttpResponse response;
+};
+
+struct HttpRoute {
+  HttpHandler *handler;
+  int status;
+  std::string_view allow;
+};
+
+class HttpRouter {
 public:
-  typedef std::multimap<std::string, HttpHandler>::iterator HandlerIterator;
-  typedef std::pair<HandlerIterator, HandlerIterator> HandlerRange;
-  HttpServer();
-  virtual ~HttpServer();
-  void RegisterHandler(HttpMethod method, const std::string &url,
-                       HttpCallback callback);
-  HttpResponse ExecuteHandler(const HttpRequest &request);
-  void Serve(const std::string &service, const std::string &host);
+  HttpRouter();
+  virtual ~HttpRouter();
+  HttpHandler *Insert(HttpMethod method, const std::string &url,
+                      HttpCallback callback);
+  HttpRoute Find(HttpRequest &request);
+  const std::vector<HttpHandler *> &GetHandlers() const;
+
+private:
+  struct Node {
+    std::string prefix;
+    std::string indices;
+    std::vector<Node *> children;
+    Node *parameter;
+    Node *wildcard;
+    std::string name;
+    HttpHandler *handlers[kHttpMethods];
+    std::string allow;
+  };
+  static Node *CreateNode(const std::string &prefix);
+  static void DeleteNode(Node *node);
+  static Node *InsertStatic(Node *node, const std::string &text);
+  static Node *Match(Node *node, std::string_view path,
+                     std::vector<HttpRequest::Header> &parameters);
+  static bool HasHandlers(Node *node);
+  Node *root_;
+  std::vector<HttpHandler *> handlers_;
+};
+
+class HttpFileCache {
+public:
+  HttpFileCache(const std::string &directory, ThreadPool *pool);
+  virtual ~HttpFileCache();
+  HttpResponse Serve(const HttpRequest &request);
+
+private:
+  struct Entry {
+    std::string path;
+    std::shared_ptr<TcpFile> file;
+    size_t size;
+    time_t modified;
+    long checked;
+    std::string tag;
+    std::string date;
+    std::string type;
+    std::shared_ptr<const std::string> variants[ENCODING_COUNT];
+  };
+  bool Lookup(const std::string &path, Entry &entry);
+  bool Open(const std::string &path, Entry &entry);
+  std::shared_ptr<const std::string> GetVariant(const std::string &path,
+                                                const Entry &entry,
+                                                ContentEncoding encoding);
+  void BuildVariant(const std::string &path, std::shared_ptr<TcpFile> file,
+                    size_t size, ContentEncoding encoding);
+  void Erase(std::list<Entry>::iterator entry);
+  static bool IsSafe(std::string_view path);
+  static bool IsNotModified(const HttpRequest &request, const Entry &entry,
+                            const std::string &tag);
+  static std::string GetContentType(const std::string &path);
+  std::string directory_;
+  ThreadPool *pool_;
+  std::mutex mutex_;
+  std::list<Entry> entries_;
+  std::unordered_map<std::string, std::list<Entry>::iterator> index_;
+  std::unordered_set<std::string> compressing_;
+};
+
+// Server metrics in the Prometheus text format. Every route gets a latency
+// histogram and response counters by status code, requests that match no
+// route are accounted under an empty route label.
+class HttpMetrics {
+public:
+  HttpMetrics();
+  virtual ~HttpMetrics();
+  void Setup(const std::vector<HttpHandler *> &handlers);
+  void RecordAccept();
+  void RecordClose();
+  void RecordParseFailure();
+  void RecordShed();
+  void RecordThrottle();
+  void RecordPause();
+  void RecordTransfer(size_t received, size_t sent);
+  void RecordResponse(const HttpHandler *handler, int status, long duration);
+  std::string Render();
+
+private:
+  size_t GetRoute(const HttpHandler *handler) const;
+  MetricsRegistry registry_;
+  size_t accepted_;
+  size_t active_;
+  size_t failures_;
+  size_t shed_;
+  size_t throttled_;
+  size_t pauses_;
+  size_t received_;
+  size_t sent_;
+  std::vector<size_t> latencies_;
+  std::vector<size_t> responses_;
+};
+
+// Load shedding in the style of CoDel as it is applied to request queues.
+// A queue that drained below the target delay at least once during the last
+// interval is considered healthy. Otherwise there is a standing queue, and
+// requests that waited more than twice the target are rejected until a
+// request gets through quickly again. Delays are passed in microseconds,
+// the target and the interval are configured in milliseconds. The
+// controller is lock-free and may be shared by worker threads.
+class HttpAdmission {
+public:
+  HttpAdmission(long target = kHttpQueueTarget,
+                long interval = kHttpQueueInterval);
+  virtual ~HttpAdmission();
+  void Configure(long target, long interval);
+  long GetTarget() const;
+  long GetInterval() const;
+  bool Admit(long sojourn, long now);
+  bool IsOverloaded() const;
+
+private:
+  long target_;
+  long interval_;
+  std::atomic<long> deadline_;
+  std::atomic<long> minimum_;
+  std::atomic<bool> overloaded_;
+  std::atomic<bool> resetting_;
+};
+
+// Token buckets per client in a table of fixed size. The table is split
+// into shards with a lock each, and every key maps to a set of a few
+// buckets within its shard. A key that finds no bucket in its set replaces
+// the bucket that has been idle the longest, so memory stays bounded no
+// matter how many clients show up. Buckets are refilled lazily when they
+// are used. Keys are the peer address, optionally combined with the value of
+// a request header such as an API key.
+class HttpRateLimiter {
+public:
+  HttpRateLimiter(double rate, size_t burst,
+                  const std::string &header = kStringEmpty,
+                  size_t capacity = kHttpRateLimitCapacity);
+  HttpRateLimiter(const HttpRateLimiter &limiter) = delete;
+  HttpRateLimiter &operator=(const HttpRateLimiter &limiter) = delete;
+  virtual ~HttpRateLimiter();
+  long Acquire(std::string_view address, const HttpRequest &request,
+               long now);
+  long Acquire(uint64_t key, long now);
+  double GetRate() const;
+  size_t GetBurst() const;
+  size_t GetCapacity() const;
+  static uint64_t GetKey(std::string_view address, std::string_view value);
 
 private:
-  bool SetupServerSocket(const std::string &service, const std::string &host);
+  struct Bucket {
+    uint64_t key;
+    long updated;
+    double tokens;
+  };
+  struct alignas(64) Shard {
+    std::mutex mutex;
+    std::vector<Bucket> buckets;
+  };
+  double rate_;
+  double burst_;
+  std::string header_;
+  HttpHeader token_;
+  size_t sets_;
+  Shard shards_[kHttpRateLimitShards];
+};
+
+class HttpServer;
+
+class HttpReactor {
+public:
+  HttpReactor(HttpServer *server);
+  virtual ~HttpReactor();
+  bool Setup(const std::string &service, const std::string &host,
+             bool reuse_port, int inherited = -1);
+  int GetListener();
+  void Run();
+  void Wake();
+  void Release();
+  void Complete(int descriptor, uint32_t id, HttpResponse response);
+
+private:
+  bool SetupServerSocket();
+  bool SetupRing();
+  void RunRing();
+  bool IsDrained();
+  void AcceptConnections();
+  void AcceptRing(int result, bool more);
+  void ReceiveRing(HttpConnection *connection, int result, int buffer,
+                   bool more);
+  void SendRing(HttpConnection *connection, HttpRingOperation operation,
+                int result);
+  bool SubmitRing(int descriptor, HttpConnection *connection);
+  bool IsClosing(HttpConnection *connection);
+  static uint64_t GetRingTag(HttpConnection *connection,
+                             HttpRingOperation operation);
+  bool ServeConnection(int descriptor, HttpConnection *connection,
+                       bool readable);
+  bool Dispatch(int descriptor, HttpConnection *connection,
+                HttpHandler *handler);
+  bool ExecuteRequests(int descriptor, HttpConnection *connection);
+  void InspectRequest(HttpConnection *connection);
+  void RejectUpload(HttpConnection *connection);
+  bool WatchConnection(int descriptor, HttpConnection *connection);
+  void ProcessCompletions();
+  void Wake(long idle);
+  void Account(HttpConnection *connection);
+  void Shed(HttpConnection *connection);
+  bool Throttle(HttpConnection *connection);
+  void PauseAccepting();
+  void ResumeAccepting();
+  void Drain();
+  HttpConnection *AddConnection(int &error, int accepted = -1);
+  HttpConnection *FindConnection(int descriptor, uint32_t id);
   void DeleteConnection(int descriptor);
+  void RecycleConnection(HttpConnection *connection);
   void DeleteConnections();
   void DeleteExpiredConnections();
+  void ArmTimer(HttpConnection *connection);
   void ClearTimer();
   void ScheduleTimer(long duration);
   bool IsTimerScheduled();
-  std::atomic<bool> running_;
+  HttpServer *server_;
+  std::string service_;
+  std::string host_;
+  bool reuse_port_;
+  int inherited_;
   TcpSocket server_socket_;
-  std::multimap<std::string, HttpHandler> handlers_;
   EpollInstance epoll_instance_;
-  std::map<int, HttpConnection *> connections_;
-  sigset_t sigset_;
-  int signal_descriptor_;
-  struct signalfd_siginfo signal_info_;
+  UringInstance ring_;
+  bool uring_;
+  bool accepting_;
+  uint64_t event_value_;
+  uint64_t timer_value_;
+  std::vector<HttpConnection *> connections_;
+  std::vector<HttpConnection *> spare_;
+  std::vector<HttpConnection *> closing_;
+  size_t count_;
+  size_t limit_;
+  bool paused_;
+  bool draining_;
+  HttpAdmission admission_;
+  long woken_;
+  long arrived_;
+  TimerWheel wheel_;
+  std::vector<TimerNode *> expired_;
+  long now_;
+  std::mutex completion_mutex_;
+  std::deque<HttpCompletion> completions_;
+  uint32_t sequence_;
+  int event_descriptor_;
   int timer_descriptor_;
   struct itimerspec timer_current_;
   struct itimerspec timer_schedule_;
 };
+
+class HttpServer {
+public:
+  HttpServer();
+  virtual ~HttpServer();
+  HttpHandler *RegisterHandler(HttpMethod method, const std::string &url,
+                              HttpCallback callback);
+  HttpHandler *RegisterFiles(const std::string &url,
+                             const std::string &directory);
+  HttpHandler *RegisterMetrics(const std::string &url = kHttpMetricsUrl);
+  HttpRoute FindRoute(HttpRequest &request);
+  HttpResponse ExecuteHandler(HttpRequest &request);
+  HttpResponse ExecuteHandler(const HttpRoute &route,
+                              const HttpRequest &request);
+  void SetWorkers(size_t workers);
+  void SetEdgeTriggered(bool edge_triggered);
+  bool IsEdgeTriggered();
+  void SetBackend(HttpBackend backend);
+  HttpBackend GetBackend();
+  void SetMaximumConnections(size_t maximum_connections);
+  size_t GetMaximumConnections();
+  size_t GetReactorConnections();
+  void SetQueueTarget(long target, long interval = kHttpQueueInterval);
+  HttpAdmission *GetAdmission();
+  HttpResponse Shed();
+  void SetRateLimit(double rate, size_t burst,
+                    const std::string &header = kStringEmpty,
+                    size_t capacity = kHttpRateLimitCapacity);
+  HttpRateLimiter *GetRateLimiter();
+  HttpResponse Throttle(long wait);
+  void SetUpgradePath(const std::string &path,
+                      long drain_timeout = kHttpDrainTimeout);
+  bool IsDraining();
+  long GetDrainDeadline();
+  ThreadPool *GetPool();
+  HttpMetrics *GetMetrics();
+  void Serve(const std::string &service, const std::string &host,
+             size_t reactors = 1);
+  void Stop();
+  bool IsRunning();
+
+private:
+  bool HasPooledHandlers();
+  void DeleteReactors();
+  void InheritListeners(std::vector<int> &listeners);
+  bool HandOver();
+  std::atomic<bool> running_;
+  HttpRouter router_;
+  HttpMetrics metrics_;
+  ThreadPool pool_;
+  size_t workers_;
+  bool edge_triggered_;
+  HttpBackend backend_;
+  size_t maximum_connections_;
+  size_t reactor_connections_;
+  HttpAdmission admission_;
+  HttpTemplate shed_;
+  HttpRateLimiter *rate_limiter_;
+  std::string upgrade_path_;
+  long drain_timeout_;
+  std::atomic<bool> draining_;
+  std::atomic<long> drain_deadline_;
+  UnixSocket upgrade_socket_;
+  std::vector<HttpReactor *> reactors_;
+  std::vector<HttpFileCache *> files_;
+  std::vector<std::thread> threads_;
+  EpollInstance epoll_instance_;
+  sigset_t sigset_;
+  int signal_descriptor_;
+  int event_descriptor_;
+  struct signalfd_siginfo signal_info_;
+};
@@ -0,0 +1,418 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include <chrono>
+#include <deque>
+
+#include <getopt.h>
+#include <sys/resource.h>
+
+#include "histogram.h"
+#include "http.h"
+
+const std::string kLoadHost = "127.0.0.1";
+const std::string kLoadService = "8080";
+const std::string kLoadPath = "/";
+const size_t kLoadConnections = 64;
+const size_t kLoadPipeline = 1;
+const long kLoadDuration = 10;
+
+struct LoadOptions {
+  std::string host;
+  std::string service;
+  std::string path;
+  size_t connections;
+  size_t pipeline;
+  long duration;
+  double rate;
+};
+
+struct LoadConnection {
+  LoadConnection() : reader(&socket), writer(&socket), connecting(false),
+                     events(0) {}
+  TcpSocket socket;
+  TcpReader reader;
+  TcpWriter writer;
+  std::deque<int64_t> starts;
+  bool connecting;
+  int events;
+};
+
+struct LoadResult {
+  LatencyHistogram latency;
+  uint64_t completed = 0;
+  uint64_t connect_errors = 0;
+  uint64_t socket_errors = 0;
+  uint64_t status_errors = 0;
+  uint64_t unsent = 0;
+  uint64_t outstanding = 0;
+  double elapsed = 0.0;
+};
+
+int64_t Now() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+// Consumes one response from the reader and stores its status code. Returns
+// false if the buffer does not yet hold a complete response.
+bool PopResponse(TcpReader *reader, int &status) {
+  size_t head = reader->GetPosition(kHttpDoubleLineFeed);
+  if (head == std::string::npos) {
+    return false;
+  }
+  std::string_view buffer = reader->GetBuffer();
+  size_t length = 0;
+  size_t line = buffer.find(kHttpLineFeed);
+  std::string_view status_line = buffer.substr(0, line);
+  size_t space = status_line.find(' ');
+  status = 0;
+  if (space != std::string::npos) {
+    std::from_chars(status_line.data() + space + 1,
+                    status_line.data() + status_line.length(), status);
+  }
+  while (line < head) {
+    size_t next = buffer.find(kHttpLineFeed, line + kHttpLineFeed.length());
+    std::string_view header =
+        buffer.substr(line + kHttpLineFeed.length(),
+                      next - line - kHttpLineFeed.length());
+    size_t colon = header.find(':');
+    if (colon != std::string::npos &&
+        StringEqualsNoCase(header.substr(0, colon), "content-length")) {
+      std::string_view value = header.substr(colon + 1);
+      while (!value.empty() && value.front() == ' ') {
+        value.remove_prefix(1);
+      }
+      std::from_chars(value.data(), value.data() + value.length(), length);
+    }
+    line = next;
+  }
+  size_t total = head + kHttpDoubleLineFeed.length() + length;
+  if (buffer.length() < total) {
+    return false;
+  }
+  reader->Consume(total);
+  return true;
+}
+
+class LoadGenerator {
+public:
+  LoadGenerator(const LoadOptions &options);
+  virtual ~LoadGenerator();
+  bool Run(LoadResult &result);
+
+private:
+  bool Connect(size_t index);
+  void Fail(size_t index, uint64_t &counter);
+  void Send(size_t index, int64_t start);
+  void Dispatch();
+  void Receive(size_t index);
+  void Watch(size_t index);
+  LoadOptions options_;
+  std::string request_;
+  std::vector<LoadConnection *> connections_;
+  std::deque<int64_t> backlog_;
+  EpollInstance epoll_instance_;
+  LoadResult *result_;
+  size_t next_;
+  int64_t now_;
+};
+
+LoadGenerator::LoadGenerator(const LoadOptions &options)
+    : options_(options), result_(nullptr), next_(0), now_(0) {
+  request_ = "GET " + options_.path + " " + kHttpProtocol1_1 + kHttpLineFeed +
+             "Host: " + options_.host + kHttpLineFeed + kHttpLineFeed;
+}
+
+LoadGenerator::~LoadGenerator() {
+  for (size_t i = 0; i < connections_.size(); i++) {
+    delete connections_[i];
+  }
+}
+
+bool LoadGenerator::Run(LoadResult &result) {
+  result_ = &result;
+  if (!epoll_instance_.Create()) {
+    fprintf(stderr, "cannot set up epoll instance\n");
+    return false;
+  }
+  for (size_t i = 0; i < options_.connections; i++) {
+    connections_.push_back(new LoadConnection());
+    if (!Connect(i)) {
+      fprintf(stderr, "cannot connect to %s:%s\n", options_.host.c_str(),
+              options_.service.c_str());
+      epoll_instance_.Release();
+      return false;
+    }
+  }
+  int64_t start = Now();
+  int64_t stop = start + options_.duration * 1000000000L;
+  int64_t interval = options_.rate > 0.0 ? (int64_t)(1e9 / options_.rate) : 0;
+  int64_t scheduled = start;
+  now_ = start;
+  while (now_ < stop) {
+    long timeout = (stop - now_ + 999999) / 1000000;
+    if (interval > 0) {
+      while (scheduled <= now_) {
+        backlog_.push_back(scheduled);
+        scheduled += interval;
+      }
+      Dispatch();
+      // Rounding down polls through the last millisecond before the next
+      // request is due instead of sending it late.
+      timeout = std::min(timeout, (long)((scheduled - now_) / 1000000));
+    }
+    int ready = epoll_instance_.Wait(timeout);
+    now_ = Now();
+    for (int i = 0; i < ready; i++) {
+      size_t index = epoll_instance_.GetTag(i);
+      LoadConnection *connection = connections_[index];
+      if (connection->socket.GetDescriptor() !=
+          epoll_instance_.GetDescriptor(i)) {
+        continue;
+      }
+      if (connection->connecting) {
+        if (epoll_instance_.HasErrors(i) || !connection->socket.IsGood()) {
+          Fail(index, result.connect_errors);
+          continue;
+        }
+        connection->connecting = false;
+        if (interval == 0) {
+          while (connection->starts.size() < options_.pipeline) {
+            Send(index, now_);
+          }
+        }
+      } else if (epoll_instance_.HasErrors(i)) {
+        Fail(index, result.socket_errors);
+        continue;
+      }
+      if (epoll_instance_.IsReadable(i)) {
+        Receive(index);
+        // A closed connection has been replaced by a new one, which waits
+        // for its connect to complete.
+        if (connection->socket.GetDescriptor() == -1 ||
+            connection->connecting) {
+          continue;
+        }
+      }
+      if (!connection->writer.IsEmpty()) {
+        connection->writer.SendSome();
+        if (connection->writer.HasErrors()) {
+          Fail(index, result.socket_errors);
+          continue;
+        }
+      }
+      Watch(index);
+    }
+  }
+  result.elapsed = (now_ - start) / 1e9;
+  result.unsent = backlog_.size();
+  for (size_t i = 0; i < connections_.size(); i++) {
+    result.outstanding += connections_[i]->starts.size();
+    connections_[i]->socket.Close();
+  }
+  epoll_instance_.Release();
+  return true;
+}
+
+bool LoadGenerator::Connect(size_t index) {
+  LoadConnection *connection = connections_[index];
+  connection->socket.Close();
+  connection->reader.Reset();
+  connection->writer.Reset();
+  connection->starts.clear();
+  if (!connection->socket.Connect(options_.service, options_.host, true)) {
+    return false;
+  }
+  connection->connecting = true;
+  connection->events = EPOLLOUT | EPOLLERR | EPOLLHUP;
+  return epoll_instance_.AddDescriptor(connection->socket.GetDescriptor(),
+                                       EPOLLOUT, index);
+}
+
+// Counts the failure, gives up the requests in flight on the connection and
+// opens a new one in its place. Lost open-loop requests are rescheduled with
+// their original start time.
+void LoadGenerator::Fail(size_t index, uint64_t &counter) {
+  LoadConnection *connection = connections_[index];
+  counter++;
+  if (options_.rate > 0.0) {
+    backlog_.insert(backlog_.begin(), connection->starts.begin(),
+                    connection->starts.end());
+  }
+  epoll_instance_.DeleteDescriptor(connection->socket.GetDescriptor());
+  if (!Connect(index)) {
+    result_->connect_errors++;
+    connection->socket.Close();
+  }
+}
+
+void LoadGenerator::Send(size_t index, int64_t start) {
+  LoadConnection *connection = connections_[index];
+  connection->writer.Write(request_);
+  connection->starts.push_back(start);
+}
+
+// Hands scheduled open-loop requests to connections with free pipeline
+// slots. Requests that find no slot wait in the backlog, and their latency
+// still counts from the scheduled time, which corrects for coordinated
+// omission.
+void LoadGenerator::Dispatch() {
+  size_t idle = 0;
+  while (!backlog_.empty() && idle < connections_.size()) {
+    size_t index = next_++ % connections_.size();
+    LoadConnection *connection = connections_[index];
+    if (connection->connecting || connection->socket.GetDescriptor() == -1 ||
+        connection->starts.size() >= options_.pipeline) {
+      idle++;
+      continue;
+    }
+    idle = 0;
+    Send(index, backlog_.front());
+    backlog_.pop_front();
+    connection->writer.SendSome();
+    if (connection->writer.HasErrors()) {
+      Fail(index, result_->socket_errors);
+      continue;
+    }
+    Watch(index);
+  }
+}
+
+void LoadGenerator::Receive(size_t index) {
+  LoadConnection *connection = connections_[index];
+  connection->reader.ReadSome();
+  int status = 0;
+  while (!connection->starts.empty() &&
+         PopResponse(&connection->reader, status)) {
+    result_->latency.Record((now_ - connection->starts.front()) / 1000);
+    connection->starts.pop_front();
+    result_->completed++;
+    if (status < 200 || status >= 400) {
+      result_->status_errors++;
+    }
+    if (options_.rate <= 0.0) {
+      Send(index, now_);
+    }
+  }
+  if (connection->reader.HasErrors()) {
+    Fail(index, result_->socket_errors);
+  }
+}
+
+void LoadGenerator::Watch(size_t index) {
+  LoadConnection *connection = connections_[index];
+  int events = EPOLLIN | EPOLLERR | EPOLLHUP;
+  if (connection->connecting || !connection->writer.IsEmpty()) {
+    events |= EPOLLOUT;
+  }
+  if (events == connection->events) {
+    return;
+  }
+  connection->events = events;
+  epoll_instance_.ModifyDescriptor(connection->socket.GetDescriptor(), events,
+                                   index);
+}
+
+void PrintUsage(const char *program) {
+  fprintf(stderr,
+          "usage: %s [-c connections] [-p pipeline] [-d seconds] "
+          "[-r requests per second] [-u path] [host] [port]\n",
+          program);
+}
+
+void PrintResult(const LoadOptions &options, const LoadResult &result) {
+  printf("mode: %s\n", options.rate > 0.0 ? "open loop" : "closed loop");
+  printf("connections: %lu\n", options.connections);
+  printf("pipeline: %lu\n", options.pipeline);
+  printf("duration: %.2f s\n", result.elapsed);
+  printf("requests: %lu\n", result.completed);
+  printf("throughput: %.1f requests/s\n",
+         result.elapsed > 0.0 ? result.completed / result.elapsed : 0.0);
+  printf("latency mean: %.1f us\n", result.latency.GetMean());
+  printf("latency min: %lu us\n", result.latency.GetMinimum());
+  printf("latency p50: %lu us\n", result.latency.GetPercentile(50.0));
+  printf("latency p90: %lu us\n", result.latency.GetPercentile(90.0));
+  printf("latency p99: %lu us\n", result.latency.GetPercentile(99.0));
+  printf("latency p99.9: %lu us\n", result.latency.GetPercentile(99.9));
+  printf("latency max: %lu us\n", result.latency.GetMaximum());
+  printf("connect errors: %lu\n", result.connect_errors);
+  printf("socket errors: %lu\n", result.socket_errors);
+  printf("status errors: %lu\n", result.status_errors);
+  printf("outstanding: %lu\n", result.outstanding);
+  if (options.rate > 0.0) {
+    printf("unsent: %lu\n", result.unsent);
+  }
+}
+
+int main(int argc, char **argv) {
+  LoadOptions options = {kLoadHost,        kLoadService,   kLoadPath,
+                         kLoadConnections, kLoadPipeline, kLoadDuration,
+                         0.0};
+  int option;
+  while ((option = getopt(argc, argv, "c:p:d:r:u:h")) != -1) {
+    switch (option) {
+    case 'c':
+      options.connections = strtoul(optarg, nullptr, 10);
+      break;
+    case 'p':
+      options.pipeline = strtoul(optarg, nullptr, 10);
+      break;
+    case 'd':
+      options.duration = strtol(optarg, nullptr, 10);
+      break;
+    case 'r':
+      options.rate = strtod(optarg, nullptr);
+      break;
+    case 'u':
+      options.path = optarg;
+      break;
+    default:
+      PrintUsage(argv[0]);
+      return 1;
+    }
+  }
+  if (optind < argc) {
+    options.host = argv[optind++];
+  }
+  if (optind < argc) {
+    options.service = argv[optind++];
+  }
+  if (options.connections == 0 || options.pipeline == 0 ||
+      options.duration <= 0) {
+    PrintUsage(argv[0]);
+    return 1;
+  }
+  struct rlimit limit;
+  if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max) {
+    limit.rlim_cur = limit.rlim_max;
+    setrlimit(RLIMIT_NOFILE, &limit);
+  }
+  LoadResult result;
+  LoadGenerator generator(options);
+  if (!generator.Run(result)) {
+    return 1;
+  }
+  PrintResult(options, result);
+  return 0;
+}
@@ -0,0 +1,275 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "log.h"
+
+namespace {
+
+struct LogRingHolder {
+  LogRing *ring = nullptr;
+  ~LogRingHolder() {
+    if (ring != nullptr) {
+      ring->Release();
+      ring = nullptr;
+    }
+  }
+};
+
+thread_local LogRingHolder ring_holder;
+
+const char *GetLevelString(int level) {
+  switch (level) {
+  case LOG_LEVEL_DEBUG:
+    return "DEBUG";
+  case LOG_LEVEL_INFO:
+    return "INFO";
+  case LOG_LEVEL_WARNING:
+    return "WARNING";
+  case LOG_LEVEL_ERROR:
+    return "ERROR";
+  default:
+    return "NONE";
+  }
+}
+
+void WriteDescriptor(int descriptor, const std::string &buffer) {
+  size_t written = 0;
+  while (written < buffer.length()) {
+    ssize_t bytes = write(descriptor, buffer.data() + written,
+                          buffer.length() - written);
+    if (bytes == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return;
+    }
+    written += bytes;
+  }
+}
+
+} // namespace
+
+std::atomic<int> Logger::level_(LOG_LEVEL_INFO);
+std::atomic<bool> Logger::running_(false);
+std::atomic<size_t> Logger::dropped_(0);
+std::mutex Logger::mutex_;
+std::condition_variable Logger::condition_;
+std::vector<LogRing *> Logger::rings_;
+std::thread Logger::flusher_;
+int Logger::descriptor_ = STDERR_FILENO;
+size_t Logger::threads_ = 0;
+size_t Logger::reported_ = 0;
+
+LogRing::LogRing(size_t thread)
+    : records_(new LogRecord[kLogSlots]), thread_(thread), head_(0), tail_(0),
+      released_(false) {}
+
+LogRing::~LogRing() { delete[] records_; }
+
+LogRecord *LogRing::Prepare() {
+  size_t head = head_.load(std::memory_order_relaxed);
+  if (head - tail_.load(std::memory_order_acquire) == kLogSlots) {
+    return nullptr;
+  }
+  return &records_[head % kLogSlots];
+}
+
+void LogRing::Commit() {
+  head_.store(head_.load(std::memory_order_relaxed) + 1,
+              std::memory_order_release);
+}
+
+LogRecord *LogRing::Peek() {
+  size_t tail = tail_.load(std::memory_order_relaxed);
+  if (tail == head_.load(std::memory_order_acquire)) {
+    return nullptr;
+  }
+  return &records_[tail % kLogSlots];
+}
+
+void LogRing::Pop() {
+  tail_.store(tail_.load(std::memory_order_relaxed) + 1,
+              std::memory_order_release);
+}
+
+void LogRing::Release() { released_.store(true, std::memory_order_release); }
+
+bool LogRing::IsReleased() {
+  return released_.load(std::memory_order_acquire);
+}
+
+bool LogRing::IsEmpty() {
+  return tail_.load(std::memory_order_acquire) ==
+         head_.load(std::memory_order_acquire);
+}
+
+size_t LogRing::GetThread() { return thread_; }
+
+bool Logger::Start(const std::string &path) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (running_) {
+    return false;
+  }
+  descriptor_ = STDERR_FILENO;
+  if (!path.empty()) {
+    descriptor_ =
+        open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND | O_CLOEXEC, 0644);
+    if (descriptor_ == -1) {
+      descriptor_ = STDERR_FILENO;
+      return false;
+    }
+  }
+  // The flusher inherits a fully blocked signal mask so that signals keep
+  // reaching the threads that wait for them on a signal descriptor.
+  sigset_t all, previous;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &previous);
+  running_ = true;
+  flusher_ = std::thread(&Logger::Flush);
+  pthread_sigmask(SIG_SETMASK, &previous, nullptr);
+  return true;
+}
+
+void Logger::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_) {
+      return;
+    }
+    running_ = false;
+  }
+  condition_.notify_one();
+  flusher_.join();
+  std::string buffer;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    Drain(buffer);
+  }
+  WriteDescriptor(descriptor_, buffer);
+  if (descriptor_ != STDERR_FILENO) {
+    close(descriptor_);
+    descriptor_ = STDERR_FILENO;
+  }
+}
+
+bool Logger::IsRunning() { return running_; }
+
+void Logger::SetLevel(int level) { level_ = level; }
+
+int Logger::GetLevel() { return level_; }
+
+size_t Logger::CountDropped() { return dropped_; }
+
+void Logger::Write(int level, const char *format, ...) {
+  va_list arguments;
+  if (!running_) {
+    LogRecord record;
+    record.level = level;
+    clock_gettime(CLOCK_REALTIME, &record.time);
+    va_start(arguments, format);
+    int length = vsnprintf(record.message, kLogMessageSize, format, arguments);
+    va_end(arguments);
+    record.length = std::min((size_t)std::max(length, 0), kLogMessageSize - 1);
+    std::string buffer;
+    Format(0, record, buffer);
+    WriteDescriptor(STDERR_FILENO, buffer);
+    return;
+  }
+  LogRing *ring = GetRing();
+  LogRecord *record = ring->Prepare();
+  if (record == nullptr) {
+    dropped_.fetch_add(1, std::memory_order_relaxed);
+    return;
+  }
+  record->level = level;
+  clock_gettime(CLOCK_REALTIME, &record->time);
+  va_start(arguments, format);
+  int length = vsnprintf(record->message, kLogMessageSize, format, arguments);
+  va_end(arguments);
+  record->length = std::min((size_t)std::max(length, 0), kLogMessageSize - 1);
+  ring->Commit();
+}
+
+LogRing *Logger::GetRing() {
+  if (ring_holder.ring == nullptr) {
+    std::lock_guard<std::mutex> lock(mutex_);
+    ring_holder.ring = new LogRing(++threads_);
+    rings_.push_back(ring_holder.ring);
+  }
+  return ring_holder.ring;
+}
+
+void Logger::Flush() {
+  std::string buffer;
+  std::unique_lock<std::mutex> lock(mutex_);
+  while (running_) {
+    condition_.wait_for(lock, std::chrono::milliseconds(kLogFlushInterval));
+    Drain(buffer);
+    if (buffer.empty()) {
+      continue;
+    }
+    lock.unlock();
+    WriteDescriptor(descriptor_, buffer);
+    buffer.clear();
+    lock.lock();
+  }
+}
+
+void Logger::Drain(std::string &buffer) {
+  for (size_t i = 0; i < rings_.size();) {
+    LogRing *ring = rings_[i];
+    LogRecord *record;
+    while ((record = ring->Peek()) != nullptr) {
+      Format(ring->GetThread(), *record, buffer);
+      ring->Pop();
+    }
+    if (ring->IsReleased() && ring->IsEmpty()) {
+      delete ring;
+      rings_[i] = rings_.back();
+      rings_.pop_back();
+      continue;
+    }
+    i++;
+  }
+  size_t dropped = dropped_.load(std::memory_order_relaxed);
+  if (dropped > reported_) {
+    buffer.append("dropped " + std::to_string(dropped - reported_) +
+                  " log records\n");
+    reported_ = dropped;
+  }
+}
+
+void Logger::Format(size_t thread, const LogRecord &record,
+                    std::string &buffer) {
+  struct tm time;
+  gmtime_r(&record.time.tv_sec, &time);
+  char prefix[64];
+  int length = snprintf(prefix, sizeof(prefix),
+                        "%04d-%02d-%02dT%02d:%02d:%02d.%03ldZ %s [%lu] ",
+                        time.tm_year + 1900, time.tm_mon + 1, time.tm_mday,
+                        time.tm_hour, time.tm_min, time.tm_sec,
+                        record.time.tv_nsec / 1000000,
+                        GetLevelString(record.level), thread);
+  buffer.append(prefix, std::min((size_t)std::max(length, 0), sizeof(prefix)));
+  buffer.append(record.message, record.length);
+  buffer.push_back('\n');
+}
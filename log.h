@@ -0,0 +1,156 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdarg>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <time.h>
+#include <unistd.h>
+
+#define LOG_LEVEL_DEBUG 0
+#define LOG_LEVEL_INFO 1
+#define LOG_LEVEL_WARNING 2
+#define LOG_LEVEL_ERROR 3
+#define LOG_LEVEL_NONE 4
+
+#ifndef LOG_COMPILE_LEVEL
+#define LOG_COMPILE_LEVEL LOG_LEVEL_DEBUG
+#endif
+
+#define LOG_WRITE(level, ...)                                                  \
+  do {                                                                         \
+    if (Logger::IsEnabled(level)) {                                            \
+      Logger::Write(level, __VA_ARGS__);                                       \
+    }                                                                          \
+  } while (0)
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_DEBUG
+#define LOG_DEBUG(...) LOG_WRITE(LOG_LEVEL_DEBUG, __VA_ARGS__)
+#else
+#define LOG_DEBUG(...)                                                         \
+  do {                                                                         \
+  } while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_INFO
+#define LOG_INFO(...) LOG_WRITE(LOG_LEVEL_INFO, __VA_ARGS__)
+#else
+#define LOG_INFO(...)                                                          \
+  do {                                                                         \
+  } while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_WARNING
+#define LOG_WARNING(...) LOG_WRITE(LOG_LEVEL_WARNING, __VA_ARGS__)
+#else
+#define LOG_WARNING(...)                                                       \
+  do {                                                                         \
+  } while (0)
+#endif
+
+#if LOG_COMPILE_LEVEL <= LOG_LEVEL_ERROR
+#define LOG_ERROR(...) LOG_WRITE(LOG_LEVEL_ERROR, __VA_ARGS__)
+#else
+#define LOG_ERROR(...)                                                         \
+  do {                                                                         \
+  } while (0)
+#endif
+
+const size_t kLogSlots = 1024;
+const size_t kLogMessageSize = 232;
+const long kLogFlushInterval = 20;
+
+struct LogRecord {
+  int level;
+  struct timespec time;
+  size_t length;
+  char message[kLogMessageSize];
+};
+
+// Single producer, single consumer ring owned by one logging thread and
+// drained by the flusher. Records that do not fit are dropped and counted.
+class LogRing {
+public:
+  LogRing(size_t thread);
+  virtual ~LogRing();
+  LogRecord *Prepare();
+  void Commit();
+  LogRecord *Peek();
+  void Pop();
+  void Release();
+  bool IsReleased();
+  bool IsEmpty();
+  size_t GetThread();
+
+private:
+  LogRecord *records_;
+  size_t thread_;
+  std::atomic<size_t> head_;
+  std::atomic<size_t> tail_;
+  std::atomic<bool> released_;
+};
+
+class Logger {
+public:
+  static bool Start(const std::string &path = "");
+  static void Stop();
+  static bool IsRunning();
+  static void SetLevel(int level);
+  static int GetLevel();
+  static size_t CountDropped();
+  static void Write(int level, const char *format, ...)
+      __attribute__((format(printf, 2, 3)));
+  static inline bool IsEnabled(int level) {
+    return level >= level_.load(std::memory_order_relaxed);
+  }
+
+private:
+  static LogRing *GetRing();
+  static void Flush();
+  static void Drain(std::string &buffer);
+  static void Format(size_t thread, const LogRecord &record,
+                     std::string &buffer);
+  static std::atomic<int> level_;
+  static std::atomic<bool> running_;
+  static std::atomic<size_t> dropped_;
+  static std::mutex mutex_;
+  static std::condition_variable condition_;
+  static std::vector<LogRing *> rings_;
+  static std::thread flusher_;
+  static int descriptor_;
+  static size_t threads_;
+  static size_t reported_;
+};
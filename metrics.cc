@@ -0,0 +1,294 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "metrics.h"
+
+namespace {
+
+const uint64_t kSubBuckets = 1ULL << kMetricsPrecisionBits;
+
+const char *kTypeNames[] = {"counter", "gauge", "histogram"};
+
+std::atomic<uint64_t> registries(0);
+
+// Threads normally record into a single registry, so one cached shard per
+// thread spares the lookup under the registry lock.
+struct ShardCache {
+  uint64_t serial;
+  std::atomic<uint64_t> *slots;
+};
+
+thread_local ShardCache cache = {0, nullptr};
+
+} // namespace
+
+MetricsRegistry::MetricsRegistry()
+    : serial_(++registries), slots_(0), frozen_(false) {}
+
+MetricsRegistry::~MetricsRegistry() {
+  for (auto it = shards_.begin(); it != shards_.end(); it++) {
+    delete[] it->second;
+  }
+}
+
+size_t MetricsRegistry::AddCounter(const std::string &name,
+                                   const std::string &help,
+                                   const std::string &labels) {
+  return Add(METRICS_COUNTER, name, help, labels, kStringEmpty, 1);
+}
+
+size_t MetricsRegistry::AddCounters(const std::string &name,
+                                    const std::string &help,
+                                    const std::string &labels,
+                                    const std::string &dimension,
+                                    size_t width) {
+  if (dimension.empty() || width == 0) {
+    return kMetricsInvalid;
+  }
+  return Add(METRICS_COUNTER, name, help, labels, dimension, width);
+}
+
+size_t MetricsRegistry::AddGauge(const std::string &name,
+                                 const std::string &help,
+                                 const std::string &labels) {
+  return Add(METRICS_GAUGE, name, help, labels, kStringEmpty, 1);
+}
+
+size_t MetricsRegistry::AddHistogram(const std::string &name,
+                                     const std::string &help,
+                                     const std::string &labels) {
+  return Add(METRICS_HISTOGRAM, name, help, labels, kStringEmpty,
+             kMetricsBuckets + 1);
+}
+
+size_t MetricsRegistry::Add(MetricsType type, const std::string &name,
+                            const std::string &help, const std::string &labels,
+                            const std::string &dimension, size_t width) {
+  std::lock_guard<std::mutex> lock(mutex_);
+  if (frozen_ || name.empty()) {
+    return kMetricsInvalid;
+  }
+  metrics_.push_back({type, name, help, labels, dimension, width, slots_});
+  slots_ += width;
+  return metrics_.size() - 1;
+}
+
+void MetricsRegistry::Increment(size_t metric, uint64_t value, size_t index) {
+  if (metric >= metrics_.size() || index >= metrics_[metric].width) {
+    return;
+  }
+  std::atomic<uint64_t> *slots = GetShard();
+  std::atomic<uint64_t> &slot = slots[metrics_[metric].offset + index];
+  slot.store(slot.load(std::memory_order_relaxed) + value,
+             std::memory_order_relaxed);
+}
+
+// Gauges are summed across shards with wrap-around, so a thread may lower
+// a gauge that another thread raised.
+void MetricsRegistry::Adjust(size_t metric, int64_t delta) {
+  Increment(metric, (uint64_t)delta);
+}
+
+void MetricsRegistry::Observe(size_t metric, uint64_t microseconds) {
+  if (metric >= metrics_.size()) {
+    return;
+  }
+  std::atomic<uint64_t> *slots = GetShard();
+  std::atomic<uint64_t> *histogram = &slots[metrics_[metric].offset];
+  std::atomic<uint64_t> &bucket = histogram[GetIndex(microseconds)];
+  bucket.store(bucket.load(std::memory_order_relaxed) + 1,
+               std::memory_order_relaxed);
+  std::atomic<uint64_t> &sum = histogram[kMetricsBuckets];
+  sum.store(sum.load(std::memory_order_relaxed) + microseconds,
+            std::memory_order_relaxed);
+}
+
+bool MetricsRegistry::IsFrozen() { return frozen_; }
+
+std::atomic<uint64_t> *MetricsRegistry::GetShard() {
+  if (cache.serial == serial_) {
+    return cache.slots;
+  }
+  cache.slots = CreateShard();
+  cache.serial = serial_;
+  return cache.slots;
+}
+
+std::atomic<uint64_t> *MetricsRegistry::CreateShard() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  frozen_ = true;
+  std::thread::id id = std::this_thread::get_id();
+  for (auto it = shards_.begin(); it != shards_.end(); it++) {
+    if (it->first == id) {
+      return it->second;
+    }
+  }
+  std::atomic<uint64_t> *slots = new std::atomic<uint64_t>[slots_ + 1];
+  for (size_t i = 0; i <= slots_; i++) {
+    slots[i].store(0, std::memory_order_relaxed);
+  }
+  shards_.push_back({id, slots});
+  return slots;
+}
+
+void MetricsRegistry::Collect(const Metric &metric,
+                              std::vector<uint64_t> &values) {
+  values.assign(metric.width, 0);
+  for (auto it = shards_.begin(); it != shards_.end(); it++) {
+    for (size_t i = 0; i < metric.width; i++) {
+      values[i] += it->second[metric.offset + i].load(std::memory_order_relaxed);
+    }
+  }
+}
+
+std::string MetricsRegistry::Render() {
+  std::lock_guard<std::mutex> lock(mutex_);
+  std::string output;
+  std::vector<bool> rendered(metrics_.size(), false);
+  for (size_t i = 0; i < metrics_.size(); i++) {
+    if (rendered[i]) {
+      continue;
+    }
+    output.append("# HELP ")
+        .append(metrics_[i].name)
+        .append(" ")
+        .append(metrics_[i].help)
+        .append("\n# TYPE ")
+        .append(metrics_[i].name)
+        .append(" ")
+        .append(kTypeNames[metrics_[i].type])
+        .append("\n");
+    for (size_t j = i; j < metrics_.size(); j++) {
+      if (!rendered[j] && metrics_[j].name == metrics_[i].name) {
+        RenderMetric(metrics_[j], output);
+        rendered[j] = true;
+      }
+    }
+  }
+  return output;
+}
+
+void MetricsRegistry::RenderMetric(const Metric &metric, std::string &output) {
+  std::vector<uint64_t> values;
+  Collect(metric, values);
+  char number[32];
+  if (metric.type == METRICS_GAUGE) {
+    snprintf(number, sizeof(number), "%lld", (long long)(int64_t)values[0]);
+    AppendSample(output, metric.name, metric.labels, std::string_view(),
+                 number);
+    return;
+  }
+  if (metric.type == METRICS_COUNTER) {
+    if (metric.dimension.empty()) {
+      snprintf(number, sizeof(number), "%llu", (unsigned long long)values[0]);
+      AppendSample(output, metric.name, metric.labels, std::string_view(),
+                   number);
+      return;
+    }
+    for (size_t i = 0; i < metric.width; i++) {
+      if (values[i] == 0) {
+        continue;
+      }
+      std::string extra = metric.dimension + "=\"" + std::to_string(i) + "\"";
+      snprintf(number, sizeof(number), "%llu", (unsigned long long)values[i]);
+      AppendSample(output, metric.name, metric.labels, extra, number);
+    }
+    return;
+  }
+  size_t highest = 0;
+  for (size_t i = 0; i < kMetricsBuckets - 1; i++) {
+    if (values[i] > 0) {
+      highest = i;
+    }
+  }
+  std::string bucket = metric.name + "_bucket";
+  uint64_t count = 0;
+  for (size_t i = 0; i <= highest; i++) {
+    count += values[i];
+    char bound[32];
+    snprintf(bound, sizeof(bound), "le=\"%.9g\"", GetUpperBound(i) / 1e6);
+    snprintf(number, sizeof(number), "%llu", (unsigned long long)count);
+    AppendSample(output, bucket, metric.labels, bound, number);
+  }
+  for (size_t i = highest + 1; i < kMetricsBuckets; i++) {
+    count += values[i];
+  }
+  snprintf(number, sizeof(number), "%llu", (unsigned long long)count);
+  AppendSample(output, bucket, metric.labels, "le=\"+Inf\"", number);
+  AppendSample(output, metric.name + "_count", metric.labels,
+               std::string_view(), number);
+  snprintf(number, sizeof(number), "%.9g", values[kMetricsBuckets] / 1e6);
+  AppendSample(output, metric.name + "_sum", metric.labels, std::string_view(),
+               number);
+}
+
+void MetricsRegistry::AppendSample(std::string &output, const std::string &name,
+                                   const std::string &labels,
+                                   std::string_view extra, const char *value) {
+  output.append(name);
+  if (!labels.empty() || !extra.empty()) {
+    output.append("{").append(labels);
+    if (!labels.empty() && !extra.empty()) {
+      output.append(",");
+    }
+    output.append(extra).append("}");
+  }
+  output.append(" ").append(value).append("\n");
+}
+
+std::string MetricsRegistry::Escape(std::string_view value) {
+  std::string escaped;
+  escaped.reserve(value.length());
+  for (size_t i = 0; i < value.length(); i++) {
+    if (value[i] == '\n') {
+      escaped.append("\\n");
+      continue;
+    }
+    if (value[i] == '\\' || value[i] == '"') {
+      escaped.push_back('\\');
+    }
+    escaped.push_back(value[i]);
+  }
+  return escaped;
+}
+
+size_t MetricsRegistry::GetIndex(uint64_t microseconds) {
+  unsigned bits = 64 - __builtin_clzll(microseconds | 1);
+  if (bits <= kMetricsPrecisionBits + 1) {
+    return microseconds;
+  }
+  unsigned magnitude = bits - kMetricsPrecisionBits - 1;
+  if (magnitude > kMetricsMagnitudes) {
+    return kMetricsBuckets - 1;
+  }
+  return (magnitude + 1) * kSubBuckets +
+         ((microseconds >> magnitude) - kSubBuckets);
+}
+
+uint64_t MetricsRegistry::GetUpperBound(size_t index) {
+  if (index < 2 * kSubBuckets) {
+    return index + 1;
+  }
+  unsigned magnitude = index / kSubBuckets - 1;
+  return (kSubBuckets + index % kSubBuckets + 1) << magnitude;
+}
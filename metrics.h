@@ -0,0 +1,100 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include "utils.h"
+
+const unsigned kMetricsPrecisionBits = 2;
+const unsigned kMetricsMagnitudes = 28;
+const size_t kMetricsBuckets = (kMetricsMagnitudes + 2)
+                               << kMetricsPrecisionBits;
+const size_t kMetricsInvalid = SIZE_MAX;
+
+enum MetricsType { METRICS_COUNTER = 0, METRICS_GAUGE, METRICS_HISTOGRAM };
+
+// Every recording thread owns a shard of plain slots that only it writes,
+// so recording is a relaxed load and store without any read-modify-write.
+// Scrapes sum the shards of all threads. Metrics have to be declared before
+// the first value is recorded, which freezes the layout of the shards.
+// Histograms use log-linear buckets over microseconds with four buckets per
+// power of two, which covers one microsecond up to about half an hour.
+class MetricsRegistry {
+public:
+  MetricsRegistry();
+  virtual ~MetricsRegistry();
+  size_t AddCounter(const std::string &name, const std::string &help,
+                    const std::string &labels = kStringEmpty);
+  size_t AddCounters(const std::string &name, const std::string &help,
+                     const std::string &labels, const std::string &dimension,
+                     size_t width);
+  size_t AddGauge(const std::string &name, const std::string &help,
+                  const std::string &labels = kStringEmpty);
+  size_t AddHistogram(const std::string &name, const std::string &help,
+                      const std::string &labels = kStringEmpty);
+  void Increment(size_t metric, uint64_t value = 1, size_t index = 0);
+  void Adjust(size_t metric, int64_t delta);
+  void Observe(size_t metric, uint64_t microseconds);
+  bool IsFrozen();
+  std::string Render();
+  static std::string Escape(std::string_view value);
+
+private:
+  struct Metric {
+    MetricsType type;
+    std::string name;
+    std::string help;
+    std::string labels;
+    std::string dimension;
+    size_t width;
+    size_t offset;
+  };
+  size_t Add(MetricsType type, const std::string &name,
+             const std::string &help, const std::string &labels,
+             const std::string &dimension, size_t width);
+  std::atomic<uint64_t> *GetShard();
+  std::atomic<uint64_t> *CreateShard();
+  void Collect(const Metric &metric, std::vector<uint64_t> &values);
+  void RenderMetric(const Metric &metric, std::string &output);
+  static size_t GetIndex(uint64_t microseconds);
+  static uint64_t GetUpperBound(size_t index);
+  static void AppendSample(std::string &output, const std::string &name,
+                           const std::string &labels, std::string_view extra,
+                           const char *value);
+  const uint64_t serial_;
+  std::mutex mutex_;
+  std::vector<Metric> metrics_;
+  size_t slots_;
+  std::atomic<bool> frozen_;
+  std::vector<std::pair<std::thread::id, std::atomic<uint64_t> *>> shards_;
+};
@@ -0,0 +1,128 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "pool.h"
+
+ThreadPool::ThreadPool() : running_(false), next_(0), pending_(0) {}
+
+ThreadPool::~ThreadPool() { Stop(); }
+
+bool ThreadPool::Start(size_t workers) {
+  if (running_ || workers == 0) {
+    return false;
+  }
+  for (size_t i = 0; i < workers; i++) {
+    workers_.push_back(new Worker());
+  }
+  running_ = true;
+  for (size_t i = 0; i < workers; i++) {
+    threads_.push_back(std::thread(&ThreadPool::Work, this, i));
+  }
+  return true;
+}
+
+void ThreadPool::Stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_) {
+      return;
+    }
+    running_ = false;
+  }
+  condition_.notify_all();
+  for (size_t i = 0; i < threads_.size(); i++) {
+    threads_[i].join();
+  }
+  threads_.clear();
+  for (size_t i = 0; i < workers_.size(); i++) {
+    delete workers_[i];
+  }
+  workers_.clear();
+  pending_ = 0;
+}
+
+bool ThreadPool::Submit(ThreadTask task) {
+  // The task is counted before it is published, otherwise a worker could
+  // pop it first and wrap the counter around.
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (!running_) {
+      return false;
+    }
+    pending_++;
+  }
+  Worker *worker = workers_[next_++ % workers_.size()];
+  {
+    std::lock_guard<std::mutex> lock(worker->mutex);
+    worker->tasks.push_back(std::move(task));
+  }
+  condition_.notify_one();
+  return true;
+}
+
+bool ThreadPool::IsRunning() { return running_; }
+
+size_t ThreadPool::CountWorkers() { return workers_.size(); }
+
+void ThreadPool::Work(size_t index) {
+  ThreadTask task;
+  for (;;) {
+    if (Pop(index, task) || Steal(index, task)) {
+      pending_--;
+      task();
+      task = nullptr;
+      continue;
+    }
+    std::unique_lock<std::mutex> lock(mutex_);
+    condition_.wait(lock, [this] { return !running_ || pending_ > 0; });
+    // Workers only leave once every queued task has run, so that each
+    // submitted request still gets its completion.
+    if (!running_ && pending_ == 0) {
+      return;
+    }
+  }
+}
+
+bool ThreadPool::Pop(size_t index, ThreadTask &task) {
+  Worker *worker = workers_[index];
+  std::lock_guard<std::mutex> lock(worker->mutex);
+  if (worker->tasks.empty()) {
+    return false;
+  }
+  task = std::move(worker->tasks.front());
+  worker->tasks.pop_front();
+  return true;
+}
+
+bool ThreadPool::Steal(size_t index, ThreadTask &task) {
+  for (size_t i = 1; i < workers_.size(); i++) {
+    Worker *victim = workers_[(index + i) % workers_.size()];
+    std::lock_guard<std::mutex> lock(victim->mutex);
+    if (victim->tasks.empty()) {
+      continue;
+    }
+    task = std::move(victim->tasks.back());
+    victim->tasks.pop_back();
+    return true;
+  }
+  return false;
+}
@@ -0,0 +1,60 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+typedef std::function<void()> ThreadTask;
+
+class ThreadPool {
+public:
+  ThreadPool();
+  virtual ~ThreadPool();
+  bool Start(size_t workers);
+  void Stop();
+  bool Submit(ThreadTask task);
+  bool IsRunning();
+  size_t CountWorkers();
+
+private:
+  struct Worker {
+    std::mutex mutex;
+    std::deque<ThreadTask> tasks;
+  };
+  void Work(size_t index);
+  bool Pop(size_t index, ThreadTask &task);
+  bool Steal(size_t index, ThreadTask &task);
+  std::atomic<bool> running_;
+  std::atomic<size_t> next_;
+  std::atomic<size_t> pending_;
+  std::vector<Worker *> workers_;
+  std::vector<std::thread> threads_;
+  std::mutex mutex_;
+  std::condition_variable condition_;
+};
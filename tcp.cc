@@ -22,7 +22,7 @@ SOFTWARE. */
 
 #include "tcp.h"
 
-EpollInstance::EpollInstance() {}
+EpollInstance::EpollInstance() : instance_(-1), edge_triggered_(false) {}
 
 EpollInstance::~EpollInstance() {}
 
@@ -36,29 +36,38 @@ bool EpollInstance::Create() {
 
 void EpollInstance::Release() { close(instance_); }
 
+void EpollInstance::SetEdgeTriggered(bool edge_triggered) {
+  edge_triggered_ = edge_triggered;
+}
+
+bool EpollInstance::IsEdgeTriggered() { return edge_triggered_; }
+
 int EpollInstance::Wait(long timeout) {
   return epoll_wait(instance_, events_, kMaximumEvents, timeout);
 }
 
-bool EpollInstance::AddDescriptor(int descriptor, int flags) {
+bool EpollInstance::AddDescriptor(int descriptor, int flags, uint32_t tag) {
   event_.events = flags | EPOLLERR | EPOLLHUP;
-  event_.data.fd = descriptor;
+  if (edge_triggered_) {
+    event_.events |= EPOLLET;
+  }
+  event_.data.u64 = ((uint64_t)tag << 32) | (uint32_t)descriptor;
   if (epoll_ctl(instance_, EPOLL_CTL_ADD, descriptor, &event_) == -1) {
     return false;
   }
   return true;
 }
 
-bool EpollInstance::AddReadableDescriptor(int descriptor) {
-  return AddDescriptor(descriptor, EPOLLIN);
+bool EpollInstance::AddReadableDescriptor(int descriptor, uint32_t tag) {
+  return AddDescriptor(descriptor, EPOLLIN, tag);
 }
 
-bool EpollInstance::AddWritableDescriptor(int descriptor) {
-  return AddDescriptor(descriptor, EPOLLOUT);
+bool EpollInstance::AddWritableDescriptor(int descriptor, uint32_t tag) {
+  return AddDescriptor(descriptor, EPOLLOUT, tag);
 }
 
-bool EpollInstance::AddDuplexDescriptor(int descriptor) {
-  return AddDescriptor(descriptor, EPOLLIN | EPOLLOUT);
+bool EpollInstance::AddDuplexDescriptor(int descriptor, uint32_t tag) {
+  return AddDescriptor(descriptor, EPOLLIN | EPOLLOUT, tag);
 }
 
 bool EpollInstance::DeleteDescriptor(int descriptor) {
@@ -68,9 +77,12 @@ bool EpollInstance::DeleteDescriptor(int descriptor) {
   return true;
 }
 
-bool EpollInstance::ModifyDescriptor(int descriptor, int flags) {
+bool EpollInstance::ModifyDescriptor(int descriptor, int flags, uint32_t tag) {
   event_.events = flags;
-  event_.data.fd = descriptor;
+  if (edge_triggered_) {
+    event_.events |= EPOLLET;
+  }
+  event_.data.u64 = ((uint64_t)tag << 32) | (uint32_t)descriptor;
   if (epoll_ctl(instance_, EPOLL_CTL_MOD, descriptor, &event_) == -1) {
     return false;
   }
@@ -81,7 +93,14 @@ int EpollInstance::GetDescriptor(size_t index) {
   if (index >= kMaximumEvents) {
     return -1;
   }
-  return events_[index].data.fd;
+  return (int)(events_[index].data.u64 & 0xffffffff);
+}
+
+uint32_t EpollInstance::GetTag(size_t index) {
+  if (index >= kMaximumEvents) {
+    return 0;
+  }
+  return (uint32_t)(events_[index].data.u64 >> 32);
 }
 
 int EpollInstance::GetEvents(size_t index) {
@@ -113,21 +132,363 @@ bool EpollInstance::HasErrors(size_t index) {
 }
 
 bool EpollInstance::SetReadable(size_t index) {
-  return ModifyDescriptor(GetDescriptor(index), EPOLLIN | EPOLLERR | EPOLLHUP);
+  return ModifyDescriptor(GetDescriptor(index), EPOLLIN | EPOLLERR | EPOLLHUP,
+                          GetTag(index));
 }
 
 bool EpollInstance::SetWriteable(size_t index) {
-  return ModifyDescriptor(GetDescriptor(index), EPOLLOUT | EPOLLERR | EPOLLHUP);
+  return ModifyDescriptor(GetDescriptor(index), EPOLLOUT | EPOLLERR | EPOLLHUP,
+                          GetTag(index));
 }
 
 bool EpollInstance::SetDuplex(size_t index) {
   return ModifyDescriptor(GetDescriptor(index),
-                          EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP);
+                          EPOLLIN | EPOLLOUT | EPOLLERR | EPOLLHUP,
+                          GetTag(index));
+}
+
+UringInstance::UringInstance()
+    : instance_(-1), flags_(0), rings_(nullptr), rings_length_(0),
+      entries_(nullptr), entries_length_(0), sq_head_(nullptr),
+      sq_tail_(nullptr), sq_flags_(nullptr), sq_mask_(0), sq_entries_(0),
+      sq_queued_(0), cq_head_(nullptr), cq_tail_(nullptr), cq_mask_(0),
+      cq_entries_(nullptr), buffer_ring_(nullptr), buffer_ring_length_(0),
+      buffers_(nullptr), buffer_count_(0), buffer_size_(0) {}
+
+UringInstance::~UringInstance() { Release(); }
+
+// Multishot receives need Linux 6.0, the first release that also knows
+// single issuer rings, so setup fails on older kernels and callers can fall
+// back to epoll. Task work is deferred until the next Wait where the kernel
+// supports it (6.1). The ring starts disabled so that the thread which runs
+// it, rather than the one which set it up, becomes its single issuer.
+bool UringInstance::Create(unsigned entries) {
+  const unsigned setups[] = {
+      IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN |
+          IORING_SETUP_TASKRUN_FLAG | IORING_SETUP_R_DISABLED,
+      IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_COOP_TASKRUN |
+          IORING_SETUP_TASKRUN_FLAG | IORING_SETUP_R_DISABLED};
+  struct io_uring_params params;
+  for (size_t i = 0; i < sizeof(setups) / sizeof(setups[0]); i++) {
+    memset(&params, 0, sizeof(params));
+    params.flags = setups[i];
+    instance_ = syscall(__NR_io_uring_setup, entries, &params);
+    if (instance_ != -1) {
+      break;
+    }
+  }
+  if (instance_ == -1) {
+    return false;
+  }
+  flags_ = params.flags;
+  if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+      !(params.features & IORING_FEAT_NODROP) ||
+      !(params.features & IORING_FEAT_EXT_ARG)) {
+    Release();
+    return false;
+  }
+  rings_length_ =
+      std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+               params.cq_off.cqes +
+                   params.cq_entries * sizeof(struct io_uring_cqe));
+  rings_ = mmap(nullptr, rings_length_, PROT_READ | PROT_WRITE,
+                MAP_SHARED | MAP_POPULATE, instance_, IORING_OFF_SQ_RING);
+  if (rings_ == MAP_FAILED) {
+    rings_ = nullptr;
+    Release();
+    return false;
+  }
+  entries_length_ = params.sq_entries * sizeof(struct io_uring_sqe);
+  void *mapping = mmap(nullptr, entries_length_, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, instance_, IORING_OFF_SQES);
+  if (mapping == MAP_FAILED) {
+    Release();
+    return false;
+  }
+  entries_ = (struct io_uring_sqe *)mapping;
+  char *rings = (char *)rings_;
+  sq_head_ = (unsigned *)(rings + params.sq_off.head);
+  sq_tail_ = (unsigned *)(rings + params.sq_off.tail);
+  sq_flags_ = (unsigned *)(rings + params.sq_off.flags);
+  sq_mask_ = *(unsigned *)(rings + params.sq_off.ring_mask);
+  sq_entries_ = params.sq_entries;
+  sq_queued_ = *sq_tail_;
+  unsigned *array = (unsigned *)(rings + params.sq_off.array);
+  for (unsigned i = 0; i < sq_entries_; i++) {
+    array[i] = i;
+  }
+  cq_head_ = (unsigned *)(rings + params.cq_off.head);
+  cq_tail_ = (unsigned *)(rings + params.cq_off.tail);
+  cq_mask_ = *(unsigned *)(rings + params.cq_off.ring_mask);
+  cq_entries_ = (struct io_uring_cqe *)(rings + params.cq_off.cqes);
+  return true;
+}
+
+bool UringInstance::Enable() {
+  if (!(flags_ & IORING_SETUP_R_DISABLED)) {
+    return true;
+  }
+  if (syscall(__NR_io_uring_register, instance_, IORING_REGISTER_ENABLE_RINGS,
+              nullptr, 0) == -1) {
+    return false;
+  }
+  flags_ &= ~IORING_SETUP_R_DISABLED;
+  return true;
+}
+
+void UringInstance::Release() {
+  if (instance_ != -1) {
+    close(instance_);
+    instance_ = -1;
+  }
+  if (entries_ != nullptr) {
+    munmap(entries_, entries_length_);
+    entries_ = nullptr;
+  }
+  if (rings_ != nullptr) {
+    munmap(rings_, rings_length_);
+    rings_ = nullptr;
+  }
+  if (buffer_ring_ != nullptr) {
+    munmap(buffer_ring_, buffer_ring_length_);
+    buffer_ring_ = nullptr;
+  }
+  free(buffers_);
+  buffers_ = nullptr;
+  buffer_count_ = 0;
+}
+
+// Registers a group of equally sized buffers that receives pick from. The
+// count must be a power of two.
+bool UringInstance::SetupBuffers(uint16_t count, uint32_t size) {
+  if (count == 0 || (count & (count - 1)) != 0) {
+    return false;
+  }
+  buffer_ring_length_ = count * sizeof(struct io_uring_buf);
+  void *mapping = mmap(nullptr, buffer_ring_length_, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (mapping == MAP_FAILED) {
+    return false;
+  }
+  buffer_ring_ = (struct io_uring_buf_ring *)mapping;
+  buffers_ = (char *)malloc((size_t)count * size);
+  if (buffers_ == nullptr) {
+    return false;
+  }
+  struct io_uring_buf_reg registration;
+  memset(&registration, 0, sizeof(registration));
+  registration.ring_addr = (uint64_t)buffer_ring_;
+  registration.ring_entries = count;
+  registration.bgid = 0;
+  if (syscall(__NR_io_uring_register, instance_, IORING_REGISTER_PBUF_RING,
+              &registration, 1) == -1) {
+    return false;
+  }
+  buffer_count_ = count;
+  buffer_size_ = size;
+  for (uint16_t i = 0; i < count; i++) {
+    RecycleBuffer(i);
+  }
+  return true;
+}
+
+const char *UringInstance::GetBuffer(uint16_t id) {
+  return &buffers_[(size_t)id * buffer_size_];
+}
+
+void UringInstance::RecycleBuffer(uint16_t id) {
+  // Entries are addressed by hand, in C++ the flexible array member of the
+  // kernel header is preceded by an empty struct that shifts it.
+  uint16_t tail = buffer_ring_->tail;
+  struct io_uring_buf *buffer =
+      (struct io_uring_buf *)buffer_ring_ + (tail & (buffer_count_ - 1));
+  buffer->addr = (uint64_t)GetBuffer(id);
+  buffer->len = buffer_size_;
+  buffer->bid = id;
+  __atomic_store_n(&buffer_ring_->tail, tail + 1, __ATOMIC_RELEASE);
+}
+
+// Submits everything queued and collects completions. A timeout of zero
+// only enters the kernel if there is something to submit or deferred work
+// to run, so draining ready completions costs no system call.
+int UringInstance::Wait(long timeout) {
+  unsigned head = *cq_head_;
+  unsigned tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  bool queued = sq_queued_ != *sq_tail_;
+  bool flagged = __atomic_load_n(sq_flags_, __ATOMIC_RELAXED) &
+                 (IORING_SQ_TASKRUN | IORING_SQ_CQ_OVERFLOW);
+  if (queued || flagged || (head == tail && timeout != 0)) {
+    if (!Enter(head == tail && timeout != 0 ? 1 : 0, timeout)) {
+      return -1;
+    }
+    tail = __atomic_load_n(cq_tail_, __ATOMIC_ACQUIRE);
+  }
+  int count = 0;
+  while (head != tail && count < (int)kMaximumEvents) {
+    completions_[count++] = cq_entries_[head & cq_mask_];
+    head++;
+  }
+  __atomic_store_n(cq_head_, head, __ATOMIC_RELEASE);
+  return count;
+}
+
+bool UringInstance::Enter(unsigned wait, long timeout) {
+  __atomic_store_n(sq_tail_, sq_queued_, __ATOMIC_RELEASE);
+  unsigned submit = sq_queued_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE);
+  unsigned flags = IORING_ENTER_GETEVENTS;
+  struct io_uring_getevents_arg argument;
+  struct __kernel_timespec time;
+  void *extension = nullptr;
+  size_t length = 0;
+  if (wait > 0 && timeout > 0) {
+    memset(&argument, 0, sizeof(argument));
+    time.tv_sec = timeout / 1000;
+    time.tv_nsec = (timeout % 1000) * 1000000;
+    argument.ts = (uint64_t)&time;
+    extension = &argument;
+    length = sizeof(argument);
+    flags |= IORING_ENTER_EXT_ARG;
+  }
+  if (syscall(__NR_io_uring_enter, instance_, submit, wait, flags, extension,
+              length) == -1) {
+    return errno == EINTR || errno == ETIME || errno == EAGAIN ||
+           errno == EBUSY;
+  }
+  return true;
+}
+
+// Makes room for the given number of entries, submitting what is queued
+// if the submission queue is full.
+bool UringInstance::Reserve(unsigned count) {
+  if (sq_queued_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) + count >
+      sq_entries_) {
+    if (!Enter(0, 0) ||
+        sq_queued_ - __atomic_load_n(sq_head_, __ATOMIC_ACQUIRE) + count >
+            sq_entries_) {
+      return false;
+    }
+  }
+  return true;
+}
+
+struct io_uring_sqe *UringInstance::GetEntry(uint8_t opcode, int descriptor,
+                                             uint64_t tag) {
+  if (!Reserve(1)) {
+    return nullptr;
+  }
+  struct io_uring_sqe *entry = &entries_[sq_queued_ & sq_mask_];
+  memset(entry, 0, sizeof(struct io_uring_sqe));
+  entry->opcode = opcode;
+  entry->fd = descriptor;
+  entry->user_data = tag;
+  sq_queued_++;
+  return entry;
+}
+
+bool UringInstance::Accept(int descriptor, uint64_t tag) {
+  struct io_uring_sqe *entry = GetEntry(IORING_OP_ACCEPT, descriptor, tag);
+  if (entry == nullptr) {
+    return false;
+  }
+  entry->ioprio = IORING_ACCEPT_MULTISHOT;
+  entry->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+  return true;
+}
+
+bool UringInstance::Receive(int descriptor, uint64_t tag) {
+  struct io_uring_sqe *entry = GetEntry(IORING_OP_RECV, descriptor, tag);
+  if (entry == nullptr) {
+    return false;
+  }
+  entry->ioprio = IORING_RECV_MULTISHOT;
+  entry->flags = IOSQE_BUFFER_SELECT;
+  entry->buf_group = 0;
+  return true;
+}
+
+bool UringInstance::Send(int descriptor, const struct msghdr *message,
+                         uint64_t tag) {
+  struct io_uring_sqe *entry = GetEntry(IORING_OP_SENDMSG, descriptor, tag);
+  if (entry == nullptr) {
+    return false;
+  }
+  entry->addr = (uint64_t)message;
+  entry->len = 1;
+  entry->msg_flags = MSG_NOSIGNAL | MSG_WAITALL;
+  return true;
+}
+
+// Reads from a non-blocking descriptor such as an eventfd or a timerfd. A
+// plain read would complete with EAGAIN right away, so it is linked behind
+// a poll for input. Only the read posts a completion, unless the poll
+// fails, in which case the read completes as canceled as well. Both entries
+// are reserved up front so that the link is never split across two
+// submissions.
+bool UringInstance::Read(int descriptor, void *buffer, size_t length,
+                         uint64_t tag) {
+  if (!Reserve(2)) {
+    return false;
+  }
+  struct io_uring_sqe *entry = GetEntry(IORING_OP_POLL_ADD, descriptor, tag);
+  entry->poll32_events = POLLIN;
+  entry->flags = IOSQE_IO_LINK | IOSQE_CQE_SKIP_SUCCESS;
+  entry = GetEntry(IORING_OP_READ, descriptor, tag);
+  entry->addr = (uint64_t)buffer;
+  entry->len = length;
+  entry->off = (uint64_t)-1;
+  return true;
+}
+
+bool UringInstance::Poll(int descriptor, int events, uint64_t tag) {
+  struct io_uring_sqe *entry = GetEntry(IORING_OP_POLL_ADD, descriptor, tag);
+  if (entry == nullptr) {
+    return false;
+  }
+  entry->poll32_events = events;
+  return true;
+}
+
+bool UringInstance::Cancel(uint64_t target, uint64_t tag) {
+  struct io_uring_sqe *entry = GetEntry(IORING_OP_ASYNC_CANCEL, -1, tag);
+  if (entry == nullptr) {
+    return false;
+  }
+  entry->addr = target;
+  return true;
+}
+
+uint64_t UringInstance::GetTag(size_t index) {
+  if (index >= kMaximumEvents) {
+    return 0;
+  }
+  return completions_[index].user_data;
+}
+
+int UringInstance::GetResult(size_t index) {
+  if (index >= kMaximumEvents) {
+    return -EINVAL;
+  }
+  return completions_[index].res;
+}
+
+bool UringInstance::HasMore(size_t index) {
+  if (index >= kMaximumEvents) {
+    return false;
+  }
+  return completions_[index].flags & IORING_CQE_F_MORE;
+}
+
+int UringInstance::GetBufferId(size_t index) {
+  if (index >= kMaximumEvents ||
+      !(completions_[index].flags & IORING_CQE_F_BUFFER)) {
+    return -1;
+  }
+  return completions_[index].flags >> IORING_CQE_BUFFER_SHIFT;
 }
 
 TcpSocket::TcpSocket()
-    : host_(kStringEmpty), service_(kStringEmpty), descriptor_(-1),
-      listening_(false), connected_(false) {}
+    : host_(kStringEmpty), service_(kStringEmpty), address_length_(0),
+      descriptor_(-1), listening_(false), connected_(false), blocking_(true) {}
 
 TcpSocket::~TcpSocket() { Close(); }
 
@@ -138,13 +499,70 @@ void TcpSocket::Close() {
   descriptor_ = -1;
   listening_ = false;
   connected_ = false;
+  blocking_ = true;
   host_ = kStringEmpty;
   service_ = kStringEmpty;
+  address_length_ = 0;
+}
+
+const std::string &TcpSocket::GetHost() const {
+  ResolvePeer();
+  return host_;
+}
+
+const std::string &TcpSocket::GetService() const {
+  ResolvePeer();
+  return service_;
 }
 
-const std::string &TcpSocket::GetHost() const { return host_; }
+// Raw peer address without the port, cheap enough to key per-client state.
+std::string_view TcpSocket::GetAddress() const {
+  LoadPeer();
+  if (address_length_ == 0) {
+    return std::string_view();
+  }
+  if (address_.ss_family == AF_INET) {
+    const struct sockaddr_in *address = (const struct sockaddr_in *)&address_;
+    return std::string_view((const char *)&address->sin_addr,
+                            sizeof(address->sin_addr));
+  }
+  if (address_.ss_family == AF_INET6) {
+    const struct sockaddr_in6 *address =
+        (const struct sockaddr_in6 *)&address_;
+    return std::string_view((const char *)&address->sin6_addr,
+                            sizeof(address->sin6_addr));
+  }
+  return std::string_view();
+}
 
-const std::string &TcpSocket::GetService() const { return service_; }
+// Sockets accepted elsewhere learn their peer address on first use.
+void TcpSocket::LoadPeer() const {
+  if (address_length_ != 0 || !connected_) {
+    return;
+  }
+  socklen_t address_length = sizeof(address_);
+  if (getpeername(descriptor_, (struct sockaddr *)&address_,
+                  &address_length) == -1) {
+    return;
+  }
+  address_length_ = address_length;
+}
+
+void TcpSocket::ResolvePeer() const {
+  LoadPeer();
+  if (address_length_ == 0 || !host_.empty()) {
+    return;
+  }
+  char host[NI_MAXHOST];
+  char service[NI_MAXSERV];
+  if (getnameinfo((const struct sockaddr *)&address_, address_length_, host,
+                  sizeof(host), service, sizeof(service),
+                  NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
+    return;
+  }
+  host_ = host;
+  service_ = service;
+}
 
 const int TcpSocket::GetDescriptor() const { return descriptor_; }
 
@@ -178,7 +596,8 @@ bool TcpSocket::WaitSend(long timeout) {
 
 bool TcpSocket::IsConnected() { return connected_; }
 
-bool TcpSocket::Connect(const std::string &service, const std::string &host) {
+bool TcpSocket::Connect(const std::string &service, const std::string &host,
+                        bool nonblocking) {
   Close();
   struct addrinfo hints;
   struct addrinfo *result, *iter;
@@ -193,11 +612,12 @@ bool TcpSocket::Connect(const std::string &service, const std::string &host) {
   }
   int sfd;
   for (iter = result; iter != nullptr; iter = iter->ai_next) {
-    if ((sfd = socket(iter->ai_family, iter->ai_socktype, iter->ai_protocol)) ==
-        -1) {
+    int type = iter->ai_socktype | (nonblocking ? SOCK_NONBLOCK : 0);
+    if ((sfd = socket(iter->ai_family, type, iter->ai_protocol)) == -1) {
       continue;
     }
-    if (connect(sfd, iter->ai_addr, iter->ai_addrlen) != -1) {
+    if (connect(sfd, iter->ai_addr, iter->ai_addrlen) != -1 ||
+        (nonblocking && errno == EINPROGRESS)) {
       break;
     }
     close(sfd);
@@ -210,12 +630,14 @@ bool TcpSocket::Connect(const std::string &service, const std::string &host) {
   host_ = host;
   service_ = service;
   connected_ = true;
+  blocking_ = !nonblocking;
   return true;
 }
 
 bool TcpSocket::IsListening() { return listening_; }
 
-bool TcpSocket::Listen(const std::string &service, const std::string &host) {
+bool TcpSocket::Listen(const std::string &service, const std::string &host,
+                       bool reuse_port) {
   Close();
   struct addrinfo hints;
   struct addrinfo *result, *iter;
@@ -243,6 +665,13 @@ bool TcpSocket::Listen(const std::string &service, const std::string &host) {
       freeaddrinfo(result);
       return false;
     }
+    if (reuse_port &&
+        setsockopt(sfd, SOL_SOCKET, SO_REUSEPORT, &option_value,
+                   sizeof(option_value)) == -1) {
+      close(sfd);
+      freeaddrinfo(result);
+      return false;
+    }
     if (bind(sfd, iter->ai_addr, iter->ai_addrlen) == 0) {
       break;
     }
@@ -268,13 +697,9 @@ bool TcpSocket::Listen(const std::string &service, const std::string &host) {
   return true;
 }
 
-bool TcpSocket::IsBlocking() {
-  int flags = fcntl(descriptor_, F_GETFL, 0);
-  if (flags == -1) {
-    return false;
-  }
-  return !(flags & O_NONBLOCK);
-}
+// The mode is tracked by the socket itself so that the I/O calls do not
+// need an extra fcntl to look it up.
+bool TcpSocket::IsBlocking() { return blocking_; }
 
 bool TcpSocket::Unblock() {
   int flags = fcntl(descriptor_, F_GETFL, 0);
@@ -286,6 +711,7 @@ bool TcpSocket::Unblock() {
   if (err == -1) {
     return false;
   }
+  blocking_ = false;
   return true;
 }
 
@@ -299,6 +725,7 @@ bool TcpSocket::Block() {
   if (err == -1) {
     return false;
   }
+  blocking_ = true;
   return true;
 }
 
@@ -314,30 +741,61 @@ bool TcpSocket::IsGood() {
   return true;
 }
 
+// Takes over a listening socket that was created elsewhere, for instance
+// one received from another process. The socket is only owned on success.
+bool TcpSocket::Adopt(int descriptor) {
+  int listening = 0;
+  socklen_t length = sizeof(listening);
+  if (getsockopt(descriptor, SOL_SOCKET, SO_ACCEPTCONN, &listening,
+                 &length) == -1 ||
+      !listening) {
+    return false;
+  }
+  Close();
+  descriptor_ = descriptor;
+  listening_ = true;
+  blocking_ = !(fcntl(descriptor, F_GETFL, 0) & O_NONBLOCK);
+  return true;
+}
+
+// Takes over a connected socket that was accepted elsewhere, for instance
+// by io_uring. The descriptor has to be non-blocking already, and the peer
+// address is looked up lazily.
+void TcpSocket::Attach(int descriptor) {
+  Close();
+  descriptor_ = descriptor;
+  connected_ = true;
+  blocking_ = false;
+}
+
 TcpSocket *TcpSocket::Accept() {
-  if (!IsListening() || !IsGood()) {
+  TcpSocket *client = new TcpSocket();
+  if (!Accept(client)) {
+    delete client;
     return nullptr;
   }
-  struct sockaddr address;
+  return client;
+}
+
+bool TcpSocket::Accept(TcpSocket *client) {
+  if (!IsListening()) {
+    return false;
+  }
+  struct sockaddr_storage address;
   socklen_t address_length = sizeof(address);
-  memset(&address, 0, address_length);
-  int cfd = accept(descriptor_, &address, &address_length);
+  int cfd = accept4(descriptor_, (struct sockaddr *)&address, &address_length,
+                    SOCK_NONBLOCK | SOCK_CLOEXEC);
   if (cfd == -1) {
-    return nullptr;
-  }
-  char host[NI_MAXHOST];
-  char service[NI_MAXSERV];
-  if (getnameinfo(&address, address_length, host, sizeof(host), service,
-                  sizeof(service), NI_NUMERICHOST | NI_NUMERICSERV) != 0) {
-    return nullptr;
+    return false;
   }
-  TcpSocket *client = new TcpSocket();
+  client->Close();
   client->descriptor_ = cfd;
-  client->host_ = host;
-  client->service_ = service;
+  client->address_ = address;
+  client->address_length_ = address_length;
   client->listening_ = false;
   client->connected_ = true;
-  return client;
+  client->blocking_ = false;
+  return true;
 }
 
 IoStatusCode TcpSocket::Receive(std::string &payload, long timeout) {
@@ -347,9 +805,6 @@ IoStatusCode TcpSocket::Receive(std::string &payload, long timeout) {
   if (!IsConnected()) {
     return NOT_CONNECTED;
   }
-  if (!IsGood()) {
-    return BAD;
-  }
   ssize_t bytes;
   ssize_t length;
   char buffer[kTcpReceiveBufferSize];
@@ -398,15 +853,65 @@ IoStatusCode TcpSocket::Receive(std::string &payload, long timeout) {
   }
 }
 
-IoStatusCode TcpSocket::Send(std::string &payload, long timeout) {
+IoStatusCode TcpSocket::Receive(char *buffer, size_t length, size_t &received,
+                               long timeout) {
+  received = 0;
   if (IsBlocking()) {
     return SOCKET_FLAGS;
   }
   if (!IsConnected()) {
     return NOT_CONNECTED;
   }
-  if (!IsGood()) {
-    return BAD;
+  ssize_t bytes;
+  long start = TimeEpochMilliseconds();
+  for (;;) {
+    if (received == length) {
+      return SUCCESS;
+    }
+    bytes = recv(descriptor_, &buffer[received], length - received, 0);
+    switch (bytes) {
+    case -1:
+      if (errno == EAGAIN || errno == EWOULDBLOCK) {
+        if (timeout == 0) {
+          return received > 0 ? SUCCESS : BLOCKED;
+        }
+        if (TimeEpochMilliseconds() - start >= timeout) {
+          return TIMEOUT;
+        }
+        usleep(timeout * 100);
+        continue;
+      }
+      if (errno == EINTR) {
+        if (timeout == 0) {
+          return INTERRUPTED;
+        }
+        if (TimeEpochMilliseconds() - start >= timeout) {
+          return TIMEOUT;
+        }
+        continue;
+      }
+      return ERROR;
+    case 0:
+      return DISCONNECT;
+    default:
+      received += bytes;
+      if (timeout == 0) {
+        return SUCCESS;
+      }
+      if (TimeEpochMilliseconds() - start >= timeout) {
+        return TIMEOUT;
+      }
+      continue;
+    }
+  }
+}
+
+IoStatusCode TcpSocket::Send(std::string &payload, long timeout) {
+  if (IsBlocking()) {
+    return SOCKET_FLAGS;
+  }
+  if (!IsConnected()) {
+    return NOT_CONNECTED;
   }
   if (payload.size() > kTcpMaximumPayloadSize) {
     return OVERFLOW;
@@ -454,20 +959,221 @@ IoStatusCode TcpSocket::Send(std::string &payload, long timeout) {
   }
 }
 
+IoStatusCode TcpSocket::Send(const struct iovec *vector, size_t count,
+                            size_t &sent, bool more) {
+  sent = 0;
+  if (IsBlocking()) {
+    return SOCKET_FLAGS;
+  }
+  if (!IsConnected()) {
+    return NOT_CONNECTED;
+  }
+  struct msghdr message;
+  memset(&message, 0, sizeof(struct msghdr));
+  message.msg_iov = const_cast<struct iovec *>(vector);
+  message.msg_iovlen = count;
+  ssize_t bytes =
+      sendmsg(descriptor_, &message, MSG_NOSIGNAL | (more ? MSG_MORE : 0));
+  if (bytes == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return BLOCKED;
+    }
+    if (errno == EINTR) {
+      return INTERRUPTED;
+    }
+    return ERROR;
+  }
+  sent = bytes;
+  return SUCCESS;
+}
+
+IoStatusCode TcpSocket::SendFile(int descriptor, off_t offset, size_t length,
+                                 size_t &sent) {
+  sent = 0;
+  if (IsBlocking()) {
+    return SOCKET_FLAGS;
+  }
+  if (!IsConnected()) {
+    return NOT_CONNECTED;
+  }
+  ssize_t bytes = sendfile(descriptor_, descriptor, &offset, length);
+  if (bytes == -1) {
+    if (errno == EAGAIN || errno == EWOULDBLOCK) {
+      return BLOCKED;
+    }
+    if (errno == EINTR) {
+      return INTERRUPTED;
+    }
+    return ERROR;
+  }
+  if (bytes == 0) {
+    // the file shrank below the length announced in the response head
+    return ERROR;
+  }
+  sent = bytes;
+  return SUCCESS;
+}
+
+UnixSocket::UnixSocket() : descriptor_(-1) {}
+
+UnixSocket::~UnixSocket() { Close(); }
+
+void UnixSocket::Close() {
+  if (descriptor_ != -1) {
+    close(descriptor_);
+  }
+  descriptor_ = -1;
+}
+
+const int UnixSocket::GetDescriptor() const { return descriptor_; }
+
+bool UnixSocket::GetAddress(const std::string &path,
+                            struct sockaddr_un &address) {
+  if (path.empty() || path.length() >= sizeof(address.sun_path)) {
+    return false;
+  }
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  memcpy(address.sun_path, path.c_str(), path.length());
+  return true;
+}
+
+// Replaces a stale socket file, a process that still listens on the old
+// file keeps its socket but can no longer be reached by path.
+bool UnixSocket::Listen(const std::string &path) {
+  Close();
+  struct sockaddr_un address;
+  if (!GetAddress(path, address)) {
+    return false;
+  }
+  if ((descriptor_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+    return false;
+  }
+  unlink(path.c_str());
+  if (bind(descriptor_, (struct sockaddr *)&address, sizeof(address)) == -1 ||
+      listen(descriptor_, 1) == -1) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+bool UnixSocket::Connect(const std::string &path) {
+  Close();
+  struct sockaddr_un address;
+  if (!GetAddress(path, address)) {
+    return false;
+  }
+  if ((descriptor_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0)) == -1) {
+    return false;
+  }
+  if (connect(descriptor_, (struct sockaddr *)&address, sizeof(address)) ==
+      -1) {
+    Close();
+    return false;
+  }
+  return true;
+}
+
+bool UnixSocket::Accept(UnixSocket *client) {
+  int descriptor = accept4(descriptor_, nullptr, nullptr, SOCK_CLOEXEC);
+  if (descriptor == -1) {
+    return false;
+  }
+  client->Close();
+  client->descriptor_ = descriptor;
+  return true;
+}
+
+bool UnixSocket::SendDescriptors(const std::vector<int> &descriptors) {
+  if (descriptors.empty() || descriptors.size() > kUnixMaximumDescriptors) {
+    return false;
+  }
+  char control[CMSG_SPACE(kUnixMaximumDescriptors * sizeof(int))];
+  memset(control, 0, sizeof(control));
+  char payload = 0;
+  struct iovec vector = {&payload, sizeof(payload)};
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = CMSG_SPACE(descriptors.size() * sizeof(int));
+  struct cmsghdr *header = CMSG_FIRSTHDR(&message);
+  header->cmsg_level = SOL_SOCKET;
+  header->cmsg_type = SCM_RIGHTS;
+  header->cmsg_len = CMSG_LEN(descriptors.size() * sizeof(int));
+  memcpy(CMSG_DATA(header), descriptors.data(),
+         descriptors.size() * sizeof(int));
+  ssize_t sent;
+  do {
+    sent = sendmsg(descriptor_, &message, MSG_NOSIGNAL);
+  } while (sent == -1 && errno == EINTR);
+  return sent == sizeof(payload);
+}
+
+bool UnixSocket::ReceiveDescriptors(std::vector<int> &descriptors,
+                                    long timeout) {
+  descriptors.clear();
+  struct pollfd event;
+  event.fd = descriptor_;
+  event.events = POLLIN;
+  if (poll(&event, 1, timeout) <= 0 || !(event.revents & POLLIN)) {
+    return false;
+  }
+  char control[CMSG_SPACE(kUnixMaximumDescriptors * sizeof(int))];
+  char payload = 0;
+  struct iovec vector = {&payload, sizeof(payload)};
+  struct msghdr message;
+  memset(&message, 0, sizeof(message));
+  message.msg_iov = &vector;
+  message.msg_iovlen = 1;
+  message.msg_control = control;
+  message.msg_controllen = sizeof(control);
+  ssize_t received;
+  do {
+    received = recvmsg(descriptor_, &message, MSG_CMSG_CLOEXEC);
+  } while (received == -1 && errno == EINTR);
+  if (received <= 0) {
+    return false;
+  }
+  for (struct cmsghdr *header = CMSG_FIRSTHDR(&message); header != nullptr;
+       header = CMSG_NXTHDR(&message, header)) {
+    if (header->cmsg_level != SOL_SOCKET || header->cmsg_type != SCM_RIGHTS) {
+      continue;
+    }
+    size_t count = (header->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    const unsigned char *data = CMSG_DATA(header);
+    for (size_t i = 0; i < count; i++) {
+      int descriptor;
+      memcpy(&descriptor, data + i * sizeof(int), sizeof(int));
+      descriptors.push_back(descriptor);
+    }
+  }
+  if (message.msg_flags & MSG_CTRUNC) {
+    for (size_t i = 0; i < descriptors.size(); i++) {
+      close(descriptors[i]);
+    }
+    descriptors.clear();
+    return false;
+  }
+  return !descriptors.empty();
+}
+
 TcpReader::TcpReader(TcpSocket *socket)
-    : socket_(socket), buffer_(kStringEmpty), status_(NONE) {}
+    : buffer_(nullptr), capacity_(0), begin_(0), end_(0),
+      scan_token_(kStringEmpty), scan_position_(0), received_(0),
+      socket_(socket), status_(NONE) {}
 
-TcpReader::~TcpReader() {}
+TcpReader::~TcpReader() { free(buffer_); }
 
 void TcpReader::ReadUntil(const std::string &token, long max_idle) {
-  size_t start = 0;
-  while (!StringContains(buffer_, token, start)) {
-    start = buffer_.size();
+  while (!IsInBuffer(token)) {
     if (!socket_->WaitReceive(max_idle)) {
       status_ = EMPTY_BUFFER;
       break;
     }
-    status_ = socket_->Receive(buffer_);
+    ReadSome();
     if (HasErrors()) {
       break;
     }
@@ -475,12 +1181,12 @@ void TcpReader::ReadUntil(const std::string &token, long max_idle) {
 }
 
 void TcpReader::ReadUntil(size_t length, long max_idle) {
-  while (buffer_.length() < length) {
+  while (GetLength() < length) {
     if (!socket_->WaitReceive(max_idle)) {
       status_ = EMPTY_BUFFER;
       break;
     }
-    status_ = socket_->Receive(buffer_);
+    ReadSome();
     if (HasErrors()) {
       break;
     }
@@ -490,52 +1196,224 @@ void TcpReader::ReadUntil(size_t length, long max_idle) {
 bool TcpReader::HasErrors() { return status_ != SUCCESS && status_ != BLOCKED; }
 
 void TcpReader::ReadSome(long timeout) {
-  status_ = socket_->Receive(buffer_, timeout);
+  if (!Reserve(kTcpReceiveChunkSize)) {
+    status_ = OVERFLOW;
+    return;
+  }
+  size_t received = 0;
+  status_ = socket_->Receive(&buffer_[end_], capacity_ - end_, received,
+                             timeout);
+  end_ += received;
+  received_ += received;
+}
+
+// Appends data that was received elsewhere, for instance by io_uring.
+void TcpReader::Append(const char *data, size_t length) {
+  if (!Reserve(length) || capacity_ - end_ < length) {
+    status_ = OVERFLOW;
+    return;
+  }
+  memcpy(&buffer_[end_], data, length);
+  end_ += length;
+  received_ += length;
+  status_ = SUCCESS;
+}
+
+void TcpReader::SetStatus(IoStatusCode status) { status_ = status; }
+
+bool TcpReader::Reserve(size_t length) {
+  if (capacity_ - end_ >= length) {
+    return true;
+  }
+  if (begin_ > 0) {
+    memmove(buffer_, &buffer_[begin_], end_ - begin_);
+    end_ -= begin_;
+    scan_position_ = scan_position_ > begin_ ? scan_position_ - begin_ : 0;
+    begin_ = 0;
+    if (capacity_ - end_ >= length) {
+      return true;
+    }
+  }
+  if (end_ + length > (size_t)kTcpMaximumPayloadSize) {
+    length = kTcpMaximumPayloadSize - end_;
+    if (length == 0) {
+      return false;
+    }
+  }
+  size_t capacity = std::max(capacity_ * 2, end_ + length);
+  capacity = std::min(capacity, (size_t)kTcpMaximumPayloadSize);
+  char *buffer = (char *)realloc(buffer_, capacity);
+  if (buffer == nullptr) {
+    return false;
+  }
+  buffer_ = buffer;
+  capacity_ = capacity;
+  return true;
 }
 
 std::string TcpReader::PopSegment(const std::string &token) {
-  return StringPopSegment(buffer_, token);
+  size_t position = GetPosition(token);
+  if (position == std::string::npos) {
+    return kStringEmpty;
+  }
+  std::string segment(&buffer_[begin_], position);
+  Consume(position + token.length());
+  return segment;
 }
 
 std::string TcpReader::PopSegment(size_t position) {
-  return StringPopSegment(buffer_, position);
+  if (position == std::string::npos) {
+    return kStringEmpty;
+  }
+  if (position >= GetLength()) {
+    return PopAll();
+  }
+  std::string segment(&buffer_[begin_], position);
+  Consume(position + 1);
+  return segment;
 }
 
 size_t TcpReader::GetPosition(const std::string &token) {
-  return StringPosition(buffer_, token);
+  if (token != scan_token_) {
+    scan_token_ = token;
+    scan_position_ = begin_;
+  }
+  size_t start = std::max(scan_position_, begin_);
+  size_t position = GetBuffer().find(token, start - begin_);
+  if (position == std::string::npos) {
+    size_t overlap = std::min(token.length() - 1, end_ - start);
+    scan_position_ = token.empty() ? start : end_ - overlap;
+    return std::string::npos;
+  }
+  scan_position_ = begin_ + position;
+  return position;
 }
 
 std::string TcpReader::PopAll() {
-  std::string temp = buffer_;
-  buffer_.clear();
-  return temp;
+  std::string segment(GetBuffer());
+  ClearBuffer();
+  return segment;
+}
+
+size_t TcpReader::PopReceived() {
+  size_t received = received_;
+  received_ = 0;
+  return received;
 }
 
 IoStatusCode TcpReader::GetStatus() { return status_; }
 
 bool TcpReader::IsInBuffer(const std::string &token) {
-  return StringContains(buffer_, token);
+  return GetPosition(token) != std::string::npos;
+}
+
+void TcpReader::ClearBuffer() {
+  begin_ = 0;
+  end_ = 0;
+  scan_position_ = 0;
+}
+
+void TcpReader::Reset() {
+  ClearBuffer();
+  status_ = NONE;
+  if (capacity_ > (size_t)kTcpReceiveBufferSize) {
+    free(buffer_);
+    buffer_ = nullptr;
+    capacity_ = 0;
+  }
 }
 
-void TcpReader::ClearBuffer() { buffer_.clear(); }
+void TcpReader::Consume(size_t length) {
+  begin_ += std::min(length, end_ - begin_);
+  if (begin_ == end_) {
+    ClearBuffer();
+  }
+}
+
+std::string_view TcpReader::GetBuffer() {
+  return std::string_view(buffer_ == nullptr ? "" : &buffer_[begin_],
+                          end_ - begin_);
+}
+
+size_t TcpReader::GetLength() { return end_ - begin_; }
+
+TcpFile::TcpFile(int descriptor) : descriptor_(descriptor) {}
 
-const std::string &TcpReader::GetBuffer() { return buffer_; }
+TcpFile::~TcpFile() {
+  if (descriptor_ != -1) {
+    close(descriptor_);
+  }
+}
+
+int TcpFile::GetDescriptor() const { return descriptor_; }
 
 TcpWriter::TcpWriter(TcpSocket *socket)
-    : socket_(socket), buffer_(kStringEmpty), status_(NONE) {}
+    : length_(0), open_(false), offset_(0), sent_(0), socket_(socket),
+      status_(NONE) {}
 
 TcpWriter::~TcpWriter() {}
 
 void TcpWriter::Write(const std::string &payload) {
-  buffer_.insert(buffer_.end(), payload.begin(), payload.end());
+  if (payload.empty()) {
+    return;
+  }
+  Prepare().append(payload);
+}
+
+void TcpWriter::Write(std::string &&payload) {
+  if (payload.empty()) {
+    return;
+  }
+  Seal();
+  length_ += payload.length();
+  segments_.push_back({std::move(payload), nullptr, nullptr, 0, 0});
+}
+
+void TcpWriter::Write(std::shared_ptr<const std::string> payload) {
+  if (payload == nullptr || payload->empty()) {
+    return;
+  }
+  Seal();
+  length_ += payload->length();
+  segments_.push_back({std::string(), std::move(payload), nullptr, 0, 0});
+}
+
+void TcpWriter::Write(std::shared_ptr<TcpFile> file, off_t offset,
+                      size_t length) {
+  if (file == nullptr || length == 0) {
+    return;
+  }
+  Seal();
+  length_ += length;
+  segments_.push_back(
+      {std::string(), nullptr, std::move(file), offset, length});
+}
+
+// The returned segment is filled in by the caller, so its length is only
+// added to the total once the next segment is queued or bytes are consumed.
+std::string &TcpWriter::Prepare() {
+  Seal();
+  open_ = true;
+  if (spare_.empty()) {
+    segments_.push_back({std::string(), nullptr, nullptr, 0, 0});
+  } else {
+    segments_.push_back({std::move(spare_.back()), nullptr, nullptr, 0, 0});
+    spare_.pop_back();
+  }
+  return segments_.back().data;
+}
+
+void TcpWriter::Reset() {
+  Advance(GetLength());
+  status_ = NONE;
 }
 
 void TcpWriter::Send() {
-  while (!buffer_.empty()) {
+  while (!IsEmpty()) {
     if (!socket_->WaitSend(kTcpTimeout)) {
       break;
     }
-    status_ = socket_->Send(buffer_);
+    SendSome();
     if (HasErrors()) {
       break;
     }
@@ -546,8 +1424,126 @@ bool TcpWriter::HasErrors() {
   return status_ != SUCCESS && status_ != BLOCKED;
 }
 
-void TcpWriter::SendSome() { status_ = socket_->Send(buffer_); }
+void TcpWriter::SendSome() {
+  struct iovec vector[kTcpMaximumSegments];
+  while (!IsEmpty()) {
+    size_t sent = 0;
+    TcpSegment &front = segments_.front();
+    if (front.file != nullptr) {
+      status_ = socket_->SendFile(front.file->GetDescriptor(), front.offset,
+                                  front.length, sent);
+    } else {
+      bool more = false;
+      size_t count = Gather(vector, kTcpMaximumSegments, more);
+      if (count == 0) {
+        Advance(0);
+        continue;
+      }
+      status_ = socket_->Send(vector, count, sent, more);
+    }
+    if (status_ == INTERRUPTED) {
+      continue;
+    }
+    if (status_ != SUCCESS) {
+      return;
+    }
+    sent_ += sent;
+    Advance(sent);
+  }
+  status_ = SUCCESS;
+}
+
+// Describes the payload in memory at the front of the queue, up to the
+// next file, without consuming it. The segments stay in place until their
+// bytes are committed, so the vector may be handed to asynchronous sends.
+size_t TcpWriter::Gather(struct iovec *vector, size_t count, bool &more) {
+  size_t gathered = 0;
+  size_t offset = offset_;
+  more = false;
+  for (auto it = segments_.begin(); it != segments_.end() && gathered < count;
+       it++) {
+    if (it->file != nullptr) {
+      more = true;
+      break;
+    }
+    std::string_view data = GetData(*it);
+    if (data.length() == offset) {
+      offset = 0;
+      continue;
+    }
+    vector[gathered].iov_base = const_cast<char *>(&data[offset]);
+    vector[gathered].iov_len = data.length() - offset;
+    offset = 0;
+    gathered++;
+  }
+  return gathered;
+}
+
+// Consumes bytes that were sent elsewhere, for instance by io_uring.
+void TcpWriter::Commit(size_t sent) {
+  sent_ += sent;
+  Advance(sent);
+  status_ = SUCCESS;
+}
+
+void TcpWriter::SetStatus(IoStatusCode status) { status_ = status; }
+
+void TcpWriter::Seal() {
+  if (open_) {
+    length_ += segments_.back().data.length();
+    open_ = false;
+  }
+}
+
+void TcpWriter::Advance(size_t length) {
+  Seal();
+  length_ -= std::min(length, length_);
+  while (!segments_.empty()) {
+    TcpSegment &segment = segments_.front();
+    if (segment.file != nullptr) {
+      size_t step = std::min(length, segment.length);
+      segment.offset += step;
+      segment.length -= step;
+      length -= step;
+      if (segment.length > 0) {
+        return;
+      }
+      segments_.pop_front();
+      continue;
+    }
+    size_t remaining = GetData(segment).length() - offset_;
+    if (length < remaining) {
+      offset_ += length;
+      return;
+    }
+    length -= remaining;
+    offset_ = 0;
+    if (segment.shared == nullptr && spare_.size() < kTcpSpareSegments &&
+        segment.data.capacity() <= (size_t)kTcpSendBufferSize) {
+      segment.data.clear();
+      spare_.push_back(std::move(segment.data));
+    }
+    segments_.pop_front();
+  }
+}
 
 IoStatusCode TcpWriter::GetStatus() { return status_; }
 
-bool TcpWriter::IsEmpty() { return buffer_.empty(); }
+bool TcpWriter::IsEmpty() { return GetLength() == 0; }
+
+size_t TcpWriter::GetLength() {
+  return open_ ? length_ + segments_.back().data.length() : length_;
+}
+
+size_t TcpWriter::PopSent() {
+  size_t sent = sent_;
+  sent_ = 0;
+  return sent;
+}
+
+std::string_view TcpWriter::GetData(const TcpSegment &segment) {
+  if (segment.shared != nullptr) {
+    return *segment.shared;
+  }
+  return segment.data;
+}
@@ -24,7 +24,10 @@ SOFTWARE. */
 
 #include <cstdio>
 #include <cstdlib>
+#include <deque>
+#include <memory>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <arpa/inet.h>
@@ -35,11 +38,16 @@ SOFTWARE. */
 #include <poll.h>
 #include <stdint.h>
 #include <string.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
 #include <sys/time.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
 #include <sys/un.h>
 #include <unistd.h>
 #include <sys/epoll.h>
+#include <linux/io_uring.h>
 
 #include "utils.h"
 
@@ -51,17 +59,20 @@ public:
   virtual ~EpollInstance();
   bool Create();
   void Release();
+  void SetEdgeTriggered(bool edge_triggered);
+  bool IsEdgeTriggered();
   int Wait(long timeout = -1);
-  bool AddDescriptor(int descriptor, int flags);
-  bool AddReadableDescriptor(int descriptor);
-  bool AddWritableDescriptor(int descriptor);
-  bool AddDuplexDescriptor(int descriptor);
+  bool AddDescriptor(int descriptor, int flags, uint32_t tag = 0);
+  bool AddReadableDescriptor(int descriptor, uint32_t tag = 0);
+  bool AddWritableDescriptor(int descriptor, uint32_t tag = 0);
+  bool AddDuplexDescriptor(int descriptor, uint32_t tag = 0);
   bool DeleteDescriptor(int descriptor);
-  bool ModifyDescriptor(int descriptor, int flags);
+  bool ModifyDescriptor(int descriptor, int flags, uint32_t tag = 0);
   bool SetReadable(size_t index);
   bool SetWriteable(size_t index);
   bool SetDuplex(size_t index);
   int GetDescriptor(size_t index);
+  uint32_t GetTag(size_t index);
   int GetEvents(size_t index);
   bool IsReadable(size_t index);
   bool IsWritable(size_t index);
@@ -69,15 +80,79 @@ public:
 
 private:
   int instance_;
+  bool edge_triggered_;
   epoll_event event_;
   epoll_event events_[kMaximumEvents];
 };
 
+const unsigned kUringEntries = 1024;
+
+// Submission and completion rings of io_uring, set up with plain system
+// calls. Operations are queued with a 64-bit tag and submitted in one batch
+// on the next Wait, which copies the completions out so that they can be
+// addressed by index like the events of an EpollInstance. Multishot
+// operations keep completing until a completion reports no more to come.
+// Receives pick their memory from a ring of provided buffers, which must be
+// handed back once the data has been copied out.
+class UringInstance {
+public:
+  UringInstance();
+  virtual ~UringInstance();
+  bool Create(unsigned entries = kUringEntries);
+  bool Enable();
+  void Release();
+  bool SetupBuffers(uint16_t count, uint32_t size);
+  const char *GetBuffer(uint16_t id);
+  void RecycleBuffer(uint16_t id);
+  int Wait(long timeout = -1);
+  bool Accept(int descriptor, uint64_t tag);
+  bool Receive(int descriptor, uint64_t tag);
+  bool Send(int descriptor, const struct msghdr *message, uint64_t tag);
+  bool Read(int descriptor, void *buffer, size_t length, uint64_t tag);
+  bool Poll(int descriptor, int events, uint64_t tag);
+  bool Cancel(uint64_t target, uint64_t tag);
+  uint64_t GetTag(size_t index);
+  int GetResult(size_t index);
+  bool HasMore(size_t index);
+  int GetBufferId(size_t index);
+
+private:
+  bool Reserve(unsigned count);
+  struct io_uring_sqe *GetEntry(uint8_t opcode, int descriptor, uint64_t tag);
+  bool Enter(unsigned wait, long timeout);
+  int instance_;
+  unsigned flags_;
+  void *rings_;
+  size_t rings_length_;
+  struct io_uring_sqe *entries_;
+  size_t entries_length_;
+  unsigned *sq_head_;
+  unsigned *sq_tail_;
+  unsigned *sq_flags_;
+  unsigned sq_mask_;
+  unsigned sq_entries_;
+  unsigned sq_queued_;
+  unsigned *cq_head_;
+  unsigned *cq_tail_;
+  unsigned cq_mask_;
+  struct io_uring_cqe *cq_entries_;
+  struct io_uring_buf_ring *buffer_ring_;
+  size_t buffer_ring_length_;
+  char *buffers_;
+  uint16_t buffer_count_;
+  uint32_t buffer_size_;
+  struct io_uring_cqe completions_[kMaximumEvents];
+};
+
 const std::string kTcpLocalHost = "127.0.0.1";
 const long kTcpReceiveBufferSize = 65536L;
+const long kTcpReceiveChunkSize = 4096L;
 const long kTcpSendBufferSize = 65536L;
+const size_t kTcpMaximumSegments = 64;
+const size_t kTcpSpareSegments = 4;
 const long kTcpMaximumPayloadSize = 16777216L;
 const long kTcpTimeout = 1000L;
+const size_t kUnixMaximumDescriptors = 64;
 
 enum IoStatusCode {
   SUCCESS = 0,
@@ -102,27 +177,63 @@ public:
   void Close();
   const std::string &GetHost() const;
   const std::string &GetService() const;
+  std::string_view GetAddress() const;
   const int GetDescriptor() const;
   bool WaitReceive(long timeout = 0);
   bool WaitSend(long timeout = 0);
   bool IsConnected();
-  bool Connect(const std::string &service, const std::string &host);
+  bool Connect(const std::string &service, const std::string &host,
+               bool nonblocking = false);
   bool IsListening();
-  bool Listen(const std::string &service, const std::string &host);
+  bool Listen(const std::string &service, const std::string &host,
+              bool reuse_port = false);
+  bool Adopt(int descriptor);
+  void Attach(int descriptor);
   bool IsBlocking();
   bool Unblock();
   bool Block();
   bool IsGood();
   TcpSocket *Accept();
+  bool Accept(TcpSocket *client);
   IoStatusCode Receive(std::string &payload, long timeout = 0);
+  IoStatusCode Receive(char *buffer, size_t length, size_t &received,
+                       long timeout = 0);
   IoStatusCode Send(std::string &payload, long timeout = 0);
+  IoStatusCode Send(const struct iovec *vector, size_t count, size_t &sent,
+                    bool more = false);
+  IoStatusCode SendFile(int descriptor, off_t offset, size_t length,
+                        size_t &sent);
 
 private:
-  std::string host_;
-  std::string service_;
+  void LoadPeer() const;
+  void ResolvePeer() const;
+  mutable std::string host_;
+  mutable std::string service_;
+  mutable struct sockaddr_storage address_;
+  mutable socklen_t address_length_;
   int descriptor_;
   bool listening_;
   bool connected_;
+  bool blocking_;
+};
+
+// Local stream socket that passes descriptors between processes.
+class UnixSocket {
+public:
+  UnixSocket();
+  virtual ~UnixSocket();
+  void Close();
+  const int GetDescriptor() const;
+  bool Listen(const std::string &path);
+  bool Connect(const std::string &path);
+  bool Accept(UnixSocket *client);
+  bool SendDescriptors(const std::vector<int> &descriptors);
+  bool ReceiveDescriptors(std::vector<int> &descriptors,
+                          long timeout = kTcpTimeout);
+
+private:
+  static bool GetAddress(const std::string &path, struct sockaddr_un &address);
+  int descriptor_;
 };
 
 class TcpReader {
@@ -132,21 +243,51 @@ public:
   void ReadUntil(const std::string &token, long max_idle = kTcpTimeout);
   void ReadUntil(size_t length, long max_idle = kTcpTimeout);
   void ReadSome(long timeout = 0);
+  void Append(const char *data, size_t length);
+  void SetStatus(IoStatusCode status);
   IoStatusCode GetStatus();
   std::string PopSegment(const std::string &token);
   std::string PopSegment(size_t position);
   size_t GetPosition(const std::string &token);
   std::string PopAll();
+  size_t PopReceived();
   bool IsInBuffer(const std::string &token);
   void ClearBuffer();
-  const std::string& GetBuffer();
+  void Reset();
+  void Consume(size_t length);
+  std::string_view GetBuffer();
+  size_t GetLength();
   bool HasErrors();
 
 private:
-  std::string buffer_;
+  bool Reserve(size_t length);
+  char *buffer_;
+  size_t capacity_;
+  size_t begin_;
+  size_t end_;
+  std::string scan_token_;
+  size_t scan_position_;
+  size_t received_;
   TcpSocket *socket_;
   IoStatusCode status_;
-  size_t position_;
+};
+
+class TcpFile {
+public:
+  TcpFile(int descriptor);
+  virtual ~TcpFile();
+  int GetDescriptor() const;
+
+private:
+  int descriptor_;
+};
+
+struct TcpSegment {
+  std::string data;
+  std::shared_ptr<const std::string> shared;
+  std::shared_ptr<TcpFile> file;
+  off_t offset;
+  size_t length;
 };
 
 class TcpWriter {
@@ -154,15 +295,32 @@ public:
   TcpWriter(TcpSocket *socket);
   virtual ~TcpWriter();
   void Write(const std::string &payload);
+  void Write(std::string &&payload);
+  void Write(std::shared_ptr<const std::string> payload);
+  void Write(std::shared_ptr<TcpFile> file, off_t offset, size_t length);
+  std::string &Prepare();
+  void Reset();
   void Send();
   void SendSome();
+  size_t Gather(struct iovec *vector, size_t count, bool &more);
+  void Commit(size_t sent);
+  void SetStatus(IoStatusCode status);
   IoStatusCode GetStatus();
   bool IsEmpty();
+  size_t GetLength();
+  size_t PopSent();
   bool HasErrors();
 
 private:
-  std::string buffer_;
+  void Advance(size_t length);
+  void Seal();
+  static std::string_view GetData(const TcpSegment &segment);
+  std::deque<TcpSegment> segments_;
+  std::vector<std::string> spare_;
+  size_t length_;
+  bool open_;
+  size_t offset_;
+  size_t sent_;
   TcpSocket *socket_;
   IoStatusCode status_;
 };
-
@@ -25,9 +25,11 @@ SOFTWARE. */
 int main(int argc, char **argv)
 {
 
+  Logger::Start();
   HttpServer server;
   server.RegisterHandler(GET, "/", api::Status);
-  server.Serve("8080", "0.0.0.0");
+  server.Serve("8080", "0.0.0.0", std::thread::hardware_concurrency());
+  Logger::Stop();
   
   return 0;
 }
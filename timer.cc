@@ -0,0 +1,110 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#include "timer.h"
+
+TimerWheel::TimerWheel(long resolution, size_t slots)
+    : resolution_(resolution > 0 ? resolution : kTimerResolution), mask_(0),
+      tick_(0), count_(0) {
+  size_t size = 1;
+  while (size < slots) {
+    size <<= 1;
+  }
+  mask_ = size - 1;
+  slots_.resize(size);
+  for (size_t i = 0; i < size; i++) {
+    slots_[i].prev = &slots_[i];
+    slots_[i].next = &slots_[i];
+    slots_[i].deadline = 0;
+    slots_[i].data = nullptr;
+  }
+}
+
+TimerWheel::~TimerWheel() {}
+
+void TimerWheel::Start(long now) { tick_ = now / resolution_; }
+
+void TimerWheel::Schedule(TimerNode *node, long deadline) {
+  if (IsScheduled(node)) {
+    Unlink(node);
+  }
+  node->deadline = deadline;
+  long tick = (deadline + resolution_ - 1) / resolution_;
+  if (tick <= tick_) {
+    tick = tick_ + 1;
+  }
+  Link(&slots_[tick & mask_], node);
+}
+
+void TimerWheel::Cancel(TimerNode *node) {
+  if (IsScheduled(node)) {
+    Unlink(node);
+  }
+}
+
+bool TimerWheel::IsScheduled(TimerNode *node) {
+  return node->prev != nullptr && node->next != nullptr;
+}
+
+size_t TimerWheel::Advance(long now, std::vector<TimerNode *> &expired) {
+  long target = now / resolution_;
+  if (target <= tick_) {
+    return 0;
+  }
+  size_t number = 0;
+  long steps = std::min(target - tick_, (long)slots_.size());
+  for (long i = 1; i <= steps; i++) {
+    TimerNode *head = &slots_[(tick_ + i) & mask_];
+    TimerNode *node = head->next;
+    while (node != head) {
+      TimerNode *next = node->next;
+      if (node->deadline <= now) {
+        Unlink(node);
+        expired.push_back(node);
+        number++;
+      }
+      node = next;
+    }
+  }
+  tick_ = target;
+  return number;
+}
+
+size_t TimerWheel::Count() { return count_; }
+
+long TimerWheel::GetResolution() { return resolution_; }
+
+void TimerWheel::Link(TimerNode *head, TimerNode *node) {
+  node->prev = head->prev;
+  node->next = head;
+  head->prev->next = node;
+  head->prev = node;
+  count_++;
+}
+
+void TimerWheel::Unlink(TimerNode *node) {
+  node->prev->next = node->next;
+  node->next->prev = node->prev;
+  node->prev = nullptr;
+  node->next = nullptr;
+  count_--;
+}
@@ -0,0 +1,59 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+#pragma once
+
+#include <algorithm>
+#include <cstdlib>
+#include <vector>
+
+const long kTimerResolution = 250L;
+const size_t kTimerSlots = 64;
+
+struct TimerNode {
+  TimerNode *prev;
+  TimerNode *next;
+  long deadline;
+  void *data;
+};
+
+class TimerWheel {
+public:
+  TimerWheel(long resolution = kTimerResolution, size_t slots = kTimerSlots);
+  virtual ~TimerWheel();
+  void Start(long now);
+  void Schedule(TimerNode *node, long deadline);
+  void Cancel(TimerNode *node);
+  bool IsScheduled(TimerNode *node);
+  size_t Advance(long now, std::vector<TimerNode *> &expired);
+  size_t Count();
+  long GetResolution();
+
+private:
+  void Link(TimerNode *head, TimerNode *node);
+  void Unlink(TimerNode *node);
+  long resolution_;
+  size_t mask_;
+  long tick_;
+  size_t count_;
+  std::vector<TimerNode> slots_;
+};
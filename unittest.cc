@@ -0,0 +1,709 @@
+/* MIT License
+
+Copyright (c) 2020 Jonas Hegemann
+
+Permission is hereby granted, free of charge, to any person obtaining a copy
+of this software and associated documentation files (the "Software"), to deal
+in the Software without restriction, including without limitation the rights
+to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+copies of the Software, and to permit persons to whom the Software is
+furnished to do so, subject to the following conditions:
+
+The above copyright notice and this permission notice shall be included in all
+copies or substantial portions of the Software.
+
+THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+SOFTWARE. */
+
+
+#include "http.h"
+
+// Checks report the failing expression with its location and carry on, so
+// that a run lists every broken case instead of stopping at the first one.
+static size_t checks = 0;
+static size_t failures = 0;
+
+#define CHECK(condition) Check((condition), #condition, __FILE__, __LINE__)
+
+void Check(bool passed, const char *expression, const char *file, int line) {
+  checks++;
+  if (!passed) {
+    failures++;
+    printf("%s:%d: check failed: %s\n", file, line, expression);
+  }
+}
+
+// Feeds the payload to the parser the way a connection does, a growing
+// prefix of the receive buffer at a time, and returns the final stage.
+HttpStage Feed(HttpParser &parser, HttpRequest &request,
+               std::string_view payload, size_t segment = SIZE_MAX) {
+  parser.Reset();
+  size_t length = 0;
+  while (length < payload.length()) {
+    length = std::min(payload.length(), length + std::max(segment, (size_t)1));
+    HttpStage stage = parser.Parse(payload.substr(0, length), request);
+    if (stage == END || stage == FAILED) {
+      return stage;
+    }
+  }
+  return parser.Parse(payload, request);
+}
+
+int Status(std::string_view payload) {
+  HttpParser parser;
+  HttpRequest request;
+  HttpStage stage = Feed(parser, request, payload);
+  return stage == END ? OK : stage == FAILED ? parser.GetStatus() : 0;
+}
+
+void TestParser() {
+  const std::string payload = "POST /users/42?fields=name HTTP/1.1\r\n"
+                              "Host: localhost\r\n"
+                              "X-Empty:\r\n"
+                              "Content-Length: 5\r\n"
+                              "\r\n"
+                              "hello";
+  for (size_t segment : {payload.length(), (size_t)7, (size_t)1}) {
+    HttpParser parser;
+    HttpRequest request;
+    CHECK(Feed(parser, request, payload, segment) == END);
+    CHECK(request.GetMethod() == POST);
+    CHECK(request.GetPath() == "/users/42");
+    CHECK(request.GetQuery() == "fields=name");
+    CHECK(request.GetHeader("host") == "localhost");
+    CHECK(request.GetHeader(HEADER_CONTENT_LENGTH) == "5");
+    CHECK(request.CountHeaders() == 3);
+    CHECK(request.GetHeader("x-empty").empty());
+    CHECK(request.GetBody() == "hello");
+    CHECK(parser.GetLength() == payload.length());
+  }
+
+  // Pipelined requests are parsed one at a time.
+  const std::string pipelined = "GET /a HTTP/1.1\r\n\r\nGET /b HTTP/1.1\r\n\r\n";
+  HttpParser parser;
+  HttpRequest request;
+  CHECK(Feed(parser, request, pipelined) == END);
+  CHECK(request.GetPath() == "/a");
+  CHECK(parser.GetLength() == pipelined.length() / 2);
+
+  CHECK(Status("GET / HTTP/1.1\r\nContent-Length: 0\r\n"
+               "Content-Length: 0\r\n\r\n") == OK);
+  CHECK(Status("BREW / HTTP/1.1\r\n\r\n") == BAD_REQUEST);
+  CHECK(Status("GET / HTTP/1.0\r\n\r\n") == BAD_REQUEST);
+  CHECK(Status("GET / HTTP/1.1\r\nHost\r\n\r\n") == BAD_REQUEST);
+  CHECK(Status("GET / HTTP/1.1\r\n: value\r\n\r\n") == BAD_REQUEST);
+  CHECK(Status("GET / HTTP/1.1\r\nHost : localhost\r\n\r\n") == BAD_REQUEST);
+  CHECK(Status("GET / HTTP/1.1\r\nContent-Length:\r\n\r\n") == BAD_REQUEST);
+  CHECK(Status("GET / HTTP/1.1\r\nContent-Length: 1x\r\n\r\n") ==
+        BAD_REQUEST);
+  CHECK(Status("GET / HTTP/1.1\r\nContent-Length: 1\r\n"
+               "Content-Length: 2\r\n\r\nab") == BAD_REQUEST);
+  CHECK(Status("POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+               "Content-Length: 3\r\n\r\n0\r\n\r\n") == BAD_REQUEST);
+  CHECK(Status("POST / HTTP/1.1\r\nTransfer-Encoding: gzip\r\n\r\n") ==
+        BAD_REQUEST);
+  CHECK(Status("GET /" + std::string(kHttpMaximumUrlLength, 'a') +
+               " HTTP/1.1\r\n\r\n") == REQUEST_URI_TOO_LONG);
+  CHECK(Status("GET / HTTP/1.1\r\nX-Large: " +
+               std::string(kHttpMaximumHeaderLength, 'a') + "\r\n\r\n") ==
+        REQUEST_HEADER_FIELDS_TOO_LARGE);
+  std::string fields;
+  while (fields.length() <= kHttpMaximumHeaderLength) {
+    fields += "X-Field: value\r\n";
+  }
+  CHECK(Status("GET / HTTP/1.1\r\n" + fields + "\r\n") ==
+        REQUEST_HEADER_FIELDS_TOO_LARGE);
+}
+
+HttpRoute Route(HttpRouter &router, HttpMethod method, std::string_view url,
+                HttpRequest &request) {
+  request.Initialize();
+  request.SetMethod(method);
+  request.SetUrl(url);
+  return router.Find(request);
+}
+
+void TestRouter() {
+  HttpCallback callback = [](const HttpRequest &request) {
+    return HttpResponse::Build(OK);
+  };
+  HttpRouter router;
+  HttpHandler *users = router.Insert(GET, "/users", callback);
+  HttpHandler *user = router.Insert(GET, "/users/:id", callback);
+  HttpHandler *update = router.Insert(PUT, "/users/:id", callback);
+  HttpHandler *me = router.Insert(GET, "/users/me", callback);
+  HttpHandler *posts = router.Insert(GET, "/users/:id/posts/:post", callback);
+  HttpHandler *files = router.Insert(GET, "/files/*path", callback);
+  CHECK(users != nullptr && user != nullptr && update != nullptr &&
+        me != nullptr && posts != nullptr && files != nullptr);
+  CHECK(router.Insert(GET, "/users/:id", callback) == nullptr);
+  CHECK(router.Insert(GET, "/users/:name/likes", callback) == nullptr);
+  CHECK(router.Insert(GET, "/files/*path/more", callback) == nullptr);
+  CHECK(router.Insert(GET, "relative", callback) == nullptr);
+
+  HttpRequest request;
+  HttpRoute route = Route(router, GET, "/users?page=2", request);
+  CHECK(route.handler == users && route.status == OK);
+  route = Route(router, GET, "/users/42", request);
+  CHECK(route.handler == user);
+  CHECK(request.GetParameter("id") == "42");
+  route = Route(router, GET, "/users/me", request);
+  CHECK(route.handler == me && request.CountParameters() == 0);
+  route = Route(router, GET, "/users/42/posts/7", request);
+  CHECK(route.handler == posts);
+  CHECK(request.GetParameter("id") == "42");
+  CHECK(request.GetParameter("post") == "7");
+  route = Route(router, GET, "/files/css/site.css", request);
+  CHECK(route.handler == files);
+  CHECK(request.GetParameter("path") == "css/site.css");
+  CHECK(Route(router, GET, "/users/", request).status == NOT_FOUND);
+  CHECK(Route(router, GET, "/users/42/posts", request).status == NOT_FOUND);
+  CHECK(Route(router, GET, "/missing", request).status == NOT_FOUND);
+
+  // Known paths answer other methods with 405 and OPTIONS with 204, both
+  // listing the methods of the path.
+  route = Route(router, DELETE, "/users/42", request);
+  CHECK(route.handler == nullptr && route.status == METHOD_NOT_ALLOWED);
+  CHECK(route.allow == "GET, PUT, OPTIONS");
+  route = Route(router, OPTIONS, "/users/42", request);
+  CHECK(route.handler == nullptr && route.status == NO_CONTENT);
+  CHECK(route.allow == "GET, PUT, OPTIONS");
+  route = Route(router, POST, "/users", request);
+  CHECK(route.status == METHOD_NOT_ALLOWED && route.allow == "GET, OPTIONS");
+  CHECK(Route(router, OPTIONS, "/missing", request).status == NOT_FOUND);
+
+  HttpServer server;
+  server.RegisterHandler(GET, "/status", callback);
+  request.Initialize();
+  request.SetMethod(DELETE);
+  request.SetUrl("/status");
+  HttpResponse response = server.ExecuteHandler(request);
+  CHECK(response.GetStatus() == METHOD_NOT_ALLOWED);
+  CHECK(response.GetHeader(HEADER_ALLOW) == "GET, OPTIONS");
+  request.SetMethod(GET);
+  request.SetUrl("/other");
+  response = server.ExecuteHandler(request);
+  CHECK(response.GetStatus() == NOT_FOUND);
+  CHECK(response.GetHeader(HEADER_ALLOW).empty());
+}
+
+// Streams the body of the payload, handing it over in pieces of the given
+// size and dropping whatever the parser releases, like an upload does.
+HttpStage Stream(std::string_view payload, size_t segment, std::string &body) {
+  size_t head = payload.find("\r\n\r\n") + 4;
+  std::string buffer(payload.substr(0, head));
+  HttpParser parser;
+  HttpRequest request;
+  if (parser.Parse(buffer, request) != BODY) {
+    return parser.GetStage();
+  }
+  parser.ReadHead(buffer, request);
+  request.Own();
+  parser.Stream();
+  body.clear();
+  for (size_t position = head; position < payload.length();
+       position += segment) {
+    buffer.append(payload.substr(position, segment));
+    for (;;) {
+      if (parser.Parse(buffer, request) == FAILED) {
+        return FAILED;
+      }
+      std::string_view fragment = parser.GetFragment();
+      body.append(fragment);
+      buffer.erase(0, parser.Release());
+      if (parser.GetStage() == END) {
+        return buffer.empty() ? END : FAILED;
+      }
+      if (fragment.empty()) {
+        break;
+      }
+    }
+  }
+  return parser.GetStage();
+}
+
+void TestChunked() {
+  const std::string chunked = "POST /upload HTTP/1.1\r\n"
+                              "Transfer-Encoding: chunked\r\n"
+                              "\r\n"
+                              "4\r\nWiki\r\n"
+                              "6;name=value\r\npedia \r\n"
+                              "A\r\nin chunks.\r\n"
+                              "0\r\n"
+                              "Expires: never\r\n"
+                              "\r\n";
+  const std::string expected = "Wikipedia in chunks.";
+  for (size_t segment : {chunked.length(), (size_t)5, (size_t)1}) {
+    HttpParser parser;
+    HttpRequest request;
+    CHECK(Feed(parser, request, chunked, segment) == END);
+    CHECK(request.GetBody() == expected);
+    CHECK(parser.GetLength() == chunked.length());
+    std::string body;
+    CHECK(Stream(chunked, segment, body) == END);
+    CHECK(body == expected);
+  }
+
+  const std::string pipelined = chunked + "GET / HTTP/1.1\r\n\r\n";
+  HttpParser parser;
+  HttpRequest request;
+  CHECK(Feed(parser, request, pipelined) == END);
+  CHECK(request.GetBody() == expected);
+  CHECK(parser.GetLength() == chunked.length());
+
+  const std::string sized = "POST /upload HTTP/1.1\r\n"
+                            "Content-Length: 20\r\n"
+                            "\r\n" +
+                            expected;
+  std::string body;
+  CHECK(Stream(sized, 3, body) == END);
+  CHECK(body == expected);
+
+  const std::string head = "POST / HTTP/1.1\r\nTransfer-Encoding: chunked\r\n"
+                           "\r\n";
+  CHECK(Status(head + "0\r\n\r\n") == OK);
+  CHECK(Status(head + "3\r\nabc\r\n0\r\n\r\n") == OK);
+  CHECK(Status(head + "x\r\nabc\r\n0\r\n\r\n") == BAD_REQUEST);
+  CHECK(Status(head + "\r\nabc\r\n0\r\n\r\n") == BAD_REQUEST);
+  CHECK(Status(head + "3\r\nabcd\r\n0\r\n\r\n") == BAD_REQUEST);
+  CHECK(Status(head + "fffffffffffffffff\r\n") == BAD_REQUEST);
+  CHECK(Status(head + "1000001\r\n") == BAD_REQUEST);
+  CHECK(Status(head + std::string(kHttpMaximumChunkLine + 1, '1')) ==
+        BAD_REQUEST);
+  CHECK(Status(head + "0\r\nX-Trailer: " +
+               std::string(kHttpMaximumChunkLine, 'a')) == BAD_REQUEST);
+  CHECK(Status(head + "0\r\nX-Trailer: value\r\n\r\n") == OK);
+  CHECK(Stream(head + "0\r\nX-Trailer: value\r\n\r\n", 3, body) == END);
+  CHECK(Stream(head + "3\r\nabcd\r\n0\r\n\r\n", 4, body) == FAILED);
+}
+
+// Takes everything queued in the writer as one string.
+std::string Drain(TcpWriter &writer) {
+  struct iovec vector[kTcpMaximumSegments];
+  bool more = false;
+  size_t count = writer.Gather(vector, kTcpMaximumSegments, more);
+  std::string data;
+  for (size_t i = 0; i < count; i++) {
+    data.append((const char *)vector[i].iov_base, vector[i].iov_len);
+  }
+  writer.Reset();
+  return data;
+}
+
+HttpRequest MakeRequest(HttpMethod method, std::string_view url) {
+  HttpRequest request;
+  request.SetMethod(method);
+  request.SetUrl(url);
+  return request;
+}
+
+void TestCache() {
+  HttpResponse response = HttpResponse::Build(OK, "cached");
+  response.AddHeader(HEADER_CONTENT_TYPE, "text/plain");
+  TcpWriter writer(nullptr);
+
+  HttpResponseCache cache(kHttpCacheTimeToLive, kHttpCacheCapacity,
+                          {"Accept-Language"});
+  HttpRequest request = MakeRequest(GET, "/items?page=1");
+  request.AddHeader("Accept-Language", "en");
+  CHECK(!cache.Respond(request, ENCODING_IDENTITY, &writer, true));
+  cache.Store(request, ENCODING_IDENTITY, response);
+  CHECK(cache.Count() == 1);
+  CHECK(cache.Respond(request, ENCODING_IDENTITY, &writer, true));
+  std::string replay = Drain(writer);
+  CHECK(StringStartsWith(replay, "HTTP/1.1 200 OK\r\n"));
+  CHECK(StringStopsWith(replay, "\r\n\r\ncached"));
+  CHECK(replay.find("date: ") != std::string::npos);
+  CHECK(replay.find("connection: close") == std::string::npos);
+  CHECK(cache.Respond(request, ENCODING_IDENTITY, &writer, false));
+  CHECK(Drain(writer).find("connection: close\r\n\r\n") !=
+        std::string::npos);
+
+  // The method, the full URL, the encoding and the key headers select the
+  // entry, other headers do not.
+  HttpRequest other = MakeRequest(GET, "/items?page=1");
+  other.AddHeader("Accept-Language", "en");
+  other.AddHeader("User-Agent", "test");
+  CHECK(cache.Respond(other, ENCODING_IDENTITY, &writer, true));
+  CHECK(!cache.Respond(other, ENCODING_GZIP, &writer, true));
+  other = MakeRequest(GET, "/items?page=2");
+  other.AddHeader("Accept-Language", "en");
+  CHECK(!cache.Respond(other, ENCODING_IDENTITY, &writer, true));
+  other = MakeRequest(HEAD, "/items?page=1");
+  other.AddHeader("Accept-Language", "en");
+  CHECK(!cache.Respond(other, ENCODING_IDENTITY, &writer, true));
+  other = MakeRequest(GET, "/items?page=1");
+  other.AddHeader("Accept-Language", "de");
+  CHECK(!cache.Respond(other, ENCODING_IDENTITY, &writer, true));
+  Drain(writer);
+
+  // Credentials that are not part of the key bypass the cache both ways.
+  other = MakeRequest(GET, "/items?page=1");
+  other.AddHeader("Accept-Language", "en");
+  other.AddHeader("Cookie", "session=1");
+  CHECK(!cache.Respond(other, ENCODING_IDENTITY, &writer, true));
+  other = MakeRequest(GET, "/private");
+  other.AddHeader("Authorization", "Bearer a");
+  cache.Store(other, ENCODING_IDENTITY, response);
+  CHECK(cache.Count() == 1);
+
+  HttpResponseCache keyed(kHttpCacheTimeToLive, kHttpCacheCapacity,
+                          {"Authorization"});
+  keyed.Store(other, ENCODING_IDENTITY, response);
+  CHECK(keyed.Respond(other, ENCODING_IDENTITY, &writer, true));
+  HttpRequest stranger = MakeRequest(GET, "/private");
+  stranger.AddHeader("Authorization", "Bearer b");
+  CHECK(!keyed.Respond(stranger, ENCODING_IDENTITY, &writer, true));
+  Drain(writer);
+
+  HttpResponse cookie = HttpResponse::Build(OK, "cookie");
+  cookie.AddHeader(HEADER_SET_COOKIE, "session=1");
+  HttpResponse restricted = HttpResponse::Build(OK, "private");
+  restricted.AddHeader(HEADER_CACHE_CONTROL, "max-age=60, Private");
+  HttpResponse missing = HttpResponse::Build(NOT_FOUND);
+  cache.Invalidate();
+  for (const HttpResponse &refused : {cookie, restricted, missing}) {
+    cache.Store(request, ENCODING_IDENTITY, refused);
+  }
+  CHECK(cache.Count() == 0);
+
+  cache.Store(request, ENCODING_IDENTITY, response);
+  cache.Store(other, ENCODING_IDENTITY, response);
+  cache.Invalidate("/items");
+  CHECK(cache.Count() == 0);
+
+  // Entries expire after their time to live and the least recently used
+  // one makes room for a new entry.
+  HttpResponseCache expiring(1, kHttpCacheCapacity, {});
+  expiring.Store(request, ENCODING_IDENTITY, response);
+  usleep(5000);
+  CHECK(!expiring.Respond(request, ENCODING_IDENTITY, &writer, true));
+  CHECK(expiring.Count() == 0);
+
+  cache.Store(MakeRequest(GET, "/a"), ENCODING_IDENTITY, response);
+  HttpResponseCache small(kHttpCacheTimeToLive, 2 * cache.GetSize(), {});
+  small.Store(MakeRequest(GET, "/a"), ENCODING_IDENTITY, response);
+  small.Store(MakeRequest(GET, "/b"), ENCODING_IDENTITY, response);
+  CHECK(small.Respond(MakeRequest(GET, "/a"), ENCODING_IDENTITY, &writer,
+                      true));
+  small.Store(MakeRequest(GET, "/c"), ENCODING_IDENTITY, response);
+  CHECK(small.Count() == 2);
+  CHECK(small.Respond(MakeRequest(GET, "/a"), ENCODING_IDENTITY, &writer,
+                      true));
+  CHECK(!small.Respond(MakeRequest(GET, "/b"), ENCODING_IDENTITY, &writer,
+                       true));
+  Drain(writer);
+}
+
+ContentEncoding Negotiate(std::string_view accept) {
+  HttpRequest request = MakeRequest(GET, "/");
+  request.AddHeader("Accept-Encoding", accept);
+  return HttpCompression::Negotiate(request);
+}
+
+void TestCompression() {
+  CHECK(Negotiate("") == ENCODING_IDENTITY);
+  CHECK(Negotiate("gzip") == ENCODING_GZIP);
+  CHECK(Negotiate("deflate, gzip") == ENCODING_GZIP);
+  CHECK(Negotiate("gzip;q=0.5, deflate") == ENCODING_DEFLATE);
+  CHECK(Negotiate("x-gzip;q=0.8, deflate;q=0.2") == ENCODING_GZIP);
+  CHECK(Negotiate("gzip;q=0, *") == ENCODING_DEFLATE);
+  CHECK(Negotiate("*") == ENCODING_GZIP);
+  CHECK(Negotiate("*;q=0") == ENCODING_IDENTITY);
+  CHECK(Negotiate("br") == ENCODING_IDENTITY);
+  CHECK(HttpCompression::IsCompressible("text/html; charset=utf-8"));
+  CHECK(HttpCompression::IsCompressible("application/json"));
+  CHECK(HttpCompression::IsCompressible("application/problem+json"));
+  CHECK(HttpCompression::IsCompressible("image/svg+xml"));
+  CHECK(!HttpCompression::IsCompressible("image/png"));
+  CHECK(!HttpCompression::IsCompressible("application/json-seq"));
+}
+
+void TestAdmission() {
+  HttpAdmission disabled(0, 100);
+  CHECK(disabled.Admit(10000000, 1));
+  CHECK(disabled.Admit(10000000, 1000000));
+  CHECK(!disabled.IsOverloaded());
+
+  // Delays in microseconds against a target of 5ms per interval of 100ms.
+  HttpAdmission admission(5, 100);
+  CHECK(admission.GetTarget() == 5 && admission.GetInterval() == 100);
+  size_t admitted = 0;
+  for (long now = 1; now <= 1000000; now += 1000) {
+    admitted += admission.Admit(now % 3 == 0 ? 20000 : 2000, now);
+  }
+  CHECK(admitted == 1000);
+  CHECK(!admission.IsOverloaded());
+
+  // A queue that never drains below the target during a whole interval is
+  // standing, then only requests up to twice the target get through.
+  HttpAdmission standing(5, 100);
+  admitted = 0;
+  for (long now = 1; now <= 100001; now += 1000) {
+    admitted += standing.Admit(8000, now);
+  }
+  CHECK(admitted == 101);
+  CHECK(!standing.IsOverloaded());
+  CHECK(standing.Admit(8000, 100002));
+  CHECK(standing.IsOverloaded());
+  CHECK(!standing.Admit(20000, 100003));
+  CHECK(standing.Admit(10000, 100004));
+
+  // One request that waited less than the target ends the overload once
+  // the interval is over.
+  CHECK(standing.Admit(1000, 100005));
+  CHECK(!standing.Admit(20000, 100006));
+  CHECK(standing.Admit(20000, 200003));
+  CHECK(!standing.IsOverloaded());
+
+  standing.Configure(0, 100);
+  CHECK(standing.Admit(20000, 200004));
+}
+
+void TestRateLimiter() {
+  // Ten requests per second with bursts of three, the clock is passed in
+  // milliseconds.
+  HttpRateLimiter limiter(10.0, 3);
+  HttpRequest request = MakeRequest(GET, "/");
+  CHECK(limiter.GetRate() == 10.0 && limiter.GetBurst() == 3);
+  for (int i = 0; i < 3; i++) {
+    CHECK(limiter.Acquire("10.0.0.1", request, 1000) == 0);
+  }
+  CHECK(limiter.Acquire("10.0.0.1", request, 1000) == 100);
+  CHECK(limiter.Acquire("10.0.0.1", request, 1040) == 60);
+  CHECK(limiter.Acquire("10.0.0.2", request, 1040) == 0);
+  CHECK(limiter.Acquire("10.0.0.1", request, 1100) == 0);
+  CHECK(limiter.Acquire("10.0.0.1", request, 1100) > 0);
+  // Idle clients refill up to the burst and no further.
+  for (int i = 0; i < 3; i++) {
+    CHECK(limiter.Acquire("10.0.0.1", request, 60000) == 0);
+  }
+  CHECK(limiter.Acquire("10.0.0.1", request, 60000) > 0);
+
+  // With a header the bucket belongs to the address and the header value.
+  HttpRateLimiter keyed(1.0, 1, "X-Api-Key");
+  HttpRequest first = MakeRequest(GET, "/");
+  first.AddHeader("X-Api-Key", "first");
+  HttpRequest second = MakeRequest(GET, "/");
+  second.AddHeader("x-api-key", "second");
+  CHECK(keyed.Acquire("10.0.0.1", first, 1000) == 0);
+  CHECK(keyed.Acquire("10.0.0.1", first, 1000) == 1000);
+  CHECK(keyed.Acquire("10.0.0.1", second, 1000) == 0);
+  CHECK(keyed.Acquire("10.0.0.2", first, 1000) == 0);
+  CHECK(HttpRateLimiter::GetKey("10.0.0.1", "first") !=
+        HttpRateLimiter::GetKey("10.0.0.1", "second"));
+
+  // The table keeps its size, clients that have been idle the longest
+  // lose their bucket and start over with a full one.
+  HttpRateLimiter small(1.0, 1, kStringEmpty, 1);
+  CHECK(small.GetCapacity() == kHttpRateLimitShards * kHttpRateLimitWays);
+  CHECK(small.Acquire("client-0", request, 1000) == 0);
+  CHECK(small.Acquire("client-0", request, 1000) > 0);
+  for (size_t i = 1; i < 100 * small.GetCapacity(); i++) {
+    small.Acquire("client-" + std::to_string(i), request, 1000 + i);
+  }
+  CHECK(small.Acquire("client-0", request, 1000) == 0);
+
+  HttpServer server;
+  server.SetRateLimit(5.0, 10);
+  CHECK(server.GetRateLimiter() != nullptr);
+  CHECK(server.GetRateLimiter()->GetBurst() == 10);
+  HttpResponse response = server.Throttle(1500);
+  CHECK(response.GetStatus() == TOO_MANY_REQUESTS);
+  CHECK(response.GetHeader(HEADER_RETRY_AFTER) == "2");
+  server.SetRateLimit(0.0, 10);
+  CHECK(server.GetRateLimiter() == nullptr);
+}
+
+// Serves pipelined requests over loopback on the given backend. The pooled
+// handler answers through the event descriptor of the reactor, and an idle
+// server has to leave the CPU alone while its timer keeps ticking.
+void TestServe(HttpBackend backend, const std::string &service) {
+  HttpServer server;
+  server.SetBackend(backend);
+  server.SetWorkers(2);
+  server.RegisterHandler(GET, "/", [](const HttpRequest &request) {
+    return HttpResponse::Build(OK, "inline");
+  });
+  server
+      .RegisterHandler(GET, "/pooled",
+                       [](const HttpRequest &request) {
+                         usleep(1000);
+                         return HttpResponse::Build(OK, "pooled");
+                       })
+      ->SetExecution(EXECUTE_POOLED);
+  server.RegisterHandler(POST, "/echo", [](const HttpRequest &request) {
+    return HttpResponse::Build(OK, std::string(request.GetBody()));
+  });
+  std::thread thread([&]() { server.Serve(service, kTcpLocalHost); });
+
+  TcpSocket client;
+  for (int i = 0; i < 100 && !client.Connect(service, kTcpLocalHost); i++) {
+    usleep(10000);
+  }
+  CHECK(client.IsConnected() && client.Unblock());
+  struct timespec start, stop;
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &start);
+  usleep(600000);
+  clock_gettime(CLOCK_PROCESS_CPUTIME_ID, &stop);
+  CHECK((stop.tv_sec - start.tv_sec) * 1000 +
+            (stop.tv_nsec - start.tv_nsec) / 1000000 <
+        100);
+
+  std::string requests = "GET / HTTP/1.1\r\n\r\n"
+                         "GET /pooled HTTP/1.1\r\n\r\n"
+                         "POST /echo HTTP/1.1\r\n"
+                         "Transfer-Encoding: chunked\r\n\r\n"
+                         "5\r\nhello\r\n0\r\n\r\n"
+                         "DELETE / HTTP/1.1\r\n"
+                         "Connection: close\r\n\r\n";
+  CHECK(client.Send(requests, 1000) == SUCCESS);
+  std::string responses;
+  CHECK(client.Receive(responses, 2000) == DISCONNECT);
+  size_t inline_body = responses.find("\r\n\r\ninline");
+  size_t pooled_body = responses.find("\r\n\r\npooled");
+  size_t echo_body = responses.find("\r\n\r\nhello");
+  size_t rejected = responses.find("HTTP/1.1 405");
+  CHECK(StringStartsWith(responses, "HTTP/1.1 200 OK\r\n"));
+  CHECK(inline_body < pooled_body && pooled_body < echo_body &&
+        echo_body < rejected && rejected != std::string::npos);
+  CHECK(responses.find("connection: close", rejected) != std::string::npos);
+
+  server.Stop();
+  thread.join();
+}
+
+void WriteFile(const std::string &path, const std::string &content) {
+  FILE *file = fopen(path.c_str(), "w");
+  fwrite(content.data(), 1, content.length(), file);
+  fclose(file);
+}
+
+HttpResponse Fetch(HttpRouter &router, std::string_view url,
+                   std::string_view header = std::string_view(),
+                   std::string_view value = std::string_view()) {
+  HttpRequest request;
+  HttpRoute route = Route(router, GET, url, request);
+  if (!header.empty()) {
+    request.AddHeader(header, value);
+  }
+  return route.handler == nullptr ? HttpResponse::Build(route.status)
+                                  : route.handler->Execute(request);
+}
+
+void TestFiles() {
+  char directory[] = "/tmp/unittest-XXXXXX";
+  CHECK(mkdtemp(directory) != nullptr);
+  std::string root = directory;
+  mkdir((root + "/sub").c_str(), 0700);
+  WriteFile(root + "/index.html", "<p>index</p>");
+  WriteFile(root + "/sub/page.txt", "page");
+  std::string document;
+  while (document.length() < 4 * kHttpCompressionMinimum) {
+    document += "{\"id\":" + std::to_string(document.length()) + "},";
+  }
+  WriteFile(root + "/data.json", document);
+
+  ThreadPool pool;
+  pool.Start(1);
+  HttpFileCache files(root, &pool);
+  HttpRouter router;
+  router.Insert(GET, "/static/*path", [&files](const HttpRequest &request) {
+    return files.Serve(request);
+  });
+
+  HttpResponse response = Fetch(router, "/static/sub/page.txt");
+  CHECK(response.GetStatus() == OK && response.HasFile());
+  CHECK(response.GetHeader(HEADER_CONTENT_LENGTH) == "4");
+  CHECK(StringStartsWith(std::string(response.GetHeader(HEADER_CONTENT_TYPE)),
+                         "text/plain"));
+  CHECK(Fetch(router, "/static/").GetStatus() == OK);
+  CHECK(Fetch(router, "/static/missing.txt").GetStatus() == NOT_FOUND);
+  CHECK(Fetch(router, "/static/sub").GetStatus() == NOT_FOUND);
+  CHECK(Fetch(router, "/static/../unittest.cc").GetStatus() == NOT_FOUND);
+  CHECK(Fetch(router, "/static/sub/../index.html").GetStatus() == NOT_FOUND);
+  CHECK(Fetch(router, "/static/sub/..").GetStatus() == NOT_FOUND);
+  CHECK(Fetch(router, "/static/..foo").GetStatus() == NOT_FOUND);
+
+  // Conditional requests are answered without a body.
+  std::string tag(response.GetHeader(HEADER_ETAG));
+  std::string modified(response.GetHeader(HEADER_LAST_MODIFIED));
+  response = Fetch(router, "/static/sub/page.txt", "If-None-Match", tag);
+  CHECK(response.GetStatus() == NOT_MODIFIED && !response.HasFile());
+  CHECK(response.GetHeader(HEADER_CONTENT_LENGTH).empty());
+  CHECK(Fetch(router, "/static/sub/page.txt", "If-None-Match",
+              "\"other\", W/" + tag)
+            .GetStatus() == NOT_MODIFIED);
+  CHECK(Fetch(router, "/static/sub/page.txt", "If-None-Match", "\"other\"")
+            .GetStatus() == OK);
+  CHECK(Fetch(router, "/static/sub/page.txt", "If-Modified-Since", modified)
+            .GetStatus() == NOT_MODIFIED);
+  CHECK(Fetch(router, "/static/sub/page.txt", "If-Modified-Since",
+              HttpConstants::FormatDate(0))
+            .GetStatus() == OK);
+
+  // The compressed variant is built on the pool and then shared by every
+  // response instead of being copied.
+  response = Fetch(router, "/static/data.json", "Accept-Encoding", "gzip");
+  CHECK(response.HasFile());
+  CHECK(response.GetHeader(HEADER_CONTENT_ENCODING).empty());
+  for (int i = 0; i < 100 && response.HasFile(); i++) {
+    usleep(10000);
+    response = Fetch(router, "/static/data.json", "Accept-Encoding", "gzip");
+  }
+  HttpResponse again =
+      Fetch(router, "/static/data.json", "Accept-Encoding", "gzip");
+  CHECK(response.GetHeader(HEADER_CONTENT_ENCODING) == "gzip");
+  CHECK(&response.GetBody() == &again.GetBody());
+  CHECK(response.GetHeader(HEADER_CONTENT_LENGTH) ==
+        std::to_string(response.GetBody().length()));
+  CHECK(StringStartsWith(response.GetBody(), "\x1f\x8b"));
+  TcpWriter writer(nullptr);
+  response.WriteTo(&writer);
+  CHECK(StringStopsWith(Drain(writer), again.GetBody()));
+
+  // Files are evicted in the order they were last used. An entry that is
+  // still cached serves its open descriptor after the file is gone.
+  for (size_t i = 0; i <= kHttpFileCacheSize; i++) {
+    WriteFile(root + "/" + std::to_string(i), "file");
+  }
+  for (size_t i = 0; i < kHttpFileCacheSize; i++) {
+    Fetch(router, "/static/" + std::to_string(i));
+  }
+  Fetch(router, "/static/0");
+  Fetch(router, "/static/" + std::to_string(kHttpFileCacheSize));
+  for (size_t i = 0; i <= kHttpFileCacheSize; i++) {
+    unlink((root + "/" + std::to_string(i)).c_str());
+  }
+  CHECK(Fetch(router, "/static/0").GetStatus() == OK);
+  CHECK(Fetch(router, "/static/1").GetStatus() == NOT_FOUND);
+  CHECK(Fetch(router, "/static/2").GetStatus() == OK);
+
+  pool.Stop();
+  unlink((root + "/index.html").c_str());
+  unlink((root + "/sub/page.txt").c_str());
+  unlink((root + "/data.json").c_str());
+  rmdir((root + "/sub").c_str());
+  rmdir(directory);
+}
+
+int main(int argc, char **argv) {
+  TestParser();
+  TestRouter();
+  TestChunked();
+  TestCache();
+  TestCompression();
+  TestAdmission();
+  TestRateLimiter();
+  TestFiles();
+  TestServe(BACKEND_EPOLL, "18080");
+  TestServe(BACKEND_URING, "18081");
+
+  printf("%lu checks, %lu failed\n", checks, failures);
+  return failures == 0 ? 0 : 1;
+}
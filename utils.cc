@@ -48,12 +48,21 @@ bool StringStartsWith(const std::string &text, const std::string &token) {
 }
 
 bool StringStopsWith(const std::string &text, const std::string &token) {
-  if (text.rfind(token) == 0) {
+  if (text.length() >= token.length() &&
+      text.compare(text.length() - token.length(), token.length(), token) ==
+          0) {
     return true;
   }
   return false;
 }
 
+bool StringEqualsNoCase(std::string_view text, std::string_view token) {
+  if (text.length() != token.length()) {
+    return false;
+  }
+  return strncasecmp(text.data(), token.data(), text.length()) == 0;
+}
+
 std::string StringToLower(const std::string &text) {
   std::string lowercase = text;
   std::transform(lowercase.begin(), lowercase.end(), lowercase.begin(),
@@ -311,6 +320,18 @@ long TimeEpochMilliseconds() {
   return epoch.tv_sec * 1000 + epoch.tv_usec / 1000;
 }
 
+long TimeMonotonicMilliseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+long TimeMonotonicMicroseconds() {
+  struct timespec now;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
 bool IsDirectory(const std::string &path) {
   struct stat info;
   if (stat(path.c_str(), &info) == 0 && info.st_mode & S_IFDIR) {
@@ -25,16 +25,20 @@ SOFTWARE. */
 #include <algorithm>
 #include <cstdlib>
 #include <limits>
+#include <new>
 #include <string>
+#include <string_view>
 #include <vector>
 
 #include <dirent.h>
 #include <fcntl.h>
 #include <string.h>
+#include <strings.h>
 #include <sys/file.h>
 #include <sys/stat.h>
 #include <sys/time.h>
 #include <sys/types.h>
+#include <time.h>
 #include <unistd.h>
 
 const std::string kStringEmpty = "";
@@ -46,11 +50,116 @@ const std::string kStringTab = "\t";
 const std::string kStringSlash = "/";
 const std::string kStringColon = ":";
 
+// Vector that keeps its first N elements inline and only moves them to the
+// heap once it grows beyond that. Elements stay contiguous either way, and
+// clear keeps the heap capacity for the next use. Inline slots are raw
+// storage, so constructing an empty vector costs nothing per slot.
+template <typename T, size_t N> class SmallVector {
+public:
+  SmallVector() : size_(0), spilled_(false) {}
+  SmallVector(const SmallVector &other) : size_(0), spilled_(false) {
+    *this = other;
+  }
+  SmallVector(SmallVector &&other) : size_(0), spilled_(false) {
+    *this = std::move(other);
+  }
+  ~SmallVector() { clear(); }
+  SmallVector &operator=(const SmallVector &other) {
+    if (this == &other) {
+      return *this;
+    }
+    clear();
+    for (const T *it = other.begin(); it != other.end(); it++) {
+      push_back(*it);
+    }
+    return *this;
+  }
+  SmallVector &operator=(SmallVector &&other) {
+    if (this == &other) {
+      return *this;
+    }
+    clear();
+    if (other.spilled_) {
+      overflow_ = std::move(other.overflow_);
+      spilled_ = true;
+      size_ = other.size_;
+      other.overflow_.clear();
+      other.spilled_ = false;
+      other.size_ = 0;
+      return *this;
+    }
+    for (T *it = other.begin(); it != other.end(); it++) {
+      push_back(std::move(*it));
+    }
+    other.clear();
+    return *this;
+  }
+  T *begin() { return spilled_ ? overflow_.data() : GetInline(); }
+  T *end() { return begin() + size_; }
+  const T *begin() const {
+    return spilled_ ? overflow_.data() : GetInline();
+  }
+  const T *end() const { return begin() + size_; }
+  T &operator[](size_t index) { return begin()[index]; }
+  const T &operator[](size_t index) const { return begin()[index]; }
+  T &back() { return begin()[size_ - 1]; }
+  size_t size() const { return size_; }
+  bool empty() const { return size_ == 0; }
+  void push_back(T item) {
+    if (!spilled_ && size_ == N) {
+      overflow_.reserve(2 * N);
+      for (size_t i = 0; i < N; i++) {
+        overflow_.push_back(std::move(GetInline()[i]));
+        GetInline()[i].~T();
+      }
+      spilled_ = true;
+    }
+    if (spilled_) {
+      overflow_.push_back(std::move(item));
+    } else {
+      new (GetInline() + size_) T(std::move(item));
+    }
+    size_++;
+  }
+  void pop_back() {
+    size_--;
+    if (spilled_) {
+      overflow_.pop_back();
+    } else {
+      GetInline()[size_].~T();
+    }
+  }
+  void erase(T *position) {
+    std::move(position + 1, end(), position);
+    pop_back();
+  }
+  void clear() {
+    if (spilled_) {
+      overflow_.clear();
+      spilled_ = false;
+    } else {
+      for (size_t i = 0; i < size_; i++) {
+        GetInline()[i].~T();
+      }
+    }
+    size_ = 0;
+  }
+
+private:
+  T *GetInline() { return reinterpret_cast<T *>(storage_); }
+  const T *GetInline() const { return reinterpret_cast<const T *>(storage_); }
+  alignas(T) unsigned char storage_[sizeof(T) * N];
+  std::vector<T> overflow_;
+  size_t size_;
+  bool spilled_;
+};
+
 bool StringContains(const std::string &text, const std::string &token);
 bool StringContains(const std::string &text, const std::string &token,
                     size_t start);
 bool StringStartsWith(const std::string &text, const std::string &token);
 bool StringStopsWith(const std::string &text, const std::string &token);
+bool StringEqualsNoCase(std::string_view text, std::string_view token);
 std::string StringToLower(const std::string &text);
 std::string StringToUpper(const std::string &text);
 size_t StringPosition(const std::string &text, const std::string &token,
@@ -81,6 +190,8 @@ std::string FileToString(const std::string &filename);
 void StringToFile(const std::string &filename, const std::string &content);
 long TimeElapsedMilliseconds(struct timeval *from, struct timeval *to);
 long TimeEpochMilliseconds();
+long TimeMonotonicMilliseconds();
+long TimeMonotonicMicroseconds();
 bool IsDirectory(const std::string &path);
 bool IsFile(const std::string &path);
 bool FileExists(const std::string &filename);